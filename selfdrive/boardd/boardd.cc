@@ -14,10 +14,13 @@
 #include <cerrno>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <future>
+#include <mutex>
 #include <thread>
 
 #include "cereal/gen/cpp/car.capnp.h"
@@ -52,6 +55,12 @@
 #define CUTOFF_IL 400
 #define SATURATE_IL 1000
 #define NIBBLE_TO_HEX(n) ((n) < 10 ? (n) + '0' : ((n) - 10) + 'a')
+
+// words of the arena the can messages are built in, ~1500 CAN FD frames
+#define CAN_MSG_ARENA_WORDS (16 * 1024)
+// reads queued on each panda in the event driven receive mode
+#define CAN_RECV_TRANSFERS 4
+
 using namespace std::chrono_literals;
 
 std::atomic<bool> ignition(false);
@@ -212,8 +221,41 @@ void can_send_thread(std::vector<Panda *> pandas, bool fake_send) {
   assert(subscriber != NULL);
   subscriber->setTimeout(100);
 
+  // the messages are split by panda in one pass, each panda packs its messages into its TX queue, which is
+  // written by a thread of its own. a slow panda does not hold up the others.
+  std::array<int, 256> bus_panda;
+  bus_panda.fill(-1);
+  for (int i = 0; i < pandas.size(); ++i) {
+    for (int bus = pandas[i]->bus_offset; bus < std::min<int>(pandas[i]->bus_offset + PANDA_BUS_CNT, bus_panda.size()); ++bus) {
+      bus_panda[bus] = i;
+    }
+  }
+  std::vector<std::vector<cereal::CanData::Reader>> panda_msgs(pandas.size());
+
+  std::atomic<bool> stop = false;
+  std::vector<std::thread> writers;
+  for (auto panda : pandas) {
+    writers.emplace_back([panda, &stop]() {
+      util::set_thread_name("boardd_can_tx");
+      panda->can_tx_loop(stop);
+    });
+  }
+
+  const uint64_t report_interval = 60 * 1000000000ULL;
+  uint64_t last_report_time = nanos_since_boot();
+
   // run as fast as messages come in
   while (!do_exit && check_all_connected(pandas)) {
+    if (nanos_since_boot() - last_report_time >= report_interval) {
+      for (auto panda : pandas) {
+        auto stats = panda->get_can_tx_stats(true);
+        LOG("panda %s can tx: queue depth %zu (max %zu), latency (us) p50 %lu, p90 %lu, p99 %lu, max %lu, %lu chunks, %lu frames dropped",
+            panda->hw_serial().c_str(), stats.queue_depth, stats.max_queue_depth, stats.latency.percentile(0.5), stats.latency.percentile(0.9),
+            stats.latency.percentile(0.99), stats.latency.max_us, stats.latency.count, stats.dropped);
+      }
+      last_report_time = nanos_since_boot();
+    }
+
     std::unique_ptr<Message> msg(subscriber->receive());
     if (!msg) {
       if (errno == EINTR) {
@@ -227,13 +269,56 @@ void can_send_thread(std::vector<Panda *> pandas, bool fake_send) {
 
     //Dont send if older than 1 second
     if ((nanos_since_boot() - event.getLogMonoTime() < 1e9) && !fake_send) {
-      for (const auto& panda : pandas) {
-        LOGT("sending sendcan to panda: %s", (panda->hw_serial()).c_str());
-        panda->can_send(event.getSendcan());
-        LOGT("sendcan sent to panda: %s", (panda->hw_serial()).c_str());
+      for (auto &msgs : panda_msgs) {
+        msgs.clear();
+      }
+      for (auto can : event.getSendcan()) {
+        if (int i = bus_panda[can.getSrc()]; i >= 0) {
+          panda_msgs[i].push_back(can);
+        }
+      }
+      for (int i = 0; i < pandas.size(); ++i) {
+        if (!panda_msgs[i].empty()) {
+          pandas[i]->can_send_queue(panda_msgs[i]);
+        }
       }
     }
   }
+
+  stop = true;
+  for (auto &t : writers) {
+    t.join();
+  }
+}
+
+// capnp needs the first segment of a message builder zeroed, the builder only clears the words it used when done
+static kj::Array<capnp::word> can_msg_arena() {
+  kj::Array<capnp::word> arena = kj::heapArray<capnp::word>(CAN_MSG_ARENA_WORDS + 1);
+  memset(arena.begin(), 0, arena.asBytes().size());
+  return arena;
+}
+
+// builds the can message in arena and publishes it. the first word of the arena is left for the stream header,
+// a message that fits in the arena is sent from there as is.
+template <typename F>
+static void send_can(PubMaster &pm, kj::Array<capnp::word> &arena, bool valid, size_t count, F fill) {
+  capnp::MallocMessageBuilder msg(kj::arrayPtr(arena.begin() + 1, arena.size() - 1));
+  auto evt = msg.initRoot<cereal::Event>();
+  evt.setLogMonoTime(nanos_since_boot());
+  evt.setValid(valid);
+  fill(evt.initCan(count));
+
+  auto segments = msg.getSegmentsForOutput();
+  if (segments.size() == 1 && segments[0].begin() == arena.begin() + 1) {
+    // header of a single segment message: segment count - 1, segment size in words
+    uint32_t *header = (uint32_t *)arena.begin();
+    header[0] = 0;
+    header[1] = segments[0].size();
+    pm.send("can", (capnp::byte *)arena.begin(), (segments[0].size() + 1) * sizeof(capnp::word));
+  } else {
+    auto words = capnp::messageToFlatArray(segments);
+    pm.send("can", words.asBytes().begin(), words.asBytes().size());
+  }
 }
 
 void can_recv_thread(std::vector<Panda *> pandas) {
@@ -245,7 +330,11 @@ void can_recv_thread(std::vector<Panda *> pandas) {
   // run at 100hz
   const uint64_t dt = 10000000ULL;
   uint64_t next_frame_time = nanos_since_boot() + dt;
-  std::vector<can_frame> raw_can_data;
+  std::vector<can_frame_view> raw_can_data;
+
+  // the message is built in the same arena each cycle, the data of a frame is copied once from the receive
+  // buffer of the panda into the message.
+  kj::Array<capnp::word> arena = can_msg_arena();
 
   while (!do_exit && check_all_connected(pandas)) {
     bool comms_healthy = true;
@@ -254,17 +343,13 @@ void can_recv_thread(std::vector<Panda *> pandas) {
       comms_healthy &= panda->can_receive(raw_can_data);
     }
 
-    MessageBuilder msg;
-    auto evt = msg.initEvent();
-    evt.setValid(comms_healthy);
-    auto canData = evt.initCan(raw_can_data.size());
-    for (uint i = 0; i<raw_can_data.size(); i++) {
-      canData[i].setAddress(raw_can_data[i].address);
-      canData[i].setBusTime(raw_can_data[i].busTime);
-      canData[i].setDat(kj::arrayPtr((uint8_t*)raw_can_data[i].dat.data(), raw_can_data[i].dat.size()));
-      canData[i].setSrc(raw_can_data[i].src);
-    }
-    pm.send("can", msg);
+    send_can(pm, arena, comms_healthy, raw_can_data.size(), [&](auto canData) {
+      for (uint i = 0; i<raw_can_data.size(); i++) {
+        canData[i].setAddress(raw_can_data[i].address);
+        canData[i].setDat(kj::arrayPtr(raw_can_data[i].dat, raw_can_data[i].len));
+        canData[i].setSrc(raw_can_data[i].src);
+      }
+    });
 
     uint64_t cur_time = nanos_since_boot();
     int64_t remaining = next_frame_time - cur_time;
@@ -281,6 +366,116 @@ void can_recv_thread(std::vector<Panda *> pandas) {
   }
 }
 
+// event driven alternative to can_recv_thread: a thread per panda reads the frames as they come in, they are
+// published once all pandas sent frames, or when the oldest frame waited for latency_budget_us. an empty
+// message is still sent every 10ms.
+void can_recv_stream_thread(std::vector<Panda *> pandas, uint64_t latency_budget_us) {
+  util::set_thread_name("boardd_can_recv");
+
+  // can = 8006
+  PubMaster pm({"can"});
+
+  const uint64_t heartbeat = 10000000ULL;
+  const uint64_t latency_budget = latency_budget_us * 1000ULL;
+  const uint64_t report_interval = 60 * 1000000000ULL;
+
+  // frames received since the last message, the data is kept in one buffer
+  struct Batch {
+    struct Frame {
+      uint32_t address;
+      uint8_t src;
+      uint8_t len;
+      uint32_t offset;
+      uint64_t recv_time;
+    };
+    std::vector<Frame> frames;
+    std::vector<uint8_t> data;
+    std::vector<bool> received;  // pandas that sent frames
+    bool valid = true;
+
+    void clear(size_t panda_count) {
+      frames.clear();
+      data.clear();
+      received.assign(panda_count, false);
+      valid = true;
+    }
+  };
+
+  std::mutex lock;
+  std::condition_variable cv;
+  Batch pending, batch;
+  pending.clear(pandas.size());
+  std::atomic<bool> stop = false;
+
+  std::vector<std::thread> readers;
+  for (size_t i = 0; i < pandas.size(); ++i) {
+    readers.emplace_back([&, i]() {
+      util::set_thread_name("boardd_can_read");
+      pandas[i]->can_receive_stream(CAN_RECV_TRANSFERS, stop, [&](const std::vector<can_frame_view> &frames, bool healthy) {
+        const uint64_t recv_time = nanos_since_boot();
+        {
+          std::lock_guard lk(lock);
+          for (const auto &f : frames) {
+            pending.frames.push_back({f.address, f.src, f.len, (uint32_t)pending.data.size(), recv_time});
+            pending.data.insert(pending.data.end(), f.dat, f.dat + f.len);
+          }
+          pending.valid &= healthy;
+          pending.received[i] = true;
+        }
+        cv.notify_one();
+      });
+    });
+  }
+
+  kj::Array<capnp::word> arena = can_msg_arena();
+  LatencyHistogram latency;
+  uint64_t last_send_time = nanos_since_boot();
+  uint64_t last_report_time = last_send_time;
+
+  while (!do_exit && check_all_connected(pandas)) {
+    {
+      std::unique_lock lk(lock);
+      while (!do_exit) {
+        uint64_t deadline = last_send_time + heartbeat;
+        if (!pending.frames.empty()) {
+          if (std::all_of(pending.received.begin(), pending.received.end(), [](bool r) { return r; })) break;
+          deadline = std::min(deadline, pending.frames[0].recv_time + latency_budget);
+        }
+        const uint64_t cur_time = nanos_since_boot();
+        if (cur_time >= deadline) break;
+        cv.wait_for(lk, std::chrono::nanoseconds(deadline - cur_time));
+      }
+      std::swap(pending, batch);
+      pending.clear(pandas.size());
+    }
+
+    send_can(pm, arena, batch.valid, batch.frames.size(), [&](auto canData) {
+      for (uint i = 0; i < batch.frames.size(); i++) {
+        const auto &f = batch.frames[i];
+        canData[i].setAddress(f.address);
+        canData[i].setDat(kj::arrayPtr(&batch.data[f.offset], f.len));
+        canData[i].setSrc(f.src);
+      }
+    });
+
+    last_send_time = nanos_since_boot();
+    for (const auto &f : batch.frames) {
+      latency.add(last_send_time - f.recv_time);
+    }
+    if (last_send_time - last_report_time >= report_interval) {
+      LOG("can receive to publish latency (us): p50 %lu, p90 %lu, p99 %lu, max %lu, %lu frames",
+          latency.percentile(0.5), latency.percentile(0.9), latency.percentile(0.99), latency.max_us, latency.count);
+      latency.reset();
+      last_report_time = last_send_time;
+    }
+  }
+
+  stop = true;
+  for (auto &t : readers) {
+    t.join();
+  }
+}
+
 void send_empty_peripheral_state(PubMaster *pm) {
   MessageBuilder msg;
   auto peripheralState  = msg.initEvent().initPeripheralState();
@@ -617,7 +812,11 @@ void boardd_main_thread(std::vector<std::string> serials) {
     threads.emplace_back(peripheral_control_thread, peripheral_panda, getenv("NO_FAN_CONTROL") != nullptr);
 
     threads.emplace_back(can_send_thread, pandas, getenv("FAKESEND") != nullptr);
-    threads.emplace_back(can_recv_thread, pandas);
+    if (const char *budget = getenv("CAN_RECV_LATENCY_BUDGET_US")) {
+      threads.emplace_back(can_recv_stream_thread, pandas, std::strtoull(budget, nullptr, 10));
+    } else {
+      threads.emplace_back(can_recv_thread, pandas);
+    }
 
     for (auto &t : threads) t.join();
   }
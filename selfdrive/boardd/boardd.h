@@ -1,6 +1,12 @@
 #pragma once
 
+#include "common/util.h"
 #include "selfdrive/boardd/panda.h"
 
+extern ExitHandler do_exit;
+
 bool safety_setter_thread(std::vector<Panda *> pandas);
+void can_send_thread(std::vector<Panda *> pandas, bool fake_send);
+void can_recv_thread(std::vector<Panda *> pandas);
+void can_recv_stream_thread(std::vector<Panda *> pandas, uint64_t latency_budget_us);
 void boardd_main_thread(std::vector<std::string> serials);
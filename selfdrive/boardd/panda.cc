@@ -3,22 +3,30 @@
 #include <unistd.h>
 
 #include <cassert>
+#include <chrono>
 #include <stdexcept>
 
 #include "cereal/messaging/messaging.h"
 #include "common/swaglog.h"
+#include "common/timing.h"
 #include "common/util.h"
 
-Panda::Panda(std::string serial, uint32_t bus_offset) : bus_offset(bus_offset) {
+static std::unique_ptr<PandaCommsHandle> connect_handle(const std::string &serial) {
   // try USB first, then SPI
   try {
-    handle = std::make_unique<PandaUsbHandle>(serial);
+    return std::make_unique<PandaUsbHandle>(serial);
   } catch (std::exception &e) {
 #ifndef __APPLE__
-    handle = std::make_unique<PandaSpiHandle>(serial);
+    return std::make_unique<PandaSpiHandle>(serial);
 #endif
+    throw;
   }
+}
+
+Panda::Panda(std::string serial, uint32_t bus_offset) : Panda(connect_handle(serial), bus_offset) {}
 
+Panda::Panda(std::unique_ptr<PandaCommsHandle> comms_handle, uint32_t bus_offset)
+    : handle(std::move(comms_handle)), bus_offset(bus_offset) {
   hw_type = get_hw_type();
 
   assert((hw_type != cereal::PandaState::PandaType::WHITE_PANDA) &&
@@ -198,26 +206,7 @@ void Panda::pack_can_buffer(const capnp::List<cereal::CanData>::Reader &can_data
     if (bus < bus_offset || bus >= (bus_offset + PANDA_BUS_CNT)) {
       continue;
     }
-    auto can_data = cmsg.getDat();
-    uint8_t data_len_code = len_to_dlc(can_data.size());
-    assert(can_data.size() <= 64);
-    assert(can_data.size() == dlc_to_len[data_len_code]);
-
-    can_header header = {};
-    header.addr = cmsg.getAddress();
-    header.extended = (cmsg.getAddress() >= 0x800) ? 1 : 0;
-    header.data_len_code = data_len_code;
-    header.bus = bus - bus_offset;
-    header.checksum = 0;
-
-    memcpy(&send_buf[pos], (uint8_t *)&header, sizeof(can_header));
-    memcpy(&send_buf[pos + sizeof(can_header)], (uint8_t *)can_data.begin(), can_data.size());
-    uint32_t msg_size = sizeof(can_header) + can_data.size();
-
-    // set checksum
-    ((can_header *) &send_buf[pos])->checksum = calculate_checksum(&send_buf[pos], msg_size);
-
-    pos += msg_size;
+    pos += pack_can_frame(cmsg, &send_buf[pos]);
 
     if (pos >= USB_TX_SOFT_LIMIT) {
       write_func(send_buf, pos);
@@ -229,13 +218,47 @@ void Panda::pack_can_buffer(const capnp::List<cereal::CanData>::Reader &can_data
   if (pos > 0) write_func(send_buf, pos);
 }
 
+uint32_t Panda::pack_can_frame(const cereal::CanData::Reader &cmsg, uint8_t *buf) {
+  auto can_data = cmsg.getDat();
+  uint8_t data_len_code = len_to_dlc(can_data.size());
+  assert(can_data.size() <= 64);
+  assert(can_data.size() == dlc_to_len[data_len_code]);
+
+  can_header header = {};
+  header.addr = cmsg.getAddress();
+  header.extended = (cmsg.getAddress() >= 0x800) ? 1 : 0;
+  header.data_len_code = data_len_code;
+  header.bus = cmsg.getSrc() - bus_offset;
+  header.checksum = 0;
+
+  memcpy(buf, (uint8_t *)&header, sizeof(can_header));
+  memcpy(&buf[sizeof(can_header)], (uint8_t *)can_data.begin(), can_data.size());
+  uint32_t msg_size = sizeof(can_header) + can_data.size();
+
+  // set checksum
+  ((can_header *)buf)->checksum = calculate_checksum(buf, msg_size);
+  return msg_size;
+}
+
 void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list) {
   pack_can_buffer(can_data_list, [=](uint8_t* data, size_t size) {
     handle->bulk_write(3, data, size, 5);
   });
 }
 
-bool Panda::can_receive(std::vector<can_frame>& out_vec) {
+bool Panda::can_receive(std::vector<can_frame_view>& out_vec) {
+  // the frames returned by the last call are consumed. the receive buffer is used as a ring: the next read goes
+  // after the incomplete frame at the end, which is only moved to the beginning once no read fits anymore.
+  receive_buffer_start += receive_buffer_parsed;
+  receive_buffer_parsed = 0;
+  if (receive_buffer_start == receive_buffer_size) {
+    receive_buffer_start = receive_buffer_size = 0;
+  } else if (receive_buffer_size + RECV_SIZE > sizeof(receive_buffer)) {
+    receive_buffer_size -= receive_buffer_start;
+    memmove(receive_buffer, &receive_buffer[receive_buffer_start], receive_buffer_size);
+    receive_buffer_start = 0;
+  }
+
   // Check if enough space left in buffer to store RECV_SIZE data
   assert(receive_buffer_size + RECV_SIZE <= sizeof(receive_buffer));
 
@@ -246,61 +269,175 @@ bool Panda::can_receive(std::vector<can_frame>& out_vec) {
   if (recv == RECV_SIZE) {
     LOGW("Panda receive buffer full");
   }
+  if (recv <= 0) {
+    return true;
+  }
+
   receive_buffer_size += recv;
+  return unpack_can_buffer(&receive_buffer[receive_buffer_start], receive_buffer_size - receive_buffer_start,
+                           out_vec, receive_buffer_parsed);
+}
 
-  return (recv <= 0) ? true : unpack_can_buffer(receive_buffer, receive_buffer_size, out_vec);
+void Panda::can_send_queue(const std::vector<cereal::CanData::Reader> &msgs) {
+  const uint64_t queued_time = nanos_since_boot();
+  {
+    std::lock_guard lk(tx_lock);
+    TxChunk *chunk = nullptr;
+    for (const auto &cmsg : msgs) {
+      if (!chunk) {
+        if (tx_count == tx_queue.size()) {
+          ++tx_stats.dropped;
+          LOGW_100("Panda TX queue full");
+          continue;
+        }
+        chunk = &tx_queue[(tx_head + tx_count) % tx_queue.size()];
+        chunk->size = 0;
+        chunk->queued_time = queued_time;
+      }
+
+      chunk->size += pack_can_frame(cmsg, &chunk->data[chunk->size]);
+      if (chunk->size >= USB_TX_SOFT_LIMIT) {
+        ++tx_count;
+        chunk = nullptr;
+      }
+    }
+    if (chunk) ++tx_count;
+    tx_stats.max_queue_depth = std::max(tx_stats.max_queue_depth, tx_count);
+  }
+  tx_cv.notify_one();
+}
+
+void Panda::can_tx_loop(const std::atomic<bool> &stop) {
+  // the writes complete in order, the oldest chunk is done
+  const std::function<void(int)> on_done = [this](int transferred) {
+    {
+      std::lock_guard lk(tx_lock);
+      tx_stats.latency.add(nanos_since_boot() - tx_queue[tx_head].queued_time);
+      tx_head = (tx_head + 1) % tx_queue.size();
+      --tx_count;
+      --tx_writing;
+    }
+    tx_cv.notify_one();
+  };
+
+  std::unique_lock lk(tx_lock);
+  while (!stop && connected()) {
+    while (tx_writing < tx_count && tx_writing < CAN_TX_IN_FLIGHT) {
+      TxChunk &chunk = tx_queue[(tx_head + tx_writing) % tx_queue.size()];
+      ++tx_writing;
+      lk.unlock();
+      handle->bulk_write_async(3, chunk.data, chunk.size, 5, on_done);
+      lk.lock();
+    }
+
+    if (tx_writing > 0) {
+      lk.unlock();
+      handle->handle_events(1000);
+      lk.lock();
+    } else {
+      tx_cv.wait_for(lk, std::chrono::milliseconds(100), [&]() { return tx_count > 0 || stop; });
+    }
+  }
+
+  // wait for the writes in flight, their data is in the queue
+  while (tx_writing > 0) {
+    lk.unlock();
+    handle->handle_events(100000);
+    lk.lock();
+  }
+  tx_head = (tx_head + tx_count) % tx_queue.size();
+  tx_count = 0;
+}
+
+can_tx_stats Panda::get_can_tx_stats(bool reset) {
+  std::lock_guard lk(tx_lock);
+  tx_stats.queue_depth = tx_count;
+  can_tx_stats stats = tx_stats;
+  if (reset) {
+    tx_stats = {};
+  }
+  return stats;
+}
+
+void Panda::can_receive_stream(int in_flight, const std::atomic<bool> &stop,
+                               const std::function<void(const std::vector<can_frame_view> &, bool)> &on_frames) {
+  receive_buffer_start = receive_buffer_size = receive_buffer_parsed = 0;
+  std::vector<can_frame_view> frames;
+  handle->bulk_read_loop(0x81, RECV_SIZE, in_flight, [&](uint8_t *data, int size) {
+    frames.clear();
+    uint32_t pos = 0, parsed = 0;
+    bool ok = true;
+    if (receive_buffer_size > 0) {
+      // complete the frame left over from the last chunk in the receive buffer, the rest is parsed in place
+      const uint32_t n = std::min<uint32_t>(size, sizeof(can_header) + 64);
+      memcpy(&receive_buffer[receive_buffer_size], data, n);
+      ok = unpack_can_buffer(receive_buffer, receive_buffer_size + n, frames, parsed);
+      if (ok && parsed == 0) {
+        // the chunk is shorter than the rest of the frame
+        receive_buffer_size += n;
+        return;
+      }
+      pos = ok ? parsed - receive_buffer_size : size;
+    }
+    if (ok && pos < size) {
+      ok = unpack_can_buffer(&data[pos], size - pos, frames, parsed);
+      pos += parsed;
+    }
+    on_frames(frames, ok && comms_healthy());
+
+    // keep the incomplete frame at the end for the next chunk
+    receive_buffer_size = size - pos;
+    memcpy(receive_buffer, &data[pos], receive_buffer_size);
+  }, stop);
 }
 
 void Panda::can_reset_communications() {
   handle->control_write(0xc0, 0, 0);
 }
 
-bool Panda::unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_frame> &out_vec) {
-  int pos = 0;
+bool Panda::unpack_can_buffer(const uint8_t *data, uint32_t size, std::vector<can_frame_view> &out_vec, uint32_t &parsed) {
+  uint32_t pos = 0;
 
-  while (pos <= size - sizeof(can_header)) {
-    can_header header;
-    memcpy(&header, &data[pos], sizeof(can_header));
-
-    const uint8_t data_len = dlc_to_len[header.data_len_code];
-    if (pos + sizeof(can_header) + data_len > size) {
+  while (pos + sizeof(can_header) <= size) {
+    // the header is decoded in place. the first byte holds the bus and the data length code, the 32 bits after
+    // it the rejected, returned and extended flags followed by the address.
+    const uint8_t *frame = &data[pos];
+    const uint8_t data_len = dlc_to_len[frame[0] >> 4];
+    const uint32_t frame_len = sizeof(can_header) + data_len;
+    if (pos + frame_len > size) {
       // we don't have all the data for this message yet
       break;
     }
 
-    can_frame &canData = out_vec.emplace_back();
-    canData.busTime = 0;
-    canData.address = header.addr;
-    canData.src = header.bus + bus_offset;
-    if (header.rejected) {
-      canData.src += CAN_REJECTED_BUS_OFFSET;
-    }
-    if (header.returned) {
-      canData.src += CAN_RETURNED_BUS_OFFSET;
-    }
-
-    if (calculate_checksum(&data[pos], sizeof(can_header) + data_len) != 0) {
+    if (calculate_checksum(frame, frame_len) != 0) {
       LOGE("Panda CAN checksum failed");
-      size = 0;
+      // drop the buffer
+      parsed = size;
       return false;
     }
 
-    canData.dat.assign((char *)&data[pos + sizeof(can_header)], data_len);
+    uint32_t flags_addr;
+    memcpy(&flags_addr, &frame[1], sizeof(flags_addr));
 
-    pos += sizeof(can_header) + data_len;
-  }
+    can_frame_view &canData = out_vec.emplace_back();
+    canData.address = flags_addr >> 3;
+    canData.src = ((frame[0] >> 1) & 0x7U) + bus_offset;
+    if (flags_addr & 0x1U) {
+      canData.src += CAN_REJECTED_BUS_OFFSET;
+    }
+    if (flags_addr & 0x2U) {
+      canData.src += CAN_RETURNED_BUS_OFFSET;
+    }
+    canData.len = data_len;
+    canData.dat = &frame[sizeof(can_header)];
 
-  // move the overflowing data to the beginning of the buffer for the next round
-  memmove(data, &data[pos], size - pos);
-  size -= pos;
+    pos += frame_len;
+  }
 
+  parsed = pos;
   return true;
 }
 
-uint8_t Panda::calculate_checksum(uint8_t *data, uint32_t len) {
-  uint8_t checksum = 0U;
-  for (uint32_t i = 0U; i < len; i++) {
-    checksum ^= data[i];
-  }
-  return checksum;
+uint8_t Panda::calculate_checksum(const uint8_t *data, uint32_t len) {
+  return xor_checksum(data, len);
 }
@@ -1,10 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <ctime>
 #include <functional>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <vector>
 
@@ -18,10 +23,18 @@
 #define USBPACKET_MAX_SIZE  (0x40)
 
 #define RECV_SIZE (0x4000U)
+// room for several reads, the incomplete frame at the end is moved to the beginning when the next one does not fit
+#define RECV_BUFFER_SIZE (4 * RECV_SIZE)
+
+// chunks of packed frames queued for sending, and writes in flight
+#define CAN_TX_QUEUE_SIZE 64
+#define CAN_TX_IN_FLIGHT 4
 
 #define CAN_REJECTED_BUS_OFFSET   0xC0U
 #define CAN_RETURNED_BUS_OFFSET 0x80U
 
+// unpack_can_buffer decodes the header from its bytes, the layout of the bit fields is the one of a little endian target
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
 struct __attribute__((packed)) can_header {
   uint8_t reserved : 1;
   uint8_t bus : 3;
@@ -40,6 +53,45 @@ struct can_frame {
   long src;
 };
 
+// a frame received from a panda. the data is not copied, dat points into the receive buffer
+// of the panda and stays valid until the next can_receive() of that panda.
+struct can_frame_view {
+  uint32_t address;
+  uint8_t src;
+  uint8_t len;
+  const uint8_t *dat;
+};
+
+// distribution of latencies in 100us buckets, the last bucket counts the ones over 20ms
+struct LatencyHistogram {
+  std::array<uint64_t, 201> buckets = {};
+  uint64_t count = 0;
+  uint64_t max_us = 0;
+
+  void add(uint64_t ns) {
+    const uint64_t us = ns / 1000;
+    ++buckets[std::min<uint64_t>(us / 100, buckets.size() - 1)];
+    ++count;
+    max_us = std::max(max_us, us);
+  }
+  // upper bound of the bucket of percentile p, in us
+  uint64_t percentile(double p) const {
+    uint64_t n = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      n += buckets[i];
+      if (n >= p * count) return std::min<uint64_t>((i + 1) * 100, max_us);
+    }
+    return max_us;
+  }
+  void reset() { *this = {}; }
+};
+
+struct can_tx_stats {
+  size_t queue_depth = 0;  // chunks queued or being written
+  size_t max_queue_depth = 0;
+  uint64_t dropped = 0;  // frames dropped because the queue was full
+  LatencyHistogram latency;  // from queuing a chunk to the completion of its write
+};
 
 class Panda {
 private:
@@ -47,6 +99,8 @@ private:
 
 public:
   Panda(std::string serial="", uint32_t bus_offset=0);
+  // a panda on another comms handle, e.g. PandaSimHandle
+  Panda(std::unique_ptr<PandaCommsHandle> comms_handle, uint32_t bus_offset=0);
 
   cereal::PandaState::PandaType hw_type = cereal::PandaState::PandaType::UNKNOWN;
   bool has_rtc = false;
@@ -80,17 +134,45 @@ public:
   void set_data_speed_kbps(uint16_t bus, uint16_t speed);
   void set_canfd_non_iso(uint16_t bus, bool non_iso);
   void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
-  bool can_receive(std::vector<can_frame>& out_vec);
+  // pipelined send: can_send_queue packs the frames, which have to be on the buses of the panda, into the chunks
+  // of the TX queue. can_tx_loop writes them with up to CAN_TX_IN_FLIGHT writes in flight until stop is set.
+  void can_send_queue(const std::vector<cereal::CanData::Reader> &msgs);
+  void can_tx_loop(const std::atomic<bool> &stop);
+  can_tx_stats get_can_tx_stats(bool reset);
+  bool can_receive(std::vector<can_frame_view>& out_vec);
+  // event driven receive: on_frames is called with the frames of each chunk read from the panda until stop is
+  // set, the frames are valid during the call. the USB handle keeps in_flight reads queued.
+  void can_receive_stream(int in_flight, const std::atomic<bool> &stop,
+                          const std::function<void(const std::vector<can_frame_view> &, bool)> &on_frames);
   void can_reset_communications();
 
 protected:
   // for unit tests
-  uint8_t receive_buffer[RECV_SIZE + sizeof(can_header) + 64];
-  uint32_t receive_buffer_size = 0;
+  uint8_t receive_buffer[RECV_BUFFER_SIZE];
+  uint32_t receive_buffer_start = 0;  // start of the data not consumed yet
+  uint32_t receive_buffer_size = 0;  // end of the received data
+  uint32_t receive_buffer_parsed = 0;  // bytes of the frames returned by the last can_receive()
 
   Panda(uint32_t bus_offset) : bus_offset(bus_offset) {}
   void pack_can_buffer(const capnp::List<cereal::CanData>::Reader &can_data_list,
                          std::function<void(uint8_t *, size_t)> write_func);
-  bool unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_frame> &out_vec);
-  uint8_t calculate_checksum(uint8_t *data, uint32_t len);
+  // appends the complete frames at the beginning of data to out_vec, and returns the size of them in parsed
+  bool unpack_can_buffer(const uint8_t *data, uint32_t size, std::vector<can_frame_view> &out_vec, uint32_t &parsed);
+  uint8_t calculate_checksum(const uint8_t *data, uint32_t len);
+  // packs cmsg at buf, returns the size of the packed frame
+  uint32_t pack_can_frame(const cereal::CanData::Reader &cmsg, uint8_t *buf);
+
+  struct TxChunk {
+    uint8_t data[2 * USB_TX_SOFT_LIMIT];
+    uint32_t size;
+    uint64_t queued_time;
+  };
+  // the queued chunks are [tx_head, tx_head + tx_count) of the ring, the first tx_writing of them are being written
+  std::mutex tx_lock;
+  std::condition_variable tx_cv;
+  std::array<TxChunk, CAN_TX_QUEUE_SIZE> tx_queue;
+  size_t tx_head = 0;
+  size_t tx_count = 0;
+  size_t tx_writing = 0;
+  can_tx_stats tx_stats;
 };
@@ -1,10 +1,15 @@
 #include "selfdrive/boardd/panda.h"
 
 #include <cassert>
+#include <chrono>
 #include <stdexcept>
+#include <thread>
 
 #include "common/swaglog.h"
 
+// an idle endpoint answers a read right away, empty reads are queued again after this delay
+#define READ_POLL_INTERVAL std::chrono::microseconds(500)
+
 static int init_usb_ctx(libusb_context **context) {
   assert(context != nullptr);
 
@@ -83,6 +88,12 @@ PandaUsbHandle::~PandaUsbHandle() {
 }
 
 void PandaUsbHandle::cleanup() {
+  for (auto &write : async_writes) {
+    libusb_free_transfer(write->transfer);
+  }
+  async_writes.clear();
+  free_async_writes.clear();
+
   if (dev_handle) {
     libusb_release_interface(dev_handle, 0);
     libusb_close(dev_handle);
@@ -230,3 +241,203 @@ int PandaUsbHandle::bulk_read(unsigned char endpoint, unsigned char* data, int l
 
   return transferred;
 }
+
+void PandaCommsHandle::bulk_read_loop(unsigned char endpoint, int length, int in_flight,
+                                      const std::function<void(uint8_t *, int)> &on_data, const std::atomic<bool> &stop) {
+  std::vector<uint8_t> buf(length);
+  while (!stop && connected) {
+    int recv = bulk_read(endpoint, buf.data(), length);
+    if (recv > 0) {
+      on_data(buf.data(), recv);
+    } else {
+      std::this_thread::sleep_for(READ_POLL_INTERVAL);
+    }
+  }
+}
+
+namespace {
+
+// the callbacks run on the thread that handles the events of the context, which can be the one of a synchronous
+// transfer. they are serialized by libusb, the lock guards the transfers against the thread of bulk_read_loop.
+// a transfer stays active until its callback is done with it and with the AsyncRead, which bulk_read_loop frees
+// once no transfer is active.
+struct AsyncRead {
+  PandaUsbHandle *handle;
+  const std::function<void(uint8_t *, int)> &on_data;
+  const std::atomic<bool> &stop;
+  std::mutex lock;
+  std::vector<libusb_transfer *> idle;
+  int active = 0;
+};
+
+void LIBUSB_CALL async_read_callback(libusb_transfer *transfer) {
+  auto read = (AsyncRead *)transfer->user_data;
+  bool resubmit = false, reuse = true;
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+      if (transfer->actual_length > 0) {
+        read->on_data(transfer->buffer, transfer->actual_length);
+        // the transfers complete in order, queue it again right away while data is coming in
+        resubmit = !read->stop && read->handle->connected;
+      }
+      break;
+    case LIBUSB_TRANSFER_OVERFLOW:
+      read->handle->comms_healthy = false;
+      LOGE_100("overflow got 0x%x", transfer->actual_length);
+      break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      LOGE("lost connection");
+      read->handle->connected = false;
+      reuse = false;
+      break;
+    case LIBUSB_TRANSFER_CANCELLED:
+      reuse = false;
+      break;
+    default:
+      LOGE_100("usb transfer error %d in %s", transfer->status, __func__);
+      break;
+  }
+
+  std::lock_guard lk(read->lock);
+  if (resubmit && libusb_submit_transfer(transfer) == 0) return;
+
+  if (reuse) {
+    read->idle.push_back(transfer);
+  }
+  --read->active;
+}
+
+}  // namespace
+
+void PandaUsbHandle::bulk_read_loop(unsigned char endpoint, int length, int in_flight,
+                                    const std::function<void(uint8_t *, int)> &on_data, const std::atomic<bool> &stop) {
+  AsyncRead read = {this, on_data, stop};
+  std::unique_lock lk(read.lock);
+  std::vector<uint8_t> buffers(length * in_flight);
+  std::vector<libusb_transfer *> transfers(in_flight);
+  for (int i = 0; i < in_flight; ++i) {
+    transfers[i] = libusb_alloc_transfer(0);
+    libusb_fill_bulk_transfer(transfers[i], dev_handle, endpoint, &buffers[i * length], length, async_read_callback, &read, 0);
+    read.idle.push_back(transfers[i]);
+  }
+
+  auto next_poll = std::chrono::steady_clock::now();
+  while (!stop && connected) {
+    auto now = std::chrono::steady_clock::now();
+    if (!read.idle.empty() && now >= next_poll) {
+      size_t submitted = 0;
+      for (; submitted < read.idle.size(); ++submitted) {
+        int err = libusb_submit_transfer(read.idle[submitted]);
+        if (err != 0) {
+          handle_usb_issue(err, __func__);
+          break;
+        }
+      }
+      read.active += submitted;
+      read.idle.erase(read.idle.begin(), read.idle.begin() + submitted);
+      next_poll = now + READ_POLL_INTERVAL;
+    }
+
+    // completions wake up the loop, it only has to wait for the next poll of the idle transfers
+    auto timeout = read.idle.empty() ? std::chrono::microseconds(100000) : std::chrono::duration_cast<std::chrono::microseconds>(next_poll - now);
+    timeval tv = {0, std::max<long>(timeout.count(), 0)};
+    lk.unlock();
+    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    lk.lock();
+  }
+
+  // the cancelled transfers complete with LIBUSB_TRANSFER_CANCELLED, or LIBUSB_TRANSFER_NO_DEVICE after a disconnect
+  for (auto transfer : transfers) {
+    libusb_cancel_transfer(transfer);
+  }
+  while (read.active > 0) {
+    timeval tv = {0, 100000};
+    lk.unlock();
+    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    lk.lock();
+  }
+  for (auto transfer : transfers) {
+    libusb_free_transfer(transfer);
+  }
+}
+
+void PandaCommsHandle::bulk_write_async(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout,
+                                        const std::function<void(int)> &on_done) {
+  on_done(bulk_write(endpoint, data, length, timeout));
+}
+
+void PandaUsbHandle::bulk_write_async(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout,
+                                      const std::function<void(int)> &on_done) {
+  if (!connected) {
+    on_done(0);
+    return;
+  }
+
+  AsyncWrite *write = nullptr;
+  {
+    std::lock_guard lk(async_write_lock);
+    if (free_async_writes.empty()) {
+      auto &w = async_writes.emplace_back(std::make_unique<AsyncWrite>());
+      w->handle = this;
+      w->transfer = libusb_alloc_transfer(0);
+      free_async_writes.push_back(w.get());
+    }
+    write = free_async_writes.back();
+    free_async_writes.pop_back();
+  }
+
+  write->on_done = on_done;
+  libusb_fill_bulk_transfer(write->transfer, dev_handle, endpoint, data, length, async_write_callback, write, timeout);
+  int err = libusb_submit_transfer(write->transfer);
+  if (err != 0) {
+    handle_usb_issue(err, __func__);
+    {
+      std::lock_guard lk(async_write_lock);
+      free_async_writes.push_back(write);
+    }
+    on_done(0);
+  }
+}
+
+static int transfer_error(libusb_transfer_status status) {
+  switch (status) {
+    case LIBUSB_TRANSFER_ERROR: return LIBUSB_ERROR_IO;
+    case LIBUSB_TRANSFER_STALL: return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_OVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+    case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+    default: return LIBUSB_ERROR_OTHER;
+  }
+}
+
+void LIBUSB_CALL PandaUsbHandle::async_write_callback(libusb_transfer *transfer) {
+  auto write = (AsyncWrite *)transfer->user_data;
+  auto handle = write->handle;
+  if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+    // the panda NAKs while its receive buffer is full, the messages are dropped after the timeout
+    LOGW("Transmit buffer full");
+  } else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+    LOGE("lost connection");
+    handle->connected = false;
+  } else if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    // like bulk_write, the messages are sent again until they go through or the panda disconnects
+    handle->handle_usb_issue(transfer_error(transfer->status), __func__);
+    while (handle->connected) {
+      int err = libusb_submit_transfer(transfer);
+      if (err == 0) return;
+      handle->handle_usb_issue(err, __func__);
+    }
+  }
+
+  auto on_done = std::move(write->on_done);
+  const int transferred = transfer->actual_length;
+  {
+    std::lock_guard lk(handle->async_write_lock);
+    handle->free_async_writes.push_back(write);
+  }
+  on_done(transferred);
+}
+
+void PandaUsbHandle::handle_events(int timeout_us) {
+  timeval tv = {timeout_us / 1000000, timeout_us % 1000000};
+  libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+}
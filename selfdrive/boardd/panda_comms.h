@@ -3,6 +3,10 @@
 #include <mutex>
 #include <atomic>
 #include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
 #ifndef __APPLE__
@@ -15,6 +19,31 @@
 #define TIMEOUT 0
 #define SPI_BUF_SIZE 1024
 
+// XOR of the bytes of data and init, a word at a time
+inline uint8_t xor_checksum(const uint8_t *data, uint32_t len, uint8_t init = 0) {
+  uint64_t word_xor = 0;
+  uint32_t i = 0;
+  for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, &data[i], sizeof(word));
+    word_xor ^= word;
+  }
+  if (i + sizeof(uint32_t) <= len) {
+    uint32_t word;
+    memcpy(&word, &data[i], sizeof(word));
+    word_xor ^= word;
+    i += sizeof(uint32_t);
+  }
+  word_xor ^= word_xor >> 32;
+  word_xor ^= word_xor >> 16;
+  word_xor ^= word_xor >> 8;
+
+  uint8_t checksum = init ^ (uint8_t)word_xor;
+  for (; i < len; i++) {
+    checksum ^= data[i];
+  }
+  return checksum;
+}
 
 // comms base class
 class PandaCommsHandle {
@@ -33,6 +62,16 @@ public:
   virtual int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout=TIMEOUT) = 0;
   virtual int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT) = 0;
   virtual int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT) = 0;
+  // reads endpoint until stop is set, on_data is called with each chunk received. the default
+  // implementation polls bulk_read.
+  virtual void bulk_read_loop(unsigned char endpoint, int length, int in_flight,
+                              const std::function<void(uint8_t *, int)> &on_data, const std::atomic<bool> &stop);
+  // queues a write of data, on_done is called with the number of bytes written once it completes. data has to
+  // stay valid until then. the default implementation writes synchronously.
+  virtual void bulk_write_async(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout,
+                                const std::function<void(int)> &on_done);
+  // waits up to timeout_us for the completion of asynchronous writes
+  virtual void handle_events(int timeout_us) {}
 };
 
 class PandaUsbHandle : public PandaCommsHandle {
@@ -43,6 +82,12 @@ public:
   int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout=TIMEOUT);
   int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
   int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  // keeps in_flight asynchronous transfers queued on the endpoint
+  void bulk_read_loop(unsigned char endpoint, int length, int in_flight,
+                      const std::function<void(uint8_t *, int)> &on_data, const std::atomic<bool> &stop);
+  void bulk_write_async(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout,
+                        const std::function<void(int)> &on_done);
+  void handle_events(int timeout_us);
   void cleanup();
 
   static std::vector<std::string> list();
@@ -52,6 +97,17 @@ private:
   libusb_device_handle *dev_handle = NULL;
   std::recursive_mutex hw_lock;
   void handle_usb_issue(int err, const char func[]);
+
+  // transfers of asynchronous writes, reused once they complete
+  struct AsyncWrite {
+    PandaUsbHandle *handle;
+    libusb_transfer *transfer;
+    std::function<void(int)> on_done;
+  };
+  std::mutex async_write_lock;
+  std::vector<std::unique_ptr<AsyncWrite>> async_writes;
+  std::vector<AsyncWrite *> free_async_writes;
+  static void LIBUSB_CALL async_write_callback(libusb_transfer *transfer);
 };
 
 #ifndef __APPLE__
@@ -0,0 +1,132 @@
+#include "selfdrive/boardd/panda_sim.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iterator>
+
+PandaSimHandle::PandaSimHandle(const Config &config)
+    : PandaCommsHandle(config.serial), config(config), rng(config.seed), start_time(config.clock()) {
+  hw_serial = config.serial;
+  assert(config.bus_count > 0 && config.bus_count <= PANDA_BUS_CNT);
+  assert(config.addresses > 0);
+  for (uint8_t len : config.lengths) {
+    auto it = std::find(std::begin(dlc_to_len), std::end(dlc_to_len), len);
+    assert(it != std::end(dlc_to_len));
+    dlcs.push_back(it - std::begin(dlc_to_len));
+  }
+  assert(!dlcs.empty());
+}
+
+PandaSimHandle::Stats PandaSimHandle::stats() {
+  std::lock_guard lk(lock);
+  return sim_stats;
+}
+
+int PandaSimHandle::control_write(uint8_t request, uint16_t param1, uint16_t param2, unsigned int timeout) {
+  return 0;
+}
+
+int PandaSimHandle::control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout) {
+  if (request == 0xc1 && length > 0) {
+    data[0] = (uint8_t)config.hw_type;
+    return 1;
+  }
+  if (request == 0xd0) {
+    const uint16_t n = std::min<size_t>(length, config.serial.size());
+    memcpy(data, config.serial.data(), n);
+    return n;
+  }
+  // everything else reads as zeros
+  memset(data, 0, length);
+  return length;
+}
+
+int PandaSimHandle::bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  if (endpoint != 3) return length;
+
+  std::lock_guard lk(lock);
+  generate(config.clock());
+
+  // the writes hold whole frames, they are echoed back as returned frames
+  int pos = 0;
+  while (pos + (int)sizeof(can_header) <= length) {
+    can_header header;
+    memcpy(&header, &data[pos], sizeof(can_header));
+    const uint8_t data_len = dlc_to_len[header.data_len_code];
+    if (pos + (int)sizeof(can_header) + data_len > length) break;
+
+    header.returned = 1;
+    append_frame(header, &data[pos + sizeof(can_header)], false);
+    ++sim_stats.echoed;
+    pos += sizeof(can_header) + data_len;
+  }
+  return length;
+}
+
+int PandaSimHandle::bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  std::lock_guard lk(lock);
+  generate(config.clock());
+
+  const int n = std::min<size_t>(length, backlog.size() - backlog_pos);
+  memcpy(data, &backlog[backlog_pos], n);
+  backlog_pos += n;
+  if (backlog_pos * 2 >= backlog.size()) {
+    backlog.erase(backlog.begin(), backlog.begin() + backlog_pos);
+    backlog_pos = 0;
+  }
+  return n;
+}
+
+void PandaSimHandle::generate(uint64_t now) {
+  if (config.frames_per_second <= 0) return;
+
+  const double interval = 1e9 / config.frames_per_second;
+  const uint64_t due = (now - start_time) / interval;
+  std::uniform_int_distribution<int> bus_dist(0, config.bus_count - 1);
+  std::uniform_int_distribution<int> address_dist(0, config.addresses - 1);
+  std::uniform_int_distribution<size_t> dlc_dist(0, dlcs.size() - 1);
+  std::bernoulli_distribution error_dist(config.checksum_error_rate);
+
+  uint32_t dat[16];
+  for (; sim_stats.generated < due; ++sim_stats.generated) {
+    can_header header = {};
+    header.bus = bus_dist(rng);
+    header.addr = 0x100 + address_dist(rng);
+    header.data_len_code = dlcs[dlc_dist(rng)];
+
+    const uint8_t data_len = dlc_to_len[header.data_len_code];
+    for (int i = 0; i < (data_len + 3) / 4; ++i) {
+      dat[i] = rng();
+    }
+    if (config.timestamps && data_len >= sizeof(uint64_t)) {
+      const uint64_t bus_time = start_time + sim_stats.generated * interval;
+      memcpy(dat, &bus_time, sizeof(bus_time));
+    }
+    append_frame(header, (const uint8_t *)dat, error_dist(rng));
+  }
+}
+
+void PandaSimHandle::append_frame(const can_header &header, const uint8_t *dat, bool corrupt) {
+  const uint8_t data_len = dlc_to_len[header.data_len_code];
+  const size_t size = sizeof(can_header) + data_len;
+  if (backlog.size() - backlog_pos + size > config.max_backlog) {
+    ++sim_stats.dropped;
+    return;
+  }
+
+  const size_t pos = backlog.size();
+  backlog.resize(pos + size);
+  uint8_t *frame = &backlog[pos];
+  memcpy(frame, &header, sizeof(can_header));
+  memcpy(&frame[sizeof(can_header)], dat, data_len);
+
+  can_header *h = (can_header *)frame;
+  h->checksum = 0;
+  uint8_t checksum = xor_checksum(frame, size);
+  if (corrupt) {
+    checksum ^= 0x5a;
+    ++sim_stats.corrupted;
+  }
+  h->checksum = checksum;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common/timing.h"
+#include "selfdrive/boardd/panda.h"
+
+// in-process panda for benchmarks and tests without hardware. it puts frames on its buses at a fixed rate,
+// which are read from endpoint 0x81 like the frames of a real panda, and echoes the frames written to
+// endpoint 3 with the returned flag set.
+class PandaSimHandle : public PandaCommsHandle {
+public:
+  struct Config {
+    std::string serial = "sim";
+    cereal::PandaState::PandaType hw_type = cereal::PandaState::PandaType::RED_PANDA;
+    int bus_count = 3;
+    double frames_per_second = 3000;  // over all buses
+    std::vector<uint8_t> lengths = {8};  // data lengths of the frames, picked at random. repeat one to weight it
+    int addresses = 100;  // distinct addresses on each bus
+    double checksum_error_rate = 0;  // frames put on the bus with a wrong checksum
+    // the first 8 bytes of the frames with 8 bytes or more hold the clock() they were put on the bus at
+    bool timestamps = true;
+    uint32_t max_backlog = 64 * 1024;  // bytes not read yet, the frames over it are dropped
+    uint32_t seed = 0;
+    std::function<uint64_t()> clock = nanos_since_boot;  // in ns, tests step it to get a known number of frames
+  };
+  struct Stats {
+    uint64_t generated = 0;
+    uint64_t corrupted = 0;
+    uint64_t dropped = 0;
+    uint64_t echoed = 0;
+  };
+
+  PandaSimHandle(const Config &config);
+  int control_write(uint8_t request, uint16_t param1, uint16_t param2, unsigned int timeout=TIMEOUT);
+  int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout=TIMEOUT);
+  int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  void cleanup() {}
+  Stats stats();
+
+private:
+  // puts the frames due by now on the buses
+  void generate(uint64_t now);
+  void append_frame(const can_header &header, const uint8_t *dat, bool corrupt);
+
+  const Config config;
+  std::vector<uint8_t> dlcs;  // of config.lengths
+  std::mutex lock;
+  std::mt19937 rng;
+  const uint64_t start_time;
+  std::vector<uint8_t> backlog;
+  size_t backlog_pos = 0;
+  Stats sim_stats;
+};
@@ -198,18 +198,11 @@ std::vector<std::string> PandaSpiHandle::list() {
 }
 
 void add_checksum(uint8_t *data, int data_len) {
-  data[data_len] = SPI_CHECKSUM_START;
-  for (int i=0; i < data_len; i++) {
-    data[data_len] ^= data[i];
-  }
+  data[data_len] = xor_checksum(data, data_len, SPI_CHECKSUM_START);
 }
 
 bool check_checksum(uint8_t *data, int data_len) {
-  uint8_t checksum = SPI_CHECKSUM_START;
-  for (uint16_t i = 0U; i < data_len; i++) {
-    checksum ^= data[i];
-  }
-  return checksum == 0U;
+  return xor_checksum(data, data_len, SPI_CHECKSUM_START) == 0U;
 }
 
 
@@ -0,0 +1,198 @@
+// runs the CAN threads of boardd on simulated pandas, and reports the throughput, the CPU time per frame and
+// the latency from the bus to the can socket.
+//   bench_boardd --pandas 2 --rate 10000 --fd --seconds 10
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "common/timing.h"
+#include "selfdrive/boardd/boardd.h"
+#include "selfdrive/boardd/panda_sim.h"
+
+static double cpu_time() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void print_latency(const char *name, const LatencyHistogram &latency) {
+  printf("%-14s p50 %6lu us, p90 %6lu us, p99 %6lu us, max %6lu us (%lu frames)\n", name, latency.percentile(0.5),
+         latency.percentile(0.9), latency.percentile(0.99), latency.max_us, latency.count);
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [options]\n"
+         "  --pandas N           simulated pandas (1)\n"
+         "  --buses N            buses of each panda (3)\n"
+         "  --rate N             frames/s put on the buses of each panda (3000)\n"
+         "  --fd                 CAN FD frames of 8 to 64 bytes, instead of 8 bytes\n"
+         "  --lengths L,L,..     data lengths of the frames, picked at random\n"
+         "  --checksum-errors P  fraction of the frames with a wrong checksum (0)\n"
+         "  --send-rate N        sendcan messages/s, the frames are echoed by the pandas (0)\n"
+         "  --send-frames N      frames in each sendcan message (10)\n"
+         "  --budget US          use the event driven receive with this latency budget\n"
+         "  --seconds N          duration (10)\n", name);
+}
+
+int main(int argc, char *argv[]) {
+  int panda_count = 1;
+  int send_rate = 0, send_frames = 10;
+  double seconds = 10;
+  int64_t latency_budget_us = -1;
+  PandaSimHandle::Config config;
+
+  const struct option long_options[] = {
+    {"pandas", required_argument, nullptr, 'p'},
+    {"buses", required_argument, nullptr, 'b'},
+    {"rate", required_argument, nullptr, 'r'},
+    {"fd", no_argument, nullptr, 'f'},
+    {"lengths", required_argument, nullptr, 'l'},
+    {"checksum-errors", required_argument, nullptr, 'c'},
+    {"send-rate", required_argument, nullptr, 's'},
+    {"send-frames", required_argument, nullptr, 'n'},
+    {"budget", required_argument, nullptr, 'u'},
+    {"seconds", required_argument, nullptr, 't'},
+    {"help", no_argument, nullptr, 'h'},
+    {nullptr, 0, nullptr, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", long_options, nullptr)) != -1) {
+    switch (opt) {
+      case 'p': panda_count = atoi(optarg); break;
+      case 'b': config.bus_count = atoi(optarg); break;
+      case 'r': config.frames_per_second = atof(optarg); break;
+      case 'f': config.lengths = {8, 8, 12, 16, 20, 24, 32, 48, 64, 64}; break;
+      case 'l': {
+        config.lengths.clear();
+        std::stringstream ss(optarg);
+        for (std::string len; std::getline(ss, len, ',');) {
+          config.lengths.push_back(atoi(len.c_str()));
+        }
+        break;
+      }
+      case 'c': config.checksum_error_rate = atof(optarg); break;
+      case 's': send_rate = atoi(optarg); break;
+      case 'n': send_frames = atoi(optarg); break;
+      case 'u': latency_budget_us = atoll(optarg); break;
+      case 't': seconds = atof(optarg); break;
+      default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  std::vector<PandaSimHandle *> sims;
+  std::vector<Panda *> pandas;
+  for (int i = 0; i < panda_count; ++i) {
+    config.serial = "sim" + std::to_string(i);
+    config.seed = i;
+    auto sim = std::make_unique<PandaSimHandle>(config);
+    sims.push_back(sim.get());
+    pandas.push_back(new Panda(std::move(sim), i * PANDA_BUS_CNT));
+  }
+
+  std::unique_ptr<Context> context(Context::create());
+  std::unique_ptr<SubSocket> can_sock(SubSocket::create(context.get(), "can"));
+  assert(can_sock != nullptr);
+  can_sock->setTimeout(100);
+  PubMaster pm({"sendcan"});
+
+  const double start_cpu = cpu_time();
+  const uint64_t start_time = nanos_since_boot();
+  std::vector<std::thread> threads;
+  threads.emplace_back(can_send_thread, pandas, false);
+  if (latency_budget_us >= 0) {
+    threads.emplace_back(can_recv_stream_thread, pandas, latency_budget_us);
+  } else {
+    threads.emplace_back(can_recv_thread, pandas);
+  }
+
+  // the echoed frames carry the time they were sent in their first 8 bytes, like the frames of the simulated buses
+  std::thread sender([&]() {
+    if (send_rate <= 0) return;
+    const uint64_t interval = 1000000000ULL / send_rate;
+    uint64_t next_send_time = nanos_since_boot();
+    while (!do_exit) {
+      MessageBuilder msg;
+      auto can_data = msg.initEvent().initSendcan(send_frames * pandas.size());
+      const uint64_t send_time = nanos_since_boot();
+      for (int i = 0; i < can_data.size(); ++i) {
+        can_data[i].setAddress(0x200 + i % send_frames);
+        can_data[i].setSrc((i / send_frames) * PANDA_BUS_CNT);
+        can_data[i].setDat(kj::arrayPtr((const capnp::byte *)&send_time, sizeof(send_time)));
+      }
+      pm.send("sendcan", msg);
+
+      next_send_time += interval;
+      const int64_t remaining = next_send_time - nanos_since_boot();
+      if (remaining > 0) std::this_thread::sleep_for(std::chrono::nanoseconds(remaining));
+    }
+  });
+
+  AlignedBuffer aligned_buf;
+  LatencyHistogram rx_latency, echo_latency;
+  uint64_t messages = 0, invalid_messages = 0, rx_frames = 0, echo_frames = 0;
+  while (nanos_since_boot() - start_time < seconds * 1e9) {
+    std::unique_ptr<Message> msg(can_sock->receive());
+    if (!msg) continue;
+
+    const uint64_t recv_time = nanos_since_boot();
+    capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg.get()));
+    auto event = cmsg.getRoot<cereal::Event>();
+    ++messages;
+    invalid_messages += !event.getValid();
+    for (auto frame : event.getCan()) {
+      const bool echo = frame.getSrc() >= CAN_RETURNED_BUS_OFFSET;
+      (echo ? echo_frames : rx_frames) += 1;
+
+      auto dat = frame.getDat();
+      if (dat.size() >= sizeof(uint64_t) && (echo || config.timestamps)) {
+        uint64_t sent_time;
+        memcpy(&sent_time, dat.begin(), sizeof(sent_time));
+        (echo ? echo_latency : rx_latency).add(recv_time > sent_time ? recv_time - sent_time : 0);
+      }
+    }
+  }
+  const double elapsed = (nanos_since_boot() - start_time) / 1e9;
+  const double cpu = cpu_time() - start_cpu;
+
+  do_exit = true;
+  sender.join();
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  PandaSimHandle::Stats sim_stats = {};
+  for (auto sim : sims) {
+    auto s = sim->stats();
+    sim_stats.generated += s.generated;
+    sim_stats.corrupted += s.corrupted;
+    sim_stats.dropped += s.dropped;
+    sim_stats.echoed += s.echoed;
+  }
+  for (auto panda : pandas) {
+    delete panda;
+  }
+
+  const uint64_t frames = rx_frames + echo_frames;
+  printf("%d pandas, %.0f frames/s each, %.1fs, %s receive\n", panda_count, config.frames_per_second, elapsed,
+         latency_budget_us >= 0 ? "event driven" : "100Hz");
+  printf("can messages   %lu (%lu invalid), %.0f/s\n", messages, invalid_messages, messages / elapsed);
+  printf("frames         %lu received, %lu echoed, %.0f frames/s\n", rx_frames, echo_frames, frames / elapsed);
+  printf("simulated      %lu generated, %lu corrupted, %lu dropped by the panda, %lu echoed\n",
+         sim_stats.generated, sim_stats.corrupted, sim_stats.dropped, sim_stats.echoed);
+  printf("cpu            %.1f%%, %.2f us/frame (includes the simulation)\n", cpu / elapsed * 100, frames ? cpu * 1e6 / frames : 0.0);
+  print_latency("rx latency", rx_latency);
+  if (send_rate > 0) {
+    print_latency("echo latency", echo_latency);
+  }
+  return 0;
+}
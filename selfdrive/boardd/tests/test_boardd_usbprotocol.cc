@@ -5,6 +5,7 @@
 #include "catch2/catch.hpp"
 #include "cereal/messaging/messaging.h"
 #include "selfdrive/boardd/panda.h"
+#include "selfdrive/boardd/panda_sim.h"
 
 int random_int(int min, int max) {
   std::random_device dev;
@@ -18,6 +19,11 @@ struct PandaTest : public Panda {
   void test_can_send();
   void test_can_recv(uint32_t chunk_size = 0);
   void test_chunked_can_recv();
+  void test_checksum_error();
+  void test_can_send_queue();
+  void test_unpack_reference();
+  void test_can_receive_stream(int chunk_size);
+  using Panda::unpack_can_buffer;
 
   std::map<int, std::string> test_data;
   int can_list_size = 0;
@@ -82,9 +88,22 @@ void PandaTest::test_can_send() {
 
 void PandaTest::test_can_recv(uint32_t rx_chunk_size) {
   std::vector<can_frame> frames;
+  // the received frames point into the buffer, copy them before it is reused
+  auto unpack = [&](uint8_t *data, uint32_t size) {
+    std::vector<can_frame_view> views;
+    uint32_t parsed = 0;
+    REQUIRE(this->unpack_can_buffer(data, size, views, parsed));
+    for (const auto &v : views) {
+      frames.push_back({v.address, std::string((const char *)v.dat, v.len), 0, v.src});
+      REQUIRE(v.dat >= data);
+      REQUIRE(v.dat + v.len <= data + parsed);
+    }
+    return parsed;
+  };
+
   this->pack_can_buffer(can_data_list, [&](uint8_t *data, uint32_t size) {
     if (rx_chunk_size == 0) {
-      REQUIRE(this->unpack_can_buffer(data, size, frames));
+      REQUIRE(unpack(data, size) == size);
     } else {
       this->receive_buffer_size = 0;
       uint32_t pos = 0;
@@ -95,8 +114,11 @@ void PandaTest::test_can_recv(uint32_t rx_chunk_size) {
         this->receive_buffer_size += chunk_size;
         pos += chunk_size;
 
-        REQUIRE(this->unpack_can_buffer(this->receive_buffer, this->receive_buffer_size, frames));
+        uint32_t parsed = unpack(this->receive_buffer, this->receive_buffer_size);
+        this->receive_buffer_size -= parsed;
+        memmove(this->receive_buffer, &this->receive_buffer[parsed], this->receive_buffer_size);
       }
+      REQUIRE(this->receive_buffer_size == 0);
     }
   });
 
@@ -109,6 +131,179 @@ void PandaTest::test_can_recv(uint32_t rx_chunk_size) {
   }
 }
 
+void PandaTest::test_checksum_error() {
+  std::vector<uint8_t> data;
+  this->pack_can_buffer(can_data_list, [&](uint8_t *chunk, size_t size) {
+    data.insert(data.end(), chunk, &chunk[size]);
+  });
+  // corrupt the address of the first frame
+  data[1] ^= 0xff;
+
+  std::vector<can_frame_view> frames;
+  uint32_t parsed = 0;
+  REQUIRE_FALSE(this->unpack_can_buffer(data.data(), data.size(), frames, parsed));
+  REQUIRE(frames.empty());
+  REQUIRE(parsed == data.size());
+}
+
+void PandaTest::test_can_send_queue() {
+  std::vector<uint8_t> packed;
+  this->pack_can_buffer(can_data_list, [&](uint8_t *chunk, size_t size) {
+    packed.insert(packed.end(), chunk, &chunk[size]);
+  });
+
+  std::vector<cereal::CanData::Reader> msgs;
+  for (auto cmsg : can_data_list) {
+    msgs.push_back(cmsg);
+  }
+  this->can_send_queue(msgs);
+  std::vector<uint8_t> queued;
+  for (size_t i = 0; i < this->tx_count; ++i) {
+    const auto &chunk = this->tx_queue[(this->tx_head + i) % this->tx_queue.size()];
+    REQUIRE(chunk.size <= sizeof(chunk.data));
+    queued.insert(queued.end(), chunk.data, &chunk.data[chunk.size]);
+  }
+  REQUIRE(queued == packed);
+
+  auto stats = this->get_can_tx_stats(false);
+  REQUIRE(stats.queue_depth == this->tx_count);
+  REQUIRE(stats.dropped == 0);
+}
+
+// the byte wise implementation unpack_can_buffer is compared with
+static bool unpack_can_buffer_reference(uint32_t bus_offset, const uint8_t *data, uint32_t size,
+                                        std::vector<can_frame_view> &out_vec, uint32_t &parsed) {
+  uint32_t pos = 0;
+  while (pos + sizeof(can_header) <= size) {
+    can_header header;
+    memcpy(&header, &data[pos], sizeof(can_header));
+    const uint8_t data_len = dlc_to_len[header.data_len_code];
+    if (pos + sizeof(can_header) + data_len > size) break;
+
+    uint8_t checksum = 0;
+    for (uint32_t i = 0; i < sizeof(can_header) + data_len; i++) {
+      checksum ^= data[pos + i];
+    }
+    if (checksum != 0) {
+      parsed = size;
+      return false;
+    }
+
+    can_frame_view &canData = out_vec.emplace_back();
+    canData.address = header.addr;
+    canData.src = header.bus + bus_offset;
+    if (header.rejected) canData.src += CAN_REJECTED_BUS_OFFSET;
+    if (header.returned) canData.src += CAN_RETURNED_BUS_OFFSET;
+    canData.len = data_len;
+    canData.dat = &data[pos + sizeof(can_header)];
+    pos += sizeof(can_header) + data_len;
+  }
+  parsed = pos;
+  return true;
+}
+
+// frames with random headers and data on the buses of a panda, the size is rounded up to the end of a frame
+static std::vector<uint8_t> random_can_buffer(std::mt19937 &rng, size_t size) {
+  std::vector<uint8_t> data;
+  while (data.size() < size) {
+    can_header header = {};
+    header.bus = rng() % PANDA_BUS_CNT;
+    header.data_len_code = rng() % std::size(dlc_to_len);
+    header.rejected = rng() % 2;
+    header.returned = rng() % 2;
+    header.extended = rng() % 2;
+    header.addr = rng() & 0x1fffffff;
+
+    const size_t pos = data.size();
+    data.resize(pos + sizeof(can_header) + dlc_to_len[header.data_len_code]);
+    memcpy(&data[pos], &header, sizeof(can_header));
+    std::generate(&data[pos + sizeof(can_header)], data.data() + data.size(), std::ref(rng));
+    uint8_t checksum = 0;
+    for (size_t i = pos; i < data.size(); ++i) {
+      checksum ^= data[i];
+    }
+    ((can_header *)&data[pos])->checksum = checksum;
+  }
+  return data;
+}
+
+// returns data in chunks of chunk_size, or of random sizes up to -chunk_size, and disconnects at the end of it
+struct ChunkedHandle : public PandaCommsHandle {
+  ChunkedHandle(const std::vector<uint8_t> &data, int chunk_size) : PandaCommsHandle(""), data(data), chunk_size(chunk_size) {}
+  int control_write(uint8_t request, uint16_t param1, uint16_t param2, unsigned int timeout=TIMEOUT) { return 0; }
+  int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *buf, uint16_t length, unsigned int timeout=TIMEOUT) {
+    memset(buf, 0, length);
+    if (request == 0xc1 && length > 0) buf[0] = (uint8_t)cereal::PandaState::PandaType::RED_PANDA;
+    return length;
+  }
+  int bulk_write(unsigned char endpoint, unsigned char* buf, int length, unsigned int timeout=TIMEOUT) { return length; }
+  int bulk_read(unsigned char endpoint, unsigned char* buf, int length, unsigned int timeout=TIMEOUT) {
+    int n = chunk_size > 0 ? chunk_size : random_int(1, -chunk_size);
+    n = std::min<int>({n, length, (int)(data.size() - pos)});
+    memcpy(buf, &data[pos], n);
+    pos += n;
+    if (pos == data.size()) connected = false;
+    return n;
+  }
+  void cleanup() {}
+
+  std::vector<uint8_t> data;
+  size_t pos = 0;
+  const int chunk_size;
+};
+
+void PandaTest::test_can_receive_stream(int chunk_size) {
+  std::vector<uint8_t> data;
+  this->pack_can_buffer(can_data_list, [&](uint8_t *chunk, size_t size) {
+    data.insert(data.end(), chunk, &chunk[size]);
+  });
+
+  Panda panda(std::make_unique<ChunkedHandle>(data, chunk_size), this->bus_offset);
+  std::vector<can_frame> frames;
+  std::atomic<bool> stop = false;
+  panda.can_receive_stream(1, stop, [&](const std::vector<can_frame_view> &views, bool healthy) {
+    REQUIRE(healthy);
+    for (const auto &v : views) {
+      frames.push_back({v.address, std::string((const char *)v.dat, v.len), 0, v.src});
+    }
+  });
+
+  REQUIRE(frames.size() == can_list_size);
+  for (int i = 0; i < frames.size(); ++i) {
+    REQUIRE(frames[i].address == can_data_list[i].getAddress());
+    REQUIRE(frames[i].src == can_data_list[i].getSrc());
+    auto dat = can_data_list[i].getDat();
+    REQUIRE(frames[i].dat == std::string((const char *)dat.begin(), dat.size()));
+  }
+}
+
+void PandaTest::test_unpack_reference() {
+  std::mt19937 rng(can_list_size);
+  auto data = random_can_buffer(rng, total_pakets_size);
+
+  auto compare = [&](uint32_t size) {
+    std::vector<can_frame_view> frames, ref_frames;
+    uint32_t parsed = 0, ref_parsed = 0;
+    const bool ok = this->unpack_can_buffer(data.data(), size, frames, parsed);
+    REQUIRE(ok == unpack_can_buffer_reference(this->bus_offset, data.data(), size, ref_frames, ref_parsed));
+    REQUIRE(parsed == ref_parsed);
+    REQUIRE(frames.size() == ref_frames.size());
+    for (int i = 0; i < frames.size(); ++i) {
+      REQUIRE(frames[i].address == ref_frames[i].address);
+      REQUIRE(frames[i].src == ref_frames[i].src);
+      REQUIRE(frames[i].len == ref_frames[i].len);
+      REQUIRE(frames[i].dat == ref_frames[i].dat);
+    }
+  };
+
+  compare(data.size());
+  // incomplete frame at the end
+  compare(rng() % data.size());
+  // bad checksum
+  data[rng() % data.size()] ^= 1 << (rng() % 8);
+  compare(data.size());
+}
+
 TEST_CASE("send/recv CAN 2.0 packets") {
   auto bus_offset = GENERATE(0, 4);
   auto can_list_size = GENERATE(1, 3, 5, 10, 30, 60, 100, 200);
@@ -123,6 +318,12 @@ TEST_CASE("send/recv CAN 2.0 packets") {
   SECTION("chunked_can_receive") {
     test.test_can_recv(0x40);
   }
+  SECTION("checksum_error") {
+    test.test_checksum_error();
+  }
+  SECTION("can_send_queue") {
+    test.test_can_send_queue();
+  }
 }
 
 TEST_CASE("send/recv CAN FD packets") {
@@ -139,4 +340,149 @@ TEST_CASE("send/recv CAN FD packets") {
   SECTION("chunked_can_receive") {
     test.test_can_recv(0x40);
   }
+  SECTION("checksum_error") {
+    test.test_checksum_error();
+  }
+  SECTION("can_send_queue") {
+    test.test_can_send_queue();
+  }
+  SECTION("unpack_reference") {
+    test.test_unpack_reference();
+  }
+  SECTION("can_receive_stream") {
+    // chunks shorter than a frame, frames straddling chunks, and random chunk sizes
+    for (int chunk_size : {1, 5, 7, 31, 0x41, -100, RECV_SIZE}) {
+      INFO("chunk size " << chunk_size);
+      test.test_can_receive_stream(chunk_size);
+    }
+  }
+}
+
+TEST_CASE("PandaSimHandle") {
+  // the frames are put on the buses by a clock stepped by the test
+  uint64_t now = 0;
+  PandaSimHandle::Config config;
+  config.frames_per_second = 2000;
+  config.lengths = {0, 8, 12, 64};
+  config.timestamps = false;
+  config.clock = [&now]() { return now; };
+
+  SECTION("receive") {
+    auto sim = std::make_unique<PandaSimHandle>(config);
+    PandaSimHandle *handle = sim.get();
+    Panda panda(std::move(sim), 4);
+    REQUIRE(panda.hw_type == cereal::PandaState::PandaType::RED_PANDA);
+
+    now += 50 * 1000000ULL;
+    std::vector<can_frame_view> frames;
+    REQUIRE(panda.can_receive(frames));
+    auto stats = handle->stats();
+    REQUIRE(stats.generated == 100);
+    REQUIRE(stats.dropped == 0);
+    REQUIRE(frames.size() == stats.generated);
+    for (const auto &f : frames) {
+      REQUIRE(f.src >= 4);
+      REQUIRE(f.src < 4 + config.bus_count);
+      REQUIRE(std::find(config.lengths.begin(), config.lengths.end(), f.len) != config.lengths.end());
+    }
+  }
+  SECTION("checksum errors") {
+    config.checksum_error_rate = 1.0;
+    auto sim = std::make_unique<PandaSimHandle>(config);
+    PandaSimHandle *handle = sim.get();
+    Panda panda(std::move(sim));
+
+    now += 50 * 1000000ULL;
+    std::vector<can_frame_view> frames;
+    REQUIRE_FALSE(panda.can_receive(frames));
+    REQUIRE(frames.empty());
+    REQUIRE(handle->stats().corrupted == 100);
+  }
+  SECTION("receive in a ring") {
+    // more than a read each time, the reads end in the middle of frames and wrap around the receive buffer
+    config.frames_per_second = 1e6;
+    config.timestamps = true;
+    config.lengths = {8, 12, 64};
+    auto sim = std::make_unique<PandaSimHandle>(config);
+    PandaSimHandle *handle = sim.get();
+    Panda panda(std::move(sim));
+
+    uint64_t frame_count = 0, last_time = 0;
+    std::vector<can_frame_view> frames;
+    auto receive = [&]() {
+      frames.clear();
+      REQUIRE(panda.can_receive(frames));
+      for (const auto &f : frames) {
+        uint64_t bus_time;
+        memcpy(&bus_time, f.dat, sizeof(bus_time));
+        REQUIRE(bus_time >= last_time);
+        last_time = bus_time;
+      }
+      frame_count += frames.size();
+    };
+    for (int i = 0; i < 20; ++i) {
+      now += 2 * 1000000ULL;
+      receive();
+    }
+    // read the rest of the backlog
+    do {
+      receive();
+    } while (!frames.empty());
+
+    auto stats = handle->stats();
+    REQUIRE(stats.generated == 40000);
+    REQUIRE(stats.dropped > 0);
+    REQUIRE(frame_count == stats.generated - stats.dropped);
+  }
+  SECTION("echo") {
+    config.frames_per_second = 0;
+    Panda panda(std::make_unique<PandaSimHandle>(config), 4);
+
+    MessageBuilder msg;
+    auto can_data = msg.initEvent().initSendcan(100);
+    for (int i = 0; i < can_data.size(); ++i) {
+      can_data[i].setAddress(i);
+      can_data[i].setSrc(4 + i % 3);
+      std::string dat(config.lengths[i % config.lengths.size()], (char)i);
+      can_data[i].setDat(kj::arrayPtr((uint8_t *)dat.data(), dat.size()));
+    }
+    panda.can_send(can_data.asReader());
+
+    std::vector<can_frame_view> frames;
+    REQUIRE(panda.can_receive(frames));
+    REQUIRE(frames.size() == can_data.size());
+    for (int i = 0; i < frames.size(); ++i) {
+      REQUIRE(frames[i].address == can_data[i].getAddress());
+      REQUIRE(frames[i].src == can_data[i].getSrc() + CAN_RETURNED_BUS_OFFSET);
+      REQUIRE(frames[i].len == can_data[i].getDat().size());
+      REQUIRE(memcmp(frames[i].dat, can_data[i].getDat().begin(), frames[i].len) == 0);
+    }
+  }
+}
+
+TEST_CASE("unpack benchmark", "[.][benchmark]") {
+  std::mt19937 rng(0);
+  const auto data = random_can_buffer(rng, RECV_SIZE);
+  PandaTest panda(0, 1, cereal::PandaState::PandaType::RED_PANDA);
+  std::vector<can_frame_view> frames;
+  frames.reserve(data.size() / sizeof(can_header));
+
+  BENCHMARK("byte wise reference") {
+    frames.clear();
+    uint32_t parsed = 0;
+    return unpack_can_buffer_reference(0, data.data(), data.size(), frames, parsed);
+  };
+  BENCHMARK("unpack_can_buffer") {
+    frames.clear();
+    uint32_t parsed = 0;
+    return panda.unpack_can_buffer(data.data(), data.size(), frames, parsed);
+  };
+  BENCHMARK("byte wise checksum") {
+    uint8_t checksum = 0;
+    for (uint8_t b : data) checksum ^= b;
+    return checksum;
+  };
+  BENCHMARK("xor_checksum") {
+    return xor_checksum(data.data(), data.size());
+  };
 }
@@ -25,6 +25,7 @@ int main(int argc, char *argv[]) {
   cmd_parser.addOption({"ecam", "load wide road camera"});
   cmd_parser.addOption({"stream", "read can messages from live streaming"});
   cmd_parser.addOption({"zmq", "the ip address on which to receive zmq messages", "zmq"});
+  cmd_parser.addOption({"record", "record live streaming to rlogs in a directory, which can be replayed with --data_dir", "dir"});
   cmd_parser.addOption({"data_dir", "local directory with routes", "data_dir"});
   cmd_parser.addOption({"no-vipc", "do not output video"});
   cmd_parser.addOption({"dbc", "dbc file to open", "dbc"});
@@ -34,7 +35,7 @@ int main(int argc, char *argv[]) {
   std::unique_ptr<AbstractStream> stream;
 
   if (cmd_parser.isSet("stream")) {
-    stream.reset(new LiveStream(&app, cmd_parser.value("zmq")));
+    stream.reset(new LiveStream(&app, cmd_parser.value("zmq"), cmd_parser.value("record")));
   } else {
     // TODO: Remove when OpenpilotPrefix supports ZMQ
 #ifndef __APPLE__
@@ -190,6 +190,9 @@ void ChartView::updatePlotArea(int left_pos, bool force) {
     int adjust_top = chart()->legend()->geometry().height() + style()->pixelMetric(QStyle::PM_LayoutTopMargin);
     chart()->setPlotArea(rect().adjusted(align_to + left, adjust_top + top, -x_label_size.width() / 2 - right, -x_label_size.height() - bottom));
     chart()->layout()->invalidate();
+    for (auto &s : sigs) {
+      resampleSeries(s);
+    }
     resetChartCache();
   }
 }
@@ -209,6 +212,9 @@ void ChartView::updatePlot(double cur, double min, double max) {
   cur_sec = cur;
   if (min != axis_x->min() || max != axis_x->max()) {
     axis_x->setRange(min, max);
+    for (auto &s : sigs) {
+      resampleSeries(s);
+    }
     updateAxisY();
     updateSeriesPoints();
     // update tooltip
@@ -243,39 +249,72 @@ void ChartView::updateSeriesPoints() {
   }
 }
 
+// only the visible range is passed to the series, reduced to about two points per pixel.
+void ChartView::resampleSeries(SigItem &s) {
+  auto &points = resampled_points;
+  int first = std::lower_bound(s.vals.begin(), s.vals.end(), axis_x->min(), xLessThan) - s.vals.begin();
+  int last = std::lower_bound(s.vals.begin() + first, s.vals.end(), axis_x->max(), xLessThan) - s.vals.begin();
+  s.lod.downsample(s.vals, first, last, std::max<int>(chart()->plotArea().width(), 100) * 2, points);
+  // include the points just outside the range to draw the lines to the edges
+  if (first > 0) points.prepend(s.vals[first - 1]);
+  if (last < s.vals.size()) points.append(s.vals[last]);
+
+  if (series_type == SeriesType::StepLine && points.size() > 1) {
+    QVector<QPointF> step_points;
+    step_points.reserve(points.size() * 2);
+    step_points.push_back(points.front());
+    for (int i = 1; i < points.size(); ++i) {
+      step_points.push_back({points[i].x(), step_points.back().y()});
+      step_points.push_back(points[i]);
+    }
+    s.series->replace(step_points);
+  } else {
+    s.series->replace(points);
+  }
+}
+
 void ChartView::updateSeries(const cabana::Signal *sig) {
   for (auto &s : sigs) {
     if (!sig || s.sig == sig) {
       if (!can->liveStreaming()) {
         s.vals.clear();
-        s.step_vals.clear();
+        s.lod.clear();
         s.last_value_mono_time = 0;
       }
       s.series->setColor(getColor(s.sig));
 
       const auto &msgs = can->events().at(s.msg_id);
-      auto first = std::upper_bound(msgs.cbegin(), msgs.cend(), CanEvent{.mono_time = s.last_value_mono_time});
+      if (can->liveStreaming() && !s.vals.isEmpty() && !msgs.empty()) {
+        // the stream keeps the last max_cached_minutes of events, drop the older points once they are a minute behind
+        const double first_ts = msgs.front().mono_time / 1e9 - can->routeStartTime();
+        if (s.vals.front().x() < first_ts - 60) {
+          s.vals.erase(s.vals.begin(), std::lower_bound(s.vals.begin(), s.vals.end(), first_ts, xLessThan));
+          s.lod.clear();
+          s.segment_tree.build(s.vals);
+        }
+      }
+      auto first = msgs.upperBound(s.last_value_mono_time);
       int new_size = std::max<int>(s.vals.size() + std::distance(first, msgs.cend()), settings.max_cached_minutes * 60 * 100);
       if (s.vals.capacity() <= new_size) {
         s.vals.reserve(new_size * 2);
-        s.step_vals.reserve(new_size * 4);
       }
 
+      std::vector<double> values(std::distance(first, msgs.cend()));
+      msgs.decode(SignalDecoder(*s.sig), first, msgs.cend(), values.data());
       const double route_start_time = can->routeStartTime();
-      for (auto end = msgs.cend(); first != end; ++first) {
-        double value = get_raw_value(first->dat, first->size, *s.sig);
+      for (size_t i = 0; i < values.size(); ++i, ++first) {
+        double value = values[i];
         double ts = first->mono_time / 1e9 - route_start_time;  // seconds
         s.vals.append({ts, value});
-        if (!s.step_vals.empty()) {
-          s.step_vals.append({ts, s.step_vals.back().y()});
-        }
-        s.step_vals.append({ts, value});
         s.last_value_mono_time = first->mono_time;
       }
-      if (!can->liveStreaming()) {
+      s.lod.update(s.vals);
+      if (can->liveStreaming()) {
+        s.segment_tree.update(s.vals);
+      } else {
         s.segment_tree.build(s.vals);
       }
-      s.series->replace(series_type == SeriesType::StepLine ? s.step_vals : s.vals);
+      resampleSeries(s);
     }
   }
   updateAxisY();
@@ -300,18 +339,7 @@ void ChartView::updateAxisY() {
 
     auto first = std::lower_bound(s.vals.begin(), s.vals.end(), axis_x->min(), xLessThan);
     auto last = std::lower_bound(first, s.vals.end(), axis_x->max(), xLessThan);
-    s.min = std::numeric_limits<double>::max();
-    s.max = std::numeric_limits<double>::lowest();
-    if (can->liveStreaming()) {
-      for (auto it = first; it != last; ++it) {
-        if (it->y() < s.min) s.min = it->y();
-        if (it->y() > s.max) s.max = it->y();
-      }
-    } else {
-      auto [min_y, max_y] = s.segment_tree.minmax(std::distance(s.vals.begin(), first), std::distance(s.vals.begin(), last));
-      s.min = min_y;
-      s.max = max_y;
-    }
+    std::tie(s.min, s.max) = s.segment_tree.minmax(std::distance(s.vals.begin(), first), std::distance(s.vals.begin(), last));
     min = std::min(min, s.min);
     max = std::max(max, s.max);
   }
@@ -705,9 +733,8 @@ void ChartView::setSeriesType(SeriesType type) {
       s.series->deleteLater();
     }
     for (auto &s : sigs) {
-      auto series = createSeries(series_type, getColor(s.sig));
-      series->replace(series_type == SeriesType::StepLine ? s.step_vals : s.vals);
-      s.series = series;
+      s.series = createSeries(series_type, getColor(s.sig));
+      resampleSeries(s);
     }
     updateSeriesPoints();
     updateTitle();
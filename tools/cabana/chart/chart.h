@@ -39,7 +39,7 @@ public:
     const cabana::Signal *sig = nullptr;
     QXYSeries *series = nullptr;
     QVector<QPointF> vals;
-    QVector<QPointF> step_vals;
+    MinMaxPyramid lod;
     uint64_t last_value_mono_time = 0;
     QPointF track_pt{};
     SegmentTree segment_tree;
@@ -82,6 +82,7 @@ private:
   qreal niceNumber(qreal x, bool ceiling);
   QXYSeries *createSeries(SeriesType type, QColor color);
   void updateSeriesPoints();
+  void resampleSeries(SigItem &s);
   void removeIf(std::function<bool(const SigItem &)> predicate);
   inline void clearTrackPoints() { for (auto &s : sigs) s.track_pt = {}; }
 
@@ -101,6 +102,7 @@ private:
   QPixmap chart_pixmap;
   bool can_drop = false;
   double tooltip_x = -1;
+  QVector<QPointF> resampled_points;  // reused by resampleSeries
   ChartsWidget *charts_widget;
   friend class ChartsWidget;
 };
@@ -1,4 +1,7 @@
 #include "tools/cabana/dbc/dbc.h"
+
+#include <cstring>
+
 #include "tools/cabana/util.h"
 
 uint qHash(const MessageId &item) {
@@ -49,6 +52,64 @@ double get_raw_value(const uint8_t *data, size_t data_size, const cabana::Signal
   return val * sig.factor + sig.offset;
 }
 
+// SignalDecoder
+
+SignalDecoder::SignalDecoder(const cabana::Signal &sig) : sig_(sig) {
+  // the byte holding the most significant bit comes first in big endian signals
+  const size_t lsb_byte = sig.lsb / 8, msb_byte = sig.msb / 8;
+  first_byte_ = sig.is_little_endian ? lsb_byte : msb_byte;
+  last_byte_ = sig.is_little_endian ? msb_byte : lsb_byte;
+  const int bytes = last_byte_ - first_byte_ + 1;
+  compiled_ = sig.size > 0 && sig.size <= 64 && first_byte_ <= last_byte_ && bytes <= 8;
+  if (compiled_) {
+    // little endian words are loaded as is, big endian words are byte swapped to put the first byte on top
+    shift_ = sig.is_little_endian ? sig.lsb % 8 : 64 - bytes * 8 + sig.lsb % 8;
+    mask_ = sig.size == 64 ? ~0ULL : (1ULL << sig.size) - 1;
+    sign_shift_ = sig.is_signed ? 64 - sig.size : 0;
+  }
+}
+
+inline uint64_t SignalDecoder::load(const uint8_t *data) const {
+  uint64_t word;
+  memcpy(&word, data, sizeof(word));
+  return sig_.is_little_endian ? word : __builtin_bswap64(word);
+}
+
+inline double SignalDecoder::value(uint64_t word) const {
+  const uint64_t raw = (word >> shift_) & mask_;
+  const int64_t val = sign_shift_ ? (int64_t)(raw << sign_shift_) >> sign_shift_ : (int64_t)raw;
+  return val * sig_.factor + sig_.offset;
+}
+
+double SignalDecoder::decode(const uint8_t *data, size_t data_size) const {
+  if (!compiled_ || last_byte_ >= data_size) {
+    return get_raw_value(data, data_size, sig_);
+  }
+  uint8_t buf[8] = {};
+  const size_t n = std::min<size_t>(data_size - first_byte_, sizeof(buf));
+  memcpy(buf, data + first_byte_, n);
+  return value(load(buf));
+}
+
+void SignalDecoder::decode(const uint8_t *data, size_t stride, size_t count, double *out) const {
+  if (!compiled_ || last_byte_ >= stride) {
+    for (size_t i = 0; i < count; ++i) {
+      out[i] = get_raw_value(data + i * stride, stride, sig_);
+    }
+    return;
+  }
+
+  // full 8 byte loads stay inside the buffer for all frames but the last ones
+  size_t i = 0;
+  const size_t total = stride * count;
+  for (const uint8_t *p = data + first_byte_; i < count && (p - data) + 8 <= total; ++i, p += stride) {
+    out[i] = value(load(p));
+  }
+  for (; i < count; ++i) {
+    out[i] = decode(data + i * stride, stride);
+  }
+}
+
 bool cabana::operator==(const cabana::Signal &l, const cabana::Signal &r) {
   return l.name == r.name && l.size == r.size &&
          l.start_bit == r.start_bit &&
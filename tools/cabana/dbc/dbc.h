@@ -75,6 +75,28 @@ namespace cabana {
   inline bool operator!=(const cabana::Signal &l, const cabana::Signal &r) { return !(l == r); }
 }
 
+// a signal compiled into a program that loads the bytes it spans as one 64 bit word in its byte order,
+// then shifts, masks and sign extends the raw value.
+class SignalDecoder {
+public:
+  SignalDecoder(const cabana::Signal &sig);
+  double decode(const uint8_t *data, size_t data_size) const;
+  // decodes count frames of the same size stored stride bytes apart.
+  void decode(const uint8_t *data, size_t stride, size_t count, double *out) const;
+
+private:
+  inline double value(uint64_t word) const;
+  inline uint64_t load(const uint8_t *data) const;
+
+  cabana::Signal sig_;
+  bool compiled_ = false;  // false if the signal spans more than 8 bytes
+  size_t first_byte_ = 0;
+  size_t last_byte_ = 0;
+  int shift_ = 0;
+  uint64_t mask_ = 0;
+  int sign_shift_ = 0;
+};
+
 // Helper functions
 double get_raw_value(const uint8_t *data, size_t data_size, const cabana::Signal &sig);
 int bigEndianStartBitsIndex(int start_bit);
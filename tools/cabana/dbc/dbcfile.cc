@@ -1,14 +1,19 @@
 #include "tools/cabana/dbc/dbcfile.h"
 
-#include <QDebug>
-
+#include <QCryptographicHash>
+#include <QDataStream>
 #include <QFile>
 #include <QFileInfo>
-#include <QRegularExpression>
-#include <QTextStream>
-#include <QVector>
+#include <QSaveFile>
+#include <cctype>
 #include <limits>
-#include <sstream>
+#include <string_view>
+#include <unordered_set>
+
+#include "tools/replay/filereader.h"
+
+// bump when the parser or the layout of the cache changes
+const int DBC_CACHE_VERSION = 1;
 
 
 DBCFile::DBCFile(const QString &dbc_file_name, QObject *parent) : QObject(parent) {
@@ -34,31 +39,14 @@ DBCFile::DBCFile(const QString &name, const QString &content, QObject *parent) :
 }
 
 void DBCFile::open(const QString &content) {
-  std::istringstream stream(content.toStdString());
-  auto dbc = const_cast<DBC *>(dbc_parse_from_stream(name_.toStdString(), stream));
-  msgs.clear();
-  for (auto &msg : dbc->msgs) {
-    auto &m = msgs[msg.address];
-    m.name = msg.name.c_str();
-    m.size = msg.size;
-    for (auto &s : msg.sigs) {
-      m.sigs.push_back({});
-      auto &sig = m.sigs.last();
-      sig.name = s.name.c_str();
-      sig.start_bit = s.start_bit;
-      sig.msb = s.msb;
-      sig.lsb = s.lsb;
-      sig.size = s.size;
-      sig.is_signed = s.is_signed;
-      sig.factor = s.factor;
-      sig.offset = s.offset;
-      sig.is_little_endian = s.is_little_endian;
-      sig.updatePrecision();
-    }
+  const QByteArray data = content.toUtf8();
+  // files are cached by path, the hash of the content tells whether the cache is up to date.
+  const QString cache_file = filename.isEmpty() ? "" : QString::fromStdString(cacheFilePath(QFileInfo(filename).absoluteFilePath().toStdString()) + ".dbc");
+  const QByteArray hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+  if (cache_file.isEmpty() || !loadCache(cache_file, hash)) {
+    parse(data);
+    if (!cache_file.isEmpty()) saveCache(cache_file, hash);
   }
-  parseExtraInfo(content);
-
-  delete dbc;
 }
 
 bool DBCFile::save() {
@@ -194,62 +182,266 @@ QString DBCFile::name() const {
   return name_;
 }
 
-void DBCFile::parseExtraInfo(const QString &content) {
-  static QRegularExpression bo_regexp(R"(^BO_ (\w+) (\w+) *: (\w+) (\w+))");
-  static QRegularExpression sg_regexp(R"(^SG_ (\w+) : (\d+)\|(\d+)@(\d+)([\+|\-]) \(([0-9.+\-eE]+),([0-9.+\-eE]+)\) \[([0-9.+\-eE]+)\|([0-9.+\-eE]+)\] \"(.*)\" (.*))");
-  static QRegularExpression sgm_regexp(R"(^SG_ (\w+) (\w+) *: (\d+)\|(\d+)@(\d+)([\+|\-]) \(([0-9.+\-eE]+),([0-9.+\-eE]+)\) \[([0-9.+\-eE]+)\|([0-9.+\-eE]+)\] \"(.*)\" (.*))");
-  static QRegularExpression sg_comment_regexp(R"(^CM_ SG_ *(\w+) *(\w+) *\"(.*)\";)");
-  static QRegularExpression val_regexp(R"(VAL_ (\w+) (\w+) (.*);)");
-  auto get_sig = [this](uint32_t address, const QString &name) -> cabana::Signal * {
-    auto m = (cabana::Msg *)msg(address);
-    return m ? (cabana::Signal *)m->sig(name) : nullptr;
+namespace {
+
+inline std::string_view trim(std::string_view s) {
+  const char *ws = " \t\r\n";
+  const size_t begin = s.find_first_not_of(ws);
+  return begin == std::string_view::npos ? std::string_view{} : s.substr(begin, s.find_last_not_of(ws) - begin + 1);
+}
+
+inline bool startsWith(std::string_view s, std::string_view prefix) {
+  return s.substr(0, prefix.size()) == prefix;
+}
+
+template <class T>
+bool toInt(std::string_view s, T &out) {
+  uint64_t v = 0;
+  for (char c : s) {
+    if (c < '0' || c > '9' || (v = v * 10 + (c - '0')) > std::numeric_limits<T>::max()) return false;
+  }
+  out = v;
+  return !s.empty();
+}
+
+// independent of the locale, which QCoreApplication sets from the environment, unlike strtod.
+bool toDouble(std::string_view s, double &out) {
+  bool ok = false;
+  out = QByteArray::fromRawData(s.data(), s.size()).toDouble(&ok);
+  return ok;
+}
+
+inline QString toQString(std::string_view s) { return QString::fromUtf8(s.data(), s.size()); }
+
+// bit position of the big endian start bit of the i-th bit in the big endian bit order
+inline int flipBitPos(int i) { return (i / 8) * 8 + 7 - i % 8; }
+
+// reads the tokens of one line of a DBC file
+class DBCLine {
+public:
+  DBCLine(std::string_view line, size_t pos) : s(line), pos(pos) {}
+  std::string_view rest() const { return s.substr(pos); }
+  bool consume(char c) {
+    skipSpaces();
+    if (pos < s.size() && s[pos] == c) {
+      ++pos;
+      return true;
+    }
+    return false;
+  }
+  std::string_view word() {
+    return token([](char c) { return std::isalnum((unsigned char)c) || c == '_'; });
+  }
+  std::string_view number() {
+    return token([](char c) { return std::isdigit((unsigned char)c) || c == '.' || c == '+' || c == '-' || c == 'e' || c == 'E'; });
+  }
+  // the text up to the next c, c is consumed
+  bool until(char c, std::string_view &text) {
+    const size_t end = s.find(c, pos);
+    if (end == std::string_view::npos) return false;
+    text = s.substr(pos, end - pos);
+    pos = end + 1;
+    return true;
+  }
+
+private:
+  void skipSpaces() {
+    while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t')) ++pos;
+  }
+  template <class F>
+  std::string_view token(F is_token_char) {
+    skipSpaces();
+    const size_t begin = pos;
+    while (pos < s.size() && is_token_char(s[pos])) ++pos;
+    return s.substr(begin, pos - begin);
+  }
+
+  std::string_view s;
+  size_t pos;
+};
+
+}  // namespace
+
+// one pass over the content with a tokenizer instead of regular expressions. the string views point into
+// content, strings are only allocated for the names and texts that are kept.
+void DBCFile::parse(const QByteArray &content) {
+  msgs.clear();
+  const std::string_view text(content.constData(), content.size());
+  std::unordered_set<std::string_view> msg_names;
+  cabana::Msg *current_msg = nullptr;
+  size_t pos = 0;
+  int line_num = 0;
+
+  auto next_line = [&](std::string_view &line) {
+    if (pos >= text.size()) return false;
+    const size_t end = std::min(text.find('\n', pos), text.size());
+    line = trim(text.substr(pos, end - pos));
+    pos = end + 1;
+    ++line_num;
+    return true;
+  };
+  auto error = [&](const QString &msg, std::string_view line) {
+    throw std::runtime_error(QString("[%1:%2] %3: %4").arg(name_).arg(line_num).arg(msg, toQString(line)).toStdString());
+  };
+  auto get_sig = [this](std::string_view address, std::string_view name) -> cabana::Signal * {
+    uint32_t addr = 0;
+    auto it = toInt(address, addr) ? msgs.find(addr) : msgs.end();
+    if (it != msgs.end()) {
+      const QLatin1String sig_name(name.data(), name.size());
+      for (auto &s : it->second.sigs) {
+        if (s.name == sig_name) return &s;
+      }
+    }
+    return nullptr;
   };
 
-  QTextStream stream((QString *)&content);
-  uint32_t address = 0;
-  while (!stream.atEnd()) {
-    QString line = stream.readLine().trimmed();
-    if (line.startsWith("BO_ ")) {
-      if (auto match = bo_regexp.match(line); match.hasMatch()) {
-        address = match.captured(1).toUInt();
+  std::string_view line;
+  while (next_line(line)) {
+    if (startsWith(line, "BO_ ")) {
+      DBCLine l(line, 4);
+      uint32_t address = 0, size = 0;
+      const bool ok = toInt(l.word(), address);
+      const auto name = l.word();
+      if (!ok || name.empty() || !l.consume(':') || !toInt(l.word(), size) || l.word().empty()) {
+        error("bad BO", line);
       }
-    } else if (line.startsWith("SG_ ")) {
-      int offset = 0;
-      auto match = sg_regexp.match(line);
-      if (!match.hasMatch()) {
-        match = sgm_regexp.match(line);
-        offset = 1;
+      if (msgs.count(address)) error(QString("Duplicate message address %1").arg(address), line);
+      if (!msg_names.insert(name).second) error("Duplicate message name", line);
+
+      current_msg = &msgs[address];
+      current_msg->name = toQString(name);
+      current_msg->size = size;
+    } else if (startsWith(line, "SG_ ")) {
+      // SG_ name [multiplexer] : start_bit|size@endianness+ (factor,offset) [min|max] "unit" receivers
+      DBCLine l(line, 4);
+      cabana::Signal sig = {};
+      int endianness = 0;
+      double min_value = 0, max_value = 0;
+      std::string_view name = l.word(), min, max, unit;
+      bool ok = !name.empty() && (l.consume(':') || (!l.word().empty() && l.consume(':')));
+      ok = ok && toInt(l.word(), sig.start_bit) && l.consume('|') && toInt(l.word(), sig.size) && sig.size > 0;
+      ok = ok && l.consume('@') && toInt(l.word(), endianness) && endianness <= 1;
+      ok = ok && ((sig.is_signed = l.consume('-')) || l.consume('+'));
+      ok = ok && l.consume('(') && toDouble(l.number(), sig.factor) && l.consume(',') && toDouble(l.number(), sig.offset) && l.consume(')');
+      ok = ok && l.consume('[') && toDouble(min = l.number(), min_value) && l.consume('|') && toDouble(max = l.number(), max_value) && l.consume(']');
+      ok = ok && l.consume('"') && l.until('"', unit);
+      if (!ok) error("bad SG", line);
+      if (!current_msg) continue;
+
+      sig.name = toQString(name);
+      sig.is_little_endian = endianness == 1;
+      if (sig.is_little_endian) {
+        sig.lsb = sig.start_bit;
+        sig.msb = sig.start_bit + sig.size - 1;
+      } else {
+        sig.lsb = flipBitPos(flipBitPos(sig.start_bit) + sig.size - 1);
+        sig.msb = sig.start_bit;
       }
-      if (match.hasMatch()) {
-        if (auto s = get_sig(address, match.captured(1))) {
-          s->min = match.captured(8 + offset);
-          s->max = match.captured(9 + offset);
-          s->unit = match.captured(10 + offset);
-        }
+      if (sig.lsb >= 64 * 8 || sig.msb >= 64 * 8) error("Signal out of bounds", line);
+
+      sig.min = toQString(min);
+      sig.max = toQString(max);
+      sig.unit = toQString(unit);
+      sig.updatePrecision();
+      current_msg->sigs.push_back(sig);
+    } else if (startsWith(line, "VAL_ ")) {
+      // VAL_ address signal value "description" ... ;
+      DBCLine l(line, 5);
+      const auto address = l.word();
+      auto s = get_sig(address, l.word());
+      auto values = l.rest();
+      const size_t end = values.rfind(';');
+      if (!s || end == std::string_view::npos) continue;
+
+      values = values.substr(0, end);
+      for (size_t i = 0, quote = values.find('"'); quote != std::string_view::npos;) {
+        const auto val = trim(values.substr(i, quote - i));
+        size_t close = values.find('"', quote + 1);
+        const auto desc = trim(values.substr(quote + 1, close == std::string_view::npos ? close : close - quote - 1));
+        if (!val.empty()) s->val_desc.push_back({toQString(val), toQString(desc)});
+        if (close == std::string_view::npos) break;
+        i = close + 1;
+        quote = values.find('"', i);
       }
-    } else if (line.startsWith("VAL_ ")) {
-      if (auto match = val_regexp.match(line); match.hasMatch()) {
-        if (auto s = get_sig(match.captured(1).toUInt(), match.captured(2))) {
-          QStringList desc_list = match.captured(3).trimmed().split('"');
-          for (int i = 0; i < desc_list.size(); i += 2) {
-            auto val = desc_list[i].trimmed();
-            if (!val.isEmpty() && (i + 1) < desc_list.size()) {
-              auto desc = desc_list[i+1].trimmed();
-              s->val_desc.push_back({val, desc});
-            }
-          }
-        }
+    } else if (startsWith(line, "CM_ SG_ ")) {
+      // CM_ SG_ address signal "comment"; the comment may span lines
+      DBCLine l(line, 8);
+      const auto address = l.word();
+      auto s = get_sig(address, l.word());
+      if (!s || !l.consume('"')) continue;
+
+      const char *begin = l.rest().data();
+      const size_t next_pos = pos;
+      const int next_line_num = line_num;
+      std::string_view last = l.rest();
+      size_t end = std::string_view::npos;
+      while ((end = last.rfind("\";")) == std::string_view::npos && next_line(last)) {}
+      if (end != std::string_view::npos) {
+        s->comment = toQString(std::string_view(begin, last.data() + end - begin)).trimmed();
+      } else {
+        // not terminated, skip the line only
+        pos = next_pos;
+        line_num = next_line_num;
       }
-    } else if (line.startsWith("CM_ SG_ ")) {
-      if (auto match = sg_comment_regexp.match(line); match.hasMatch()) {
-        if (auto s = get_sig(match.captured(1).toUInt(), match.captured(2))) {
-          s->comment = match.captured(3).trimmed();
-        }
+    }
+  }
+}
+
+bool DBCFile::loadCache(const QString &cache_file, const QByteArray &hash) {
+  QFile f(cache_file);
+  if (!f.open(QIODevice::ReadOnly)) return false;
+
+  QDataStream in(&f);
+  int version = 0;
+  QByteArray content_hash;
+  in >> version >> content_hash;
+  if (version != DBC_CACHE_VERSION || content_hash != hash) return false;
+
+  std::map<uint32_t, cabana::Msg> cached;
+  quint32 msg_count = 0, sig_count = 0, val_count = 0;
+  in >> msg_count;
+  for (quint32 i = 0; i < msg_count && in.status() == QDataStream::Ok; ++i) {
+    quint32 address = 0;
+    in >> address;
+    auto &m = cached[address];
+    in >> m.name >> m.size >> sig_count;
+    for (quint32 j = 0; j < sig_count && in.status() == QDataStream::Ok; ++j) {
+      m.sigs.push_back({});
+      auto &s = m.sigs.last();
+      in >> s.name >> s.start_bit >> s.msb >> s.lsb >> s.size >> s.is_signed >> s.factor >> s.offset >> s.is_little_endian
+         >> s.min >> s.max >> s.unit >> s.comment >> val_count;
+      for (quint32 k = 0; k < val_count && in.status() == QDataStream::Ok; ++k) {
+        QString val, desc;
+        in >> val >> desc;
+        s.val_desc.push_back({val, desc});
       }
+      s.updatePrecision();
     }
   }
+  if (in.status() != QDataStream::Ok) return false;
+
+  msgs = std::move(cached);
+  return true;
 }
 
+void DBCFile::saveCache(const QString &cache_file, const QByteArray &hash) {
+  QSaveFile f(cache_file);
+  if (!f.open(QIODevice::WriteOnly)) return;
+
+  QDataStream out(&f);
+  out << DBC_CACHE_VERSION << hash << (quint32)msgs.size();
+  for (const auto &[address, m] : msgs) {
+    out << address << m.name << m.size << (quint32)m.sigs.size();
+    for (const auto &s : m.sigs) {
+      out << s.name << s.start_bit << s.msb << s.lsb << s.size << s.is_signed << s.factor << s.offset << s.is_little_endian
+          << s.min << s.max << s.unit << s.comment << (quint32)s.val_desc.size();
+      for (const auto &[val, desc] : s.val_desc) {
+        out << val << desc;
+      }
+    }
+  }
+  f.commit();
+}
 QString DBCFile::generateDBC() {
   QString dbc_string, signal_comment, val_desc;
   for (auto &[address, m] : msgs) {
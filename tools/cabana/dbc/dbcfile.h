@@ -49,7 +49,9 @@ public:
   QString filename;
 
 private:
-  void parseExtraInfo(const QString &content);
+  void parse(const QByteArray &content);
+  bool loadCache(const QString &cache_file, const QByteArray &hash);
+  void saveCache(const QString &cache_file, const QByteArray &hash);
   std::map<uint32_t, cabana::Msg> msgs;
   QString name_;
 };
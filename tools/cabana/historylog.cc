@@ -1,12 +1,20 @@
 #include "tools/cabana/historylog.h"
 
+#include <algorithm>
+
 #include <QPainter>
 #include <QPushButton>
 #include <QVBoxLayout>
+#include <QtConcurrent>
 
 #include "tools/cabana/commands.h"
 // HistoryLogModel
 
+HistoryLogModel::HistoryLogModel(QObject *parent) : QAbstractTableModel(parent) {
+  watcher = new QFutureWatcher<std::deque<Message>>(this);
+  QObject::connect(watcher, &QFutureWatcher<std::deque<Message>>::finished, this, &HistoryLogModel::pageFetched);
+}
+
 QVariant HistoryLogModel::data(const QModelIndex &index, int role) const {
   const bool show_signals = display_signals_mode && sigs.size() > 0;
   const auto &m = messages[index.row()];
@@ -31,6 +39,7 @@ void HistoryLogModel::setMessage(const MessageId &message_id) {
 }
 
 void HistoryLogModel::refresh(bool fetch_message) {
+  cancelFetch();
   beginResetModel();
   sigs.clear();
   if (auto dbc_msg = dbc()->msg(msg_id)) {
@@ -40,10 +49,10 @@ void HistoryLogModel::refresh(bool fetch_message) {
   has_more_data = true;
   messages.clear();
   hex_colors = {};
+  endResetModel();
   if (fetch_message) {
     updateState();
   }
-  endResetModel();
 }
 
 QVariant HistoryLogModel::headerData(int section, Qt::Orientation orientation, int role) const {
@@ -85,84 +94,212 @@ void HistoryLogModel::segmentsMerged() {
   }
 }
 
-void HistoryLogModel::setFilter(int sig_idx, const QString &value, std::function<bool(double, double)> cmp) {
-  filter_sig_idx = sig_idx;
-  filter_value = value.toDouble();
-  filter_cmp = value.isEmpty() ? nullptr : cmp;
+void HistoryLogModel::setFilter(int sig_idx, const QString &value, FilterType type) {
+  filter.sig_idx = sig_idx;
+  filter.value = value.toDouble();
+  filter.type = value.isEmpty() ? NoFilter : type;
+}
+
+bool HistoryLogModel::Filter::match(double v) const {
+  switch (type) {
+    case Greater: return v > value;
+    case Equal: return v == value;
+    case NotEqual: return v != value;
+    case Less: return v < value;
+    default: return true;
+  }
+}
+
+bool HistoryLogModel::Filter::mayMatch(double min, double max) const {
+  switch (type) {
+    case Greater: return max > value;
+    case Equal: return min <= value && value <= max;
+    case NotEqual: return min != value || max != value;
+    case Less: return min < value;
+    default: return true;
+  }
+}
+
+bool HistoryLogModel::IndexedEvents::update(const CanEvents &stream_events) {
+  if (stream_events.revision() != revision || stream_events.size() < events.size()) return false;
+
+  for (size_t i = events.size(); i < stream_events.size(); ++i) {
+    const CanEvent e = stream_events[i];
+    events.append(e.mono_time, e.dat, e.size);
+  }
+  return true;
+}
+
+void HistoryLogModel::IndexedEvents::buildZones(const SignalDecoder &decoder, const cabana::Signal &sig) {
+  if (zone_sig != sig) {
+    zones.clear();
+    zoned_events = 0;
+  }
+  // the last zone may be partial, it is rebuilt with the events appended since
+  const size_t start = zoned_events / ZONE_SIZE * ZONE_SIZE;
+  zones.resize(start / ZONE_SIZE);
+  zones.reserve((events.size() + ZONE_SIZE - 1) / ZONE_SIZE);
+  std::vector<double> values(ZONE_SIZE);
+  for (size_t i = start; i < events.size(); i += ZONE_SIZE) {
+    const size_t n = std::min(ZONE_SIZE, events.size() - i);
+    events.decode(decoder, events.begin() + i, events.begin() + i + n, values.data());
+    auto [min, max] = std::minmax_element(values.begin(), values.begin() + n);
+    zones.push_back({*min, *max});
+  }
+  zone_sig = sig;
+  zoned_events = events.size();
 }
 
 void HistoryLogModel::updateState() {
+  // the new messages are fetched after the pending page
+  if (fetching) return;
+
   uint64_t current_time = (can->lastMessage(msg_id).ts + can->routeStartTime()) * 1e9 + 1;
-  auto new_msgs = dynamic_mode ? fetchData(current_time, last_fetch_time) : fetchData(0);
-  if (!new_msgs.empty()) {
-    beginInsertRows({}, 0, new_msgs.size() - 1);
-    messages.insert(messages.begin(), std::move_iterator(new_msgs.begin()), std::move_iterator(new_msgs.end()));
-    endInsertRows();
+  if (dynamic_mode && last_fetch_time > 0) {
+    // only the events received since the last update, which are few enough to decode on the GUI thread
+    auto it = can->events().find(msg_id);
+    if (it == can->events().end()) return;
+
+    const auto &events = it->second;
+    std::vector<SignalDecoder> decoders;
+    for (auto sig : sigs) decoders.emplace_back(*sig);
+    auto new_msgs = fetchData(events, 0, events.lowerBound(current_time).index(), true, last_fetch_time, SIZE_MAX, decoders, filter, nullptr);
+    if (!new_msgs.empty()) {
+      if (!display_signals_mode || sigs.empty()) {
+        const auto freq = can->lastMessage(msg_id).freq;
+        for (auto it = new_msgs.rbegin(); it != new_msgs.rend(); ++it) {
+          hex_colors.compute(it->data.data(), it->data.size(), it->mono_time / (double)1e9, freq);
+          it->colors = hex_colors.colors;
+        }
+      }
+      beginInsertRows({}, 0, new_msgs.size() - 1);
+      messages.insert(messages.begin(), std::move_iterator(new_msgs.begin()), std::move_iterator(new_msgs.end()));
+      endInsertRows();
+    }
+  } else if (messages.empty()) {
+    fetchPage(dynamic_mode ? current_time : 0);
   }
-  has_more_data = new_msgs.size() >= batch_size;
   last_fetch_time = current_time;
 }
 
 void HistoryLogModel::fetchMore(const QModelIndex &parent) {
-  if (!messages.empty()) {
-    auto new_msgs = fetchData(messages.back().mono_time);
-    if (!new_msgs.empty()) {
-      beginInsertRows({}, messages.size(), messages.size() + new_msgs.size() - 1);
-      messages.insert(messages.end(), std::move_iterator(new_msgs.begin()), std::move_iterator(new_msgs.end()));
-      endInsertRows();
-    }
-    has_more_data = new_msgs.size() >= batch_size;
+  if (!messages.empty() && !fetching) {
+    fetchPage(messages.back().mono_time);
   }
 }
 
-template <class InputIt>
-std::deque<HistoryLogModel::Message> HistoryLogModel::fetchData(InputIt first, InputIt last, uint64_t min_time) {
-  std::deque<HistoryLogModel::Message> msgs;
-  QVector<double> values(sigs.size());
-  for (; first != last && first->mono_time > min_time; ++first) {
-    for (int i = 0; i < sigs.size(); ++i) {
-      values[i] = get_raw_value(first->dat, first->size, *sigs[i]);
-    }
-    if (!filter_cmp || filter_cmp(values[filter_sig_idx], filter_value)) {
-      auto &m = msgs.emplace_back();
-      m.mono_time = first->mono_time;
-      m.data = QByteArray((const char *)first->dat, first->size);
-      m.sig_values = values;
-      if (msgs.size() >= batch_size && min_time == 0) {
-        return msgs;
-      }
+void HistoryLogModel::fetchPage(uint64_t from_time) {
+  auto it = can->events().find(msg_id);
+  if (it == can->events().end()) {
+    has_more_data = false;
+    return;
+  }
+
+  // the stream keeps merging events into its store on the GUI thread, the page is fetched from a copy.
+  // no fetch is running on the copy here, so it's extended with the new events unless older ones changed.
+  const auto &events = it->second;
+  if (!indexed_events || indexed_events->id != msg_id || !indexed_events->update(events)) {
+    indexed_events = std::make_shared<IndexedEvents>();
+    indexed_events->id = msg_id;
+    indexed_events->events = events;
+    indexed_events->revision = events.revision();
+  }
+
+  std::vector<SignalDecoder> decoders;
+  for (auto sig : sigs) decoders.emplace_back(*sig);
+  std::optional<cabana::Signal> filter_sig;
+  if (filter.type != NoFilter) filter_sig = *sigs[filter.sig_idx];
+
+  fetching = true;
+  watcher->setFuture(QtConcurrent::run([indexed = indexed_events, decoders = std::move(decoders), filter = filter, filter_sig,
+                                        reverse = dynamic_mode, from_time, max_rows = (size_t)batch_size]() {
+    const auto &events = indexed->events;
+    if (filter_sig && (indexed->zone_sig != filter_sig || indexed->zoned_events != events.size())) {
+      indexed->buildZones(decoders[filter.sig_idx], *filter_sig);
     }
+    const size_t first = reverse ? 0 : events.upperBound(from_time).index();
+    const size_t last = reverse ? events.lowerBound(from_time).index() : events.size();
+    return fetchData(events, first, last, reverse, 0, max_rows, decoders, filter, filter_sig ? &indexed->zones : nullptr);
+  }));
+}
+
+void HistoryLogModel::pageFetched() {
+  if (watcher->isCanceled()) return;
+
+  fetching = false;
+  auto new_msgs = watcher->result();
+  // the colors of the first page are computed from the oldest message in dynamic mode
+  if ((!display_signals_mode || sigs.empty()) && (!dynamic_mode || messages.empty())) {
+    const auto freq = can->lastMessage(msg_id).freq;
+    auto compute = [&](Message &m) {
+      hex_colors.compute(m.data.data(), m.data.size(), m.mono_time / (double)1e9, freq);
+      m.colors = hex_colors.colors;
+    };
+    dynamic_mode ? std::for_each(new_msgs.rbegin(), new_msgs.rend(), compute) : std::for_each(new_msgs.begin(), new_msgs.end(), compute);
+  }
+  if (!new_msgs.empty()) {
+    beginInsertRows({}, messages.size(), messages.size() + new_msgs.size() - 1);
+    messages.insert(messages.end(), std::move_iterator(new_msgs.begin()), std::move_iterator(new_msgs.end()));
+    endInsertRows();
+  }
+  has_more_data = new_msgs.size() >= batch_size;
+}
+
+void HistoryLogModel::cancelFetch() {
+  if (fetching) {
+    watcher->cancel();
+    // the canceled fetch may still be indexing the copy
+    indexed_events.reset();
+    fetching = false;
   }
-  return msgs;
 }
 
-std::deque<HistoryLogModel::Message> HistoryLogModel::fetchData(uint64_t from_time, uint64_t min_time) {
-  const auto &events = can->events().at(msg_id);
-  const auto freq = can->lastMessage(msg_id).freq;
-  const bool update_colors = !display_signals_mode || sigs.empty();
-
-  if (dynamic_mode) {
-    auto first = std::upper_bound(events.rbegin(), events.rend(), CanEvent{.mono_time=from_time}, std::greater<CanEvent>());
-    auto msgs = fetchData(first, events.rend(), min_time);
-    if (update_colors && (min_time > 0 || messages.empty())) {
-      for (auto it = msgs.rbegin(); it != msgs.rend(); ++it) {
-        hex_colors.compute(it->data.data(), it->data.size(), it->mono_time / (double)1e9, freq);
-        it->colors = hex_colors.colors;
+std::deque<HistoryLogModel::Message> HistoryLogModel::fetchData(const CanEvents &events, size_t first, size_t last, bool reverse, uint64_t min_time,
+                                                                size_t max_rows, const std::vector<SignalDecoder> &decoders, const Filter &filter,
+                                                                const std::vector<std::pair<double, double>> *zones) {
+  std::deque<HistoryLogModel::Message> msgs;
+  QVector<double> values(decoders.size());
+  // returns false to stop
+  auto visit = [&](size_t i) {
+    const CanEvent e = events[i];
+    if (e.mono_time <= min_time) return false;
+
+    // the filter signal is decoded first, the others only for the matched events
+    if (filter.type != NoFilter && !filter.match(values[filter.sig_idx] = decoders[filter.sig_idx].decode(e.dat, e.size))) return true;
+
+    for (int j = 0; j < decoders.size(); ++j) {
+      if (j != filter.sig_idx || filter.type == NoFilter) values[j] = decoders[j].decode(e.dat, e.size);
+    }
+    auto &m = msgs.emplace_back();
+    m.mono_time = e.mono_time;
+    m.data = QByteArray((const char *)e.dat, e.size);
+    m.sig_values = values;
+    return msgs.size() < max_rows;
+  };
+  auto skip = [&](size_t i) {
+    if (!zones) return false;
+    auto &[min, max] = (*zones)[i / IndexedEvents::ZONE_SIZE];
+    return !filter.mayMatch(min, max);
+  };
+
+  if (reverse) {
+    for (size_t i = last; i > first;) {
+      if (skip(i - 1)) {
+        i = std::max(first, (i - 1) / IndexedEvents::ZONE_SIZE * IndexedEvents::ZONE_SIZE);
+      } else if (!visit(--i)) {
+        break;
       }
     }
-    return msgs;
   } else {
-    assert(min_time == 0);
-    auto first = std::upper_bound(events.begin(), events.end(), CanEvent{.mono_time=from_time});
-    auto msgs = fetchData(first, events.end(), 0);
-    if (update_colors) {
-      for (auto it = msgs.begin(); it != msgs.end(); ++it) {
-        hex_colors.compute(it->data.data(), it->data.size(), it->mono_time / (double)1e9, freq);
-        it->colors = hex_colors.colors;
+    for (size_t i = first; i < last;) {
+      if (skip(i)) {
+        i = (i / IndexedEvents::ZONE_SIZE + 1) * IndexedEvents::ZONE_SIZE;
+      } else if (!visit(i++)) {
+        break;
       }
     }
-    return msgs;
   }
+  return msgs;
 }
 
 // HeaderView
@@ -255,7 +392,7 @@ void LogsWidget::setMessage(const MessageId &message_id) {
 }
 
 void LogsWidget::refresh() {
-  model->setFilter(0, "", nullptr);
+  model->setFilter(0, "", HistoryLogModel::NoFilter);
   model->refresh(isVisible());
   bool has_signal = model->sigs.size();
   if (has_signal) {
@@ -273,14 +410,8 @@ void LogsWidget::refresh() {
 void LogsWidget::setFilter() {
   if (value_edit->text().isEmpty() && !value_edit->isModified()) return;
 
-  std::function<bool(double, double)> cmp = nullptr;
-  switch (comp_box->currentIndex()) {
-    case 0: cmp = std::greater<double>{}; break;
-    case 1: cmp = std::equal_to<double>{}; break;
-    case 2: cmp = [](double l, double r) { return l != r; }; break; // not equal
-    case 3: cmp = std::less<double>{}; break;
-  }
-  model->setFilter(signals_cb->currentIndex(), value_edit->text(), cmp);
+  auto type = (HistoryLogModel::FilterType)(comp_box->currentIndex() + HistoryLogModel::Greater);
+  model->setFilter(signals_cb->currentIndex(), value_edit->text(), type);
   model->refresh();
 }
 
@@ -1,8 +1,13 @@
 #pragma once
 
 #include <deque>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
 #include <QCheckBox>
 #include <QComboBox>
+#include <QFutureWatcher>
 #include <QHeaderView>
 #include <QLineEdit>
 #include <QTableView>
@@ -22,14 +27,16 @@ class HistoryLogModel : public QAbstractTableModel {
   Q_OBJECT
 
 public:
-  HistoryLogModel(QObject *parent) : QAbstractTableModel(parent) {}
+  enum FilterType { NoFilter, Greater, Equal, NotEqual, Less };  // NoFilter, then the order of the compare combobox
+
+  HistoryLogModel(QObject *parent);
   void setMessage(const MessageId &message_id);
   void updateState();
-  void setFilter(int sig_idx, const QString &value, std::function<bool(double, double)> cmp);
+  void setFilter(int sig_idx, const QString &value, FilterType type);
   QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const override;
   QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
   void fetchMore(const QModelIndex &parent) override;
-  inline bool canFetchMore(const QModelIndex &parent) const override { return has_more_data; }
+  inline bool canFetchMore(const QModelIndex &parent) const override { return has_more_data && !fetching; }
   int rowCount(const QModelIndex &parent = QModelIndex()) const override { return messages.size(); }
   int columnCount(const QModelIndex &parent = QModelIndex()) const override {
     return display_signals_mode && !sigs.empty() ? sigs.size() + 1 : 2;
@@ -49,22 +56,55 @@ public:
     QVector<QColor> colors;
   };
 
-  template <class InputIt>
-  std::deque<HistoryLogModel::Message> fetchData(InputIt first, InputIt last, uint64_t min_time);
-  std::deque<Message> fetchData(uint64_t from_time, uint64_t min_time = 0);
+  struct Filter {
+    int sig_idx = -1;
+    FilterType type = NoFilter;
+    double value = 0;
+    bool match(double v) const;
+    // false if no value in [min, max] can match
+    bool mayMatch(double min, double max) const;
+  };
+
+  // a copy of the events of the message for the fetch thread, with block-level min/max zone maps
+  // of the filter signal to skip the blocks that can't match the filter. the events appended to the
+  // stream since are appended to the copy, and the zones extended over them.
+  struct IndexedEvents {
+    static constexpr size_t ZONE_SIZE = 1024;
+    // false if the events changed other than by new events at the end
+    bool update(const CanEvents &stream_events);
+    void buildZones(const SignalDecoder &decoder, const cabana::Signal &sig);
+
+    MessageId id;
+    CanEvents events;
+    uint32_t revision = 0;  // of the stream's events
+    std::optional<cabana::Signal> zone_sig;
+    std::vector<std::pair<double, double>> zones;
+    size_t zoned_events = 0;  // events covered by zones
+  };
+
+  // decodes the events in [first, last) which match the filter, newest first if reverse. stops at the first event
+  // not newer than min_time or when max_rows messages are found. zones are skipped if not null.
+  static std::deque<Message> fetchData(const CanEvents &events, size_t first, size_t last, bool reverse, uint64_t min_time, size_t max_rows,
+                                       const std::vector<SignalDecoder> &decoders, const Filter &filter,
+                                       const std::vector<std::pair<double, double>> *zones);
+  // fetches the next page of messages after from_time on the fetch thread
+  void fetchPage(uint64_t from_time);
+  void pageFetched();
+  void cancelFetch();
 
   MessageId msg_id;
   CanData hex_colors;
   bool has_more_data = true;
+  bool fetching = false;
   const int batch_size = 50;
-  int filter_sig_idx = -1;
-  double filter_value = 0;
+  Filter filter;
   uint64_t last_fetch_time = 0;
-  std::function<bool(double, double)> filter_cmp = nullptr;
   std::deque<Message> messages;
   std::vector<const cabana::Signal *> sigs;
   bool dynamic_mode = true;
   bool display_signals_mode = true;
+  std::shared_ptr<IndexedEvents> indexed_events;
+  QFutureWatcher<std::deque<Message>> *watcher;
 };
 
 class LogsWidget : public QFrame {
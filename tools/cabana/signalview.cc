@@ -417,17 +417,18 @@ void SignalItemDelegate::drawSparkline(QPainter *painter, const QRect &rect, con
   const auto &msgs = can->events().at(msg_id);
 
   uint64_t ts = (can->lastMessage(msg_id).ts + can->routeStartTime()) * 1e9;
-  auto first = std::lower_bound(msgs.cbegin(), msgs.cend(), CanEvent{.mono_time = (uint64_t)std::max<int64_t>(ts - settings.sparkline_range * 1e9, 0)});
-  auto last = std::upper_bound(first, msgs.cend(), CanEvent{.mono_time = ts});
+  auto first = msgs.lowerBound(std::max<int64_t>(ts - settings.sparkline_range * 1e9, 0));
+  auto last = msgs.upperBound(ts);
 
   if (first != last) {
     double min = std::numeric_limits<double>::max();
     double max = std::numeric_limits<double>::lowest();
     const auto item = (const SignalModel::Item *)index.internalPointer();
     const auto sig = item->sig;
+    const SignalDecoder decoder(*sig);
     points.clear();
     for (auto it = first; it != last; ++it) {
-      double value = get_raw_value(it->dat, it->size, *sig);
+      double value = decoder.decode(it->dat, it->size);
       points.emplace_back((it->mono_time - first->mono_time) / 1e9, value);
       min = std::min(min, value);
       max = std::max(max, value);
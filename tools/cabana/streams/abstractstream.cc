@@ -1,5 +1,11 @@
 #include "tools/cabana/streams/abstractstream.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <QThread>
 #include <QTimer>
+#include <QtConcurrent>
 
 AbstractStream *can = nullptr;
 
@@ -10,6 +16,10 @@ AbstractStream::AbstractStream(QObject *parent, bool is_live_streaming) : is_liv
   QObject::connect(this, &AbstractStream::seekedTo, this, &AbstractStream::updateLastMsgsTo);
 }
 
+AbstractStream::~AbstractStream() {
+  merge_futures.waitForFinished();
+}
+
 void AbstractStream::process(QHash<MessageId, CanData> *messages) {
   auto prev_src_size = sources.size();
   for (auto it = messages->begin(); it != messages->end(); ++it) {
@@ -68,14 +78,15 @@ void AbstractStream::updateLastMsgsTo(double sec) {
   all_msgs.clear();
   last_msgs.clear();
 
-  CanEvent last_event = {.mono_time = uint64_t((sec + routeStartTime()) * 1e9)};
+  const uint64_t last_ts = (sec + routeStartTime()) * 1e9;
   for (auto &[id, e] : events_) {
-    auto it = std::lower_bound(e.crbegin(), e.crend(), last_event, std::greater<CanEvent>());
-    if (it != e.crend()) {
+    auto it = e.upperBound(last_ts);
+    if (it != e.begin()) {
+      --it;
       double ts = it->mono_time / 1e9 - routeStartTime();
       auto &m = all_msgs[id];
       m.compute((const char *)it->dat, it->size, ts);
-      m.count = std::distance(it, e.crend());
+      m.count = it.index() + 1;
       m.freq = m.count / std::max(1.0, ts);
     }
   }
@@ -87,39 +98,348 @@ void AbstractStream::updateLastMsgsTo(double sec) {
   });
 }
 
-void AbstractStream::parseEvents(std::unordered_map<MessageId, std::deque<CanEvent>> &msgs,
-                                 std::vector<Event *>::const_iterator first, std::vector<Event *>::const_iterator last) {
-  uint64_t ts = 0;
-  for (; first != last; ++first) {
-    if ((*first)->which == cereal::Event::Which::CAN) {
-      ts = (*first)->mono_time;
-      for (const auto &c : (*first)->event.getCan()) {
-        auto dat = c.getDat();
-        auto &m = msgs[{.source = c.getSrc(), .address = c.getAddress()}].emplace_back();
-        m.size = std::min(dat.size(), std::size(m.dat));
-        memcpy(m.dat, (uint8_t *)dat.begin(), m.size);
-        m.mono_time = ts;
+std::unordered_map<MessageId, CanEvents> AbstractStream::parseEvents(std::vector<Event *>::const_iterator first,
+                                                                     std::vector<Event *>::const_iterator last) {
+  struct Shard {
+    std::vector<Event *>::const_iterator first, last;
+    std::unordered_map<MessageId, CanEvents> msgs;
+  };
+  // split the events into consecutive ranges, the results are concatenated in order.
+  const size_t min_shard_size = 50000;
+  const size_t count = std::distance(first, last);
+  const size_t shard_count = std::clamp<size_t>(count / min_shard_size, 1, QThread::idealThreadCount());
+  std::vector<Shard> shards(shard_count);
+  for (size_t i = 0; i < shard_count; ++i) {
+    shards[i].first = first + count * i / shard_count;
+    shards[i].last = first + count * (i + 1) / shard_count;
+  }
+
+  QtConcurrent::blockingMap(shards, [](Shard &shard) {
+    for (auto it = shard.first; it != shard.last; ++it) {
+      if ((*it)->which == cereal::Event::Which::CAN) {
+        const uint64_t ts = (*it)->mono_time;
+        for (const auto &c : (*it)->event.getCan()) {
+          auto dat = c.getDat();
+          shard.msgs[{.source = c.getSrc(), .address = c.getAddress()}].append(ts, (const uint8_t *)dat.begin(), std::min<size_t>(dat.size(), 64));
+        }
       }
     }
+    for (auto &[id, e] : shard.msgs) {
+      e.finishAppend();
+    }
+  });
+
+  auto msgs = std::move(shards[0].msgs);
+  for (size_t i = 1; i < shard_count; ++i) {
+    for (auto &[id, e] : shards[i].msgs) {
+      msgs[id].insert(std::move(e));
+    }
+  }
+  return msgs;
+}
+
+void AbstractStream::mergeEvents(std::vector<Event *>::const_iterator first, std::vector<Event *>::const_iterator last) {
+  if (first != last) {
+    mergeEvents(parseEvents(first, last));
   }
-  last_event_ts = std::max(last_event_ts, ts);
 }
 
-void AbstractStream::mergeEvents(std::vector<Event *>::const_iterator first, std::vector<Event *>::const_iterator last, bool append) {
-  if (first == last) return;
+void AbstractStream::mergeEvents(std::unordered_map<MessageId, CanEvents> &&msgs) {
+  // merged one by one on the GUI thread up to this number of events, the others are copied as columns
+  const size_t max_interleaved_events = 10000;
 
-  if (append) {
-    parseEvents(events_, first, last);
-  } else {
-    std::unordered_map<MessageId, std::deque<CanEvent>> new_events;
-    parseEvents(new_events, first, last);
-    for (auto &[id, new_e] : new_events) {
-      auto &e = events_[id];
-      auto it = std::upper_bound(e.cbegin(), e.cend(), new_e.front());
-      e.insert(it, new_e.cbegin(), new_e.cend());
+  struct Merge {
+    MessageId id;
+    CanEvents events, other;
+    uint32_t revision;
+    size_t size;
+  };
+  auto merges = std::make_shared<std::vector<Merge>>();
+  for (auto &[id, e] : msgs) {
+    last_event_ts = std::max(last_event_ts, e.back().mono_time);
+    auto &events = events_[id];
+    if (events.interleaved(e) > max_interleaved_events) {
+      merges->push_back({id, events, std::move(e), events.revision(), events.size()});
+    } else {
+      events.insert(std::move(e));
     }
   }
   emit eventsMerged();
+  if (merges->empty()) return;
+
+  merge_futures.addFuture(QtConcurrent::run([this, merges]() {
+    for (auto &m : *merges) {
+      m.events.insert(CanEvents(m.other));
+    }
+    QMetaObject::invokeMethod(this, [this, merges]() {
+      // the merged copy is outdated if the events changed meanwhile, then they are merged here
+      for (auto &m : *merges) {
+        auto &events = events_[m.id];
+        if (events.revision() == m.revision && events.size() == m.size) {
+          events = std::move(m.events);
+        } else {
+          events.insert(std::move(m.other));
+        }
+      }
+      emit eventsMerged();
+    }, Qt::QueuedConnection);
+  }));
+}
+
+// CanEvents
+
+void CanEvents::append(uint64_t mono_time, const uint8_t *dat, uint8_t size) {
+  const size_t n = ts_offsets_.size();
+  if (n > 0 && mono_time < monoTime(n - 1)) {
+    // events at the boundary of segments may be out of order
+    late_.push_back({mono_time, (uint32_t)late_dat_.size(), size});
+    late_dat_.insert(late_dat_.end(), dat, dat + size);
+    return;
+  }
+
+  if (blocks_.empty() || mono_time - blocks_.back().base > std::numeric_limits<uint32_t>::max()) {
+    blocks_.push_back({mono_time, (uint32_t)n});
+  }
+  ts_offsets_.push_back(mono_time - blocks_.back().base);
+
+  if (n == 0) {
+    dat_size_ = size;
+  } else if (dat_offsets_.empty() && size != dat_size_) {
+    dat_offsets_.resize(n + 1);
+    for (size_t i = 0; i <= n; ++i) {
+      dat_offsets_[i] = i * dat_size_;
+    }
+  }
+  dat_.insert(dat_.end(), dat, dat + size);
+  if (!dat_offsets_.empty()) {
+    dat_offsets_.push_back(dat_.size());
+  }
+}
+
+void CanEvents::finishAppend() {
+  if (late_.empty()) return;
+
+  std::stable_sort(late_.begin(), late_.end(), [](const LateEvent &l, const LateEvent &r) { return l.mono_time < r.mono_time; });
+  CanEvents late;
+  for (const auto &e : late_) {
+    late.append(e.mono_time, &late_dat_[e.offset], e.size);
+  }
+  late_ = {};
+  late_dat_ = {};
+  insert(std::move(late));
+}
+
+void CanEvents::insert(CanEvents &&other) {
+  if (other.empty()) return;
+
+  if (empty()) {
+    concat(std::move(other));
+    return;
+  }
+
+  // only the overlapping events are merged one by one, events at the same time are kept after the existing ones.
+  // the others are moved as columns, so a segment before or after the events costs a copy of the columns.
+  const auto [lo, hi, other_lo, other_hi] = split(other);
+  // the existing events keep their indexes only if other comes after them
+  const uint32_t revision = lo < size() ? revision_ + 1 : revision_;
+  CanEvents merged;
+  for (size_t i = lo, j = other_lo; i < hi || j < other_hi;) {
+    const CanEvent e = (j == other_hi || (i < hi && monoTime(i) <= other.monoTime(j))) ? (*this)[i++] : other[j++];
+    merged.append(e.mono_time, e.dat, e.size);
+  }
+  CanEvents after = other.slice(other_hi, other.size());
+  CanEvents tail = hi == 0 ? std::move(*this) : slice(hi, size());
+
+  truncate(lo);
+  other.truncate(other_lo);
+  concat(std::move(other));
+  concat(std::move(merged));
+  concat(std::move(after));
+  concat(std::move(tail));
+  revision_ = revision;
+}
+
+size_t CanEvents::interleaved(const CanEvents &other) const {
+  if (empty() || other.empty()) return 0;
+
+  const auto [lo, hi, other_lo, other_hi] = split(other);
+  return (hi - lo) + (other_hi - other_lo);
+}
+
+CanEvents::Split CanEvents::split(const CanEvents &other) const {
+  // the events up to the first of other come before it, the ones after the last of other come after it
+  const size_t lo = upperBound(other.monoTime(0)).index();
+  const size_t hi = upperBound(other.monoTime(other.size() - 1)).index();
+  if (lo == hi) return {lo, hi, other.size(), other.size()};
+
+  // the events of other before [lo, hi) come right after lo, the ones not before its last event after hi
+  return {lo, hi, other.lowerBound(monoTime(lo)).index(), other.lowerBound(monoTime(hi - 1)).index()};
+}
+
+CanEvents CanEvents::slice(size_t first, size_t last) const {
+  CanEvents s;
+  if (first >= last) return s;
+
+  for (size_t b = blockIndex(first); b < blocks_.size() && blocks_[b].first < last; ++b) {
+    s.blocks_.push_back({blocks_[b].base, uint32_t(std::max<size_t>(blocks_[b].first, first) - first)});
+  }
+  s.ts_offsets_.assign(ts_offsets_.begin() + first, ts_offsets_.begin() + last);
+  s.dat_size_ = dat_size_;
+  if (dat_offsets_.empty()) {
+    s.dat_.assign(dat_.begin() + first * dat_size_, dat_.begin() + last * dat_size_);
+  } else {
+    s.dat_.assign(dat_.begin() + dat_offsets_[first], dat_.begin() + dat_offsets_[last]);
+    s.dat_offsets_.reserve(last - first + 1);
+    for (size_t i = first; i <= last; ++i) {
+      s.dat_offsets_.push_back(dat_offsets_[i] - dat_offsets_[first]);
+    }
+  }
+  return s;
+}
+
+void CanEvents::truncate(size_t n) {
+  if (n >= size()) return;
+
+  if (n == 0) {
+    const uint32_t revision = revision_;
+    *this = {};
+    revision_ = revision;
+    return;
+  }
+  blocks_.erase(std::lower_bound(blocks_.begin(), blocks_.end(), n, [](const Block &b, size_t n) { return b.first < n; }), blocks_.end());
+  ts_offsets_.resize(n);
+  if (dat_offsets_.empty()) {
+    dat_.resize(n * dat_size_);
+  } else {
+    dat_.resize(dat_offsets_[n]);
+    dat_offsets_.resize(n + 1);
+  }
+}
+
+void CanEvents::concat(CanEvents &&other) {
+  if (other.empty()) return;
+
+  const size_t n = size();
+  if (n == 0) {
+    const uint32_t revision = revision_;
+    *this = std::move(other);
+    revision_ = revision;
+    return;
+  }
+
+  // the blocks of other keep their bases, except a first block starting before the last event, which would
+  // break the search of bound(). it is rebased on its first event.
+  if (const uint64_t first_ts = other.monoTime(0); other.blocks_[0].base < monoTime(n - 1)) {
+    const uint32_t shift = first_ts - other.blocks_[0].base;
+    const size_t end = other.blocks_.size() > 1 ? other.blocks_[1].first : other.size();
+    for (size_t i = 0; i < end; ++i) {
+      other.ts_offsets_[i] -= shift;
+    }
+    other.blocks_[0].base = first_ts;
+  }
+  for (const auto &b : other.blocks_) {
+    blocks_.push_back({b.base, uint32_t(b.first + n)});
+  }
+  ts_offsets_.insert(ts_offsets_.end(), other.ts_offsets_.begin(), other.ts_offsets_.end());
+
+  if (dat_offsets_.empty() && other.dat_offsets_.empty() && dat_size_ == other.dat_size_) {
+    dat_.insert(dat_.end(), other.dat_.begin(), other.dat_.end());
+    return;
+  }
+  if (dat_offsets_.empty()) {
+    dat_offsets_.resize(n + 1);
+    for (size_t i = 0; i <= n; ++i) {
+      dat_offsets_[i] = i * dat_size_;
+    }
+  }
+  const uint32_t dat_base = dat_.size();
+  dat_.insert(dat_.end(), other.dat_.begin(), other.dat_.end());
+  for (size_t i = 1; i <= other.size(); ++i) {
+    dat_offsets_.push_back(dat_base + (other.dat_offsets_.empty() ? i * other.dat_size_ : other.dat_offsets_[i]));
+  }
+}
+
+void CanEvents::removeBefore(uint64_t ts) {
+  const size_t n = lowerBound(ts).index();
+  if (n == 0) return;
+
+  ++revision_;
+  // the offsets of the remaining events are kept, as are the bases of their blocks
+  auto b = std::prev(std::upper_bound(blocks_.begin(), blocks_.end(), n, [](size_t n, const Block &b) { return n < b.first; }));
+  blocks_.erase(blocks_.begin(), b);
+  for (auto &block : blocks_) {
+    block.first = block.first > n ? block.first - n : 0;
+  }
+  ts_offsets_.erase(ts_offsets_.begin(), ts_offsets_.begin() + n);
+  if (dat_offsets_.empty()) {
+    dat_.erase(dat_.begin(), dat_.begin() + n * dat_size_);
+  } else {
+    const uint32_t removed = dat_offsets_[n];
+    dat_.erase(dat_.begin(), dat_.begin() + removed);
+    dat_offsets_.erase(dat_offsets_.begin(), dat_offsets_.begin() + n);
+    for (auto &offset : dat_offsets_) {
+      offset -= removed;
+    }
+  }
+  if (empty()) {
+    const uint32_t revision = revision_;
+    *this = {};
+    revision_ = revision;
+  }
+}
+
+CanEvent CanEvents::operator[](size_t i) const {
+  if (dat_offsets_.empty()) {
+    return {.mono_time = monoTime(i), .size = dat_size_, .dat = dat_.data() + i * dat_size_};
+  }
+  return {.mono_time = monoTime(i), .size = uint8_t(dat_offsets_[i + 1] - dat_offsets_[i]), .dat = dat_.data() + dat_offsets_[i]};
+}
+
+size_t CanEvents::blockIndex(size_t i) const {
+  if (blocks_.size() == 1) return 0;
+
+  auto it = std::upper_bound(blocks_.begin(), blocks_.end(), i, [](size_t i, const Block &b) { return i < b.first; });
+  return std::distance(blocks_.begin(), it) - 1;
+}
+
+CanEvents::const_iterator CanEvents::lowerBound(uint64_t ts) const {
+  return bound(ts, false);
+}
+
+CanEvents::const_iterator CanEvents::upperBound(uint64_t ts) const {
+  return bound(ts, true);
+}
+
+CanEvents::const_iterator CanEvents::bound(uint64_t ts, bool upper) const {
+  // the last block starting before ts (lower bound) or at ts (upper bound), the result is either in
+  // this block or is the first event of the next one.
+  auto b = upper ? std::upper_bound(blocks_.begin(), blocks_.end(), ts, [](uint64_t ts, const Block &b) { return ts < b.base; })
+                 : std::lower_bound(blocks_.begin(), blocks_.end(), ts, [](const Block &b, uint64_t ts) { return b.base < ts; });
+  if (b == blocks_.begin()) return begin();
+
+  --b;
+  auto first = ts_offsets_.begin() + b->first;
+  auto last = std::next(b) == blocks_.end() ? ts_offsets_.end() : ts_offsets_.begin() + std::next(b)->first;
+  const uint64_t offset = ts - b->base;
+  auto it = offset > std::numeric_limits<uint32_t>::max() ? last
+            : upper ? std::upper_bound(first, last, (uint32_t)offset)
+                    : std::lower_bound(first, last, (uint32_t)offset);
+  return {this, size_t(it - ts_offsets_.begin())};
+}
+
+void CanEvents::decode(const SignalDecoder &decoder, const_iterator first, const_iterator last, double *out) const {
+  if (dat_offsets_.empty()) {
+    decoder.decode(dat_.data() + first.index() * dat_size_, dat_size_, last - first, out);
+  } else {
+    for (auto it = first; it != last; ++it) {
+      *out++ = decoder.decode(it->dat, it->size);
+    }
+  }
+}
+
+size_t CanEvents::memoryUsage() const {
+  return sizeof(*this) + blocks_.capacity() * sizeof(Block) + ts_offsets_.capacity() * sizeof(uint32_t) +
+         dat_.capacity() + dat_offsets_.capacity() * sizeof(uint32_t);
 }
 
 // CanData
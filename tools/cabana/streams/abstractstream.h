@@ -2,9 +2,10 @@
 
 #include <array>
 #include <atomic>
-#include <deque>
+#include <iterator>
 #include <unordered_map>
 #include <QColor>
+#include <QFutureSynchronizer>
 #include <QHash>
 
 #include "tools/cabana/dbc/dbcmanager.h"
@@ -27,9 +28,114 @@ struct CanData {
 struct CanEvent {
   uint64_t mono_time = 0;
   uint8_t size = 0;
-  uint8_t dat[64] = {};
-  inline bool operator<(const CanEvent &r) const { return mono_time < r.mono_time; }
-  inline bool operator>(const CanEvent &r) const { return mono_time > r.mono_time; }
+  const uint8_t *dat = nullptr;
+};
+
+// the events of one message stored by column. timestamps are stored as 32 bit offsets from the
+// start of their block, a new block starts when an offset overflows. payloads are packed by their
+// actual size, with an offset table only if the size of the message varies.
+class CanEvents {
+public:
+  class const_iterator {
+  public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = CanEvent;
+    using difference_type = std::ptrdiff_t;
+    using reference = CanEvent;
+    struct pointer {
+      CanEvent e;
+      const CanEvent *operator->() const { return &e; }
+    };
+
+    const_iterator() = default;
+    const_iterator(const CanEvents *events, size_t i) : events_(events), i_(i) {}
+    CanEvent operator*() const { return (*events_)[i_]; }
+    pointer operator->() const { return {(*events_)[i_]}; }
+    CanEvent operator[](difference_type n) const { return (*events_)[i_ + n]; }
+    const_iterator &operator++() { ++i_; return *this; }
+    const_iterator operator++(int) { auto tmp = *this; ++i_; return tmp; }
+    const_iterator &operator--() { --i_; return *this; }
+    const_iterator operator--(int) { auto tmp = *this; --i_; return tmp; }
+    const_iterator &operator+=(difference_type n) { i_ += n; return *this; }
+    const_iterator &operator-=(difference_type n) { i_ -= n; return *this; }
+    const_iterator operator+(difference_type n) const { return {events_, i_ + n}; }
+    const_iterator operator-(difference_type n) const { return {events_, i_ - n}; }
+    difference_type operator-(const const_iterator &r) const { return (difference_type)i_ - (difference_type)r.i_; }
+    bool operator==(const const_iterator &r) const { return i_ == r.i_; }
+    bool operator!=(const const_iterator &r) const { return i_ != r.i_; }
+    bool operator<(const const_iterator &r) const { return i_ < r.i_; }
+    bool operator>(const const_iterator &r) const { return i_ > r.i_; }
+    bool operator<=(const const_iterator &r) const { return i_ <= r.i_; }
+    bool operator>=(const const_iterator &r) const { return i_ >= r.i_; }
+    size_t index() const { return i_; }
+
+  private:
+    const CanEvents *events_ = nullptr;
+    size_t i_ = 0;
+  };
+
+  // events older than the last one are kept aside until finishAppend() merges them all at once
+  void append(uint64_t mono_time, const uint8_t *dat, uint8_t size);
+  void finishAppend();
+  // merges events which may overlap with the existing ones
+  void insert(CanEvents &&other);
+  // the number of events insert() merges one by one, the others are moved as columns
+  size_t interleaved(const CanEvents &other) const;
+  // drops the events before ts
+  void removeBefore(uint64_t ts);
+  size_t size() const { return ts_offsets_.size(); }
+  bool empty() const { return ts_offsets_.empty(); }
+  uint64_t monoTime(size_t i) const { return blocks_[blockIndex(i)].base + ts_offsets_[i]; }
+  CanEvent operator[](size_t i) const;
+  CanEvent front() const { return (*this)[0]; }
+  CanEvent back() const { return (*this)[size() - 1]; }
+  const_iterator begin() const { return {this, 0}; }
+  const_iterator end() const { return {this, size()}; }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+  // first event with mono_time >= ts, or > ts
+  const_iterator lowerBound(uint64_t ts) const;
+  const_iterator upperBound(uint64_t ts) const;
+  // decodes a signal from the events in [first, last) in one pass if their payloads have the same size
+  void decode(const SignalDecoder &decoder, const_iterator first, const_iterator last, double *out) const;
+  size_t memoryUsage() const;
+  // changes when events are removed or merged in between the others, not when they are only appended
+  uint32_t revision() const { return revision_; }
+
+private:
+  struct Block {
+    uint64_t base;
+    uint32_t first;  // index of the first event in the block
+  };
+  // by time, the events are [0, lo) [lo, hi) [hi, size()) and the ones of other [0, other_lo) [other_lo, other_hi)
+  // [other_hi, other.size()). only [lo, hi) and [other_lo, other_hi) overlap.
+  struct Split {
+    size_t lo, hi, other_lo, other_hi;
+  };
+  Split split(const CanEvents &other) const;
+  // events [first, last) as a copy of the columns
+  CanEvents slice(size_t first, size_t last) const;
+  // drops the events from n on
+  void truncate(size_t n);
+  // appends the columns of other, whose events are not older than the last one
+  void concat(CanEvents &&other);
+  size_t blockIndex(size_t i) const;
+  const_iterator bound(uint64_t ts, bool upper) const;
+
+  std::vector<Block> blocks_;
+  std::vector<uint32_t> ts_offsets_;
+  std::vector<uint8_t> dat_;
+  std::vector<uint32_t> dat_offsets_;  // size() + 1 offsets into dat_, empty while all payloads have the same size
+  uint8_t dat_size_ = 0;
+  uint32_t revision_ = 0;
+
+  struct LateEvent {
+    uint64_t mono_time;
+    uint32_t offset;  // into late_dat_
+    uint8_t size;
+  };
+  std::vector<LateEvent> late_;
+  std::vector<uint8_t> late_dat_;
 };
 
 class AbstractStream : public QObject {
@@ -37,7 +143,7 @@ class AbstractStream : public QObject {
 
 public:
   AbstractStream(QObject *parent, bool is_live_streaming);
-  virtual ~AbstractStream() {};
+  virtual ~AbstractStream();
   inline bool liveStreaming() const { return is_live_streaming; }
   inline double lastEventSecond() const { return last_event_ts / 1e9 - routeStartTime(); }
   virtual void seekTo(double ts) {}
@@ -53,10 +159,10 @@ public:
   virtual void setSpeed(float speed) {}
   virtual bool isPaused() const { return false; }
   virtual void pause(bool pause) {}
-  virtual const std::vector<Event*> *rawEvents() const { return nullptr; }
-  const std::unordered_map<MessageId, std::deque<CanEvent>> &events() const { return events_; }
+  virtual const SegmentedEvents *rawEvents() const { return nullptr; }
+  const std::unordered_map<MessageId, CanEvents> &events() const { return events_; }
   virtual const std::vector<std::tuple<int, int, TimelineType>> getTimeline() { return {}; }
-  void mergeEvents(std::vector<Event *>::const_iterator first, std::vector<Event *>::const_iterator last, bool append);
+  void mergeEvents(std::vector<Event *>::const_iterator first, std::vector<Event *>::const_iterator last);
 
 signals:
   void paused();
@@ -77,14 +183,19 @@ protected:
   virtual void process(QHash<MessageId, CanData> *);
   bool updateEvent(const Event *event);
   void updateLastMsgsTo(double sec);
-  void parseEvents(std::unordered_map<MessageId, std::deque<CanEvent>> &msgs, std::vector<Event *>::const_iterator first, std::vector<Event *>::const_iterator last);
+  // parses the CAN events in [first, last) on the global thread pool, may be called from any thread.
+  static std::unordered_map<MessageId, CanEvents> parseEvents(std::vector<Event *>::const_iterator first, std::vector<Event *>::const_iterator last);
+  // inserts the parsed events of a segment in one go, must be called from the GUI thread. the messages whose
+  // events interleave with many existing ones are merged into a copy on the thread pool, and swapped in later.
+  void mergeEvents(std::unordered_map<MessageId, CanEvents> &&msgs);
 
   bool is_live_streaming = false;
   std::atomic<bool> processing = false;
   std::unique_ptr<QHash<MessageId, CanData>> new_msgs;
   QHash<MessageId, CanData> all_msgs;
-  std::unordered_map<MessageId, std::deque<CanEvent>> events_;
+  std::unordered_map<MessageId, CanEvents> events_;
   uint64_t last_event_ts = 0;
+  QFutureSynchronizer<void> merge_futures;
 };
 
 // A global pointer referring to the unique AbstractStream object
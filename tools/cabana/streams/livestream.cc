@@ -1,8 +1,73 @@
 #include "tools/cabana/streams/livestream.h"
 
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
 #include <QTimer>
 
-LiveStream::LiveStream(QObject *parent, QString address) : zmq_address(address), AbstractStream(parent, true) {
+const uint64_t SEGMENT_LENGTH = 60 * 1e9;
+
+// LogWriter
+
+LogWriter::LogWriter(const QString &dir) : route(QDateTime::currentDateTime().toString("yyyy-MM-dd--HH-mm-ss")), dir_(dir) {
+  thread_ = std::thread(&LogWriter::writerThread, this);
+}
+
+LogWriter::~LogWriter() {
+  {
+    std::lock_guard lk(lock_);
+    exit_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+}
+
+void LogWriter::write(const Event *e) {
+  auto bytes = e->bytes();
+  {
+    std::lock_guard lk(lock_);
+    queue_.push_back({e->mono_time, std::string((const char *)bytes.begin(), bytes.size())});
+  }
+  cv_.notify_one();
+}
+
+void LogWriter::writerThread() {
+  std::unique_ptr<QFile> file;
+  int segment = -1;
+  uint64_t segment_start_ts = 0;
+  std::vector<std::pair<uint64_t, std::string>> events;
+  while (true) {
+    {
+      std::unique_lock lk(lock_);
+      cv_.wait(lk, [this]() { return exit_ || !queue_.empty(); });
+      if (exit_ && queue_.empty()) break;
+      events.swap(queue_);
+    }
+    for (const auto &[mono_time, data] : events) {
+      // signed, the events of the sockets may arrive slightly out of order
+      if (segment < 0 || (int64_t)(mono_time - segment_start_ts) >= (int64_t)SEGMENT_LENGTH) {
+        segment_start_ts = mono_time;
+        const QString seg_dir = QString("%1/%2--%3").arg(dir_, route).arg(++segment);
+        file = std::make_unique<QFile>(seg_dir + "/rlog");
+        if (!QDir().mkpath(seg_dir) || !file->open(QIODevice::WriteOnly | QIODevice::Append)) {
+          qWarning() << "failed to open" << file->fileName();
+          file.reset();
+        }
+      }
+      if (file) file->write(data.data(), data.size());
+    }
+    if (file) file->flush();
+    events.clear();
+  }
+}
+
+// LiveStream
+
+LiveStream::LiveStream(QObject *parent, QString address, QString record_dir) : zmq_address(address), AbstractStream(parent, true) {
+  if (!record_dir.isEmpty()) {
+    writer = std::make_unique<LogWriter>(record_dir);
+    qInfo() << "recording to" << record_dir << ", replay with: cabana --data_dir" << record_dir << writer->route;
+  }
   stream_thread = new QThread(this);
   QObject::connect(stream_thread, &QThread::started, [=]() { streamThread(); });
   QObject::connect(stream_thread, &QThread::finished, stream_thread, &QThread::deleteLater);
@@ -32,8 +97,9 @@ void LiveStream::streamThread() {
       continue;
     }
     std::lock_guard lk(lock);
-    handleEvent(messages.emplace_back(msg).event);
-    // TODO: write stream to log file to replay it with cabana --data_dir flag.
+    Event *evt = messages.emplace_back(msg).event;
+    handleEvent(evt);
+    if (writer) writer->write(evt);
   }
 }
 
@@ -71,11 +137,27 @@ void LiveStream::process(QHash<MessageId, CanData> *last_messages) {
     auto first = std::upper_bound(received.cbegin(), received.cend(), last_event_ts, [](uint64_t ts, auto &e) {
       return ts < e->mono_time;
     });
-    mergeEvents(first, received.cend(), true);
+    mergeEvents(first, received.cend());
     if (speed_ == 1) {
       received.clear();
       messages.clear();
+    } else {
+      // the merged events before current_ts were played already
+      auto last = std::upper_bound(received.cbegin(), received.cend(), std::min<uint64_t>(current_ts, last_event_ts), [](uint64_t ts, auto &e) {
+        return ts < e->mono_time;
+      });
+      messages.erase(messages.begin(), messages.begin() + (last - received.cbegin()));
+      received.erase(received.cbegin(), last);
+    }
+  }
+
+  // keep the last max_cached_minutes of events in memory, trimmed once a minute
+  const uint64_t retention = settings.max_cached_minutes * 60 * 1e9;
+  if (last_event_ts > retention && last_event_ts - last_trim_ts > 60 * 1e9) {
+    for (auto &[_, e] : events_) {
+      e.removeBefore(last_event_ts - retention);
     }
+    last_trim_ts = last_event_ts;
   }
   AbstractStream::process(last_messages);
 }
@@ -1,12 +1,39 @@
 #pragma once
 
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "tools/cabana/streams/abstractstream.h"
 
+// appends events to the rlogs of one minute segments in <dir>/<route>--<n>/rlog on a background thread.
+// a capture can be replayed with: cabana --data_dir <dir> <route>
+class LogWriter {
+public:
+  LogWriter(const QString &dir);
+  ~LogWriter();
+  void write(const Event *e);
+  const QString route;
+
+private:
+  void writerThread();
+
+  const QString dir_;
+  std::mutex lock_;
+  std::condition_variable cv_;
+  std::vector<std::pair<uint64_t, std::string>> queue_;
+  bool exit_ = false;
+  std::thread thread_;
+};
+
 class LiveStream : public AbstractStream {
   Q_OBJECT
 
 public:
-  LiveStream(QObject *parent, QString address = {});
+  LiveStream(QObject *parent, QString address = {}, QString record_dir = {});
   virtual ~LiveStream();
   inline QString routeName() const override {
     return QString("Live Streaming From %1").arg(zmq_address.isEmpty() ? "127.0.0.1" : zmq_address);
@@ -40,6 +67,8 @@ protected:
   std::atomic<float> speed_ = 1;
   std::atomic<bool> pause_ = false;
   uint64_t last_update_ts = 0;
+  uint64_t last_trim_ts = 0;
+  std::unique_ptr<LogWriter> writer;
 
   const QString zmq_address;
   QThread *stream_thread;
@@ -1,5 +1,7 @@
 #include "tools/cabana/streams/replaystream.h"
 
+#include <QtConcurrent>
+
 ReplayStream::ReplayStream(uint32_t replay_flags, QObject *parent) : replay_flags(replay_flags), AbstractStream(parent, false) {
   QObject::connect(&settings, &Settings::changed, [this]() {
     if (replay) replay->setSegmentCacheLimit(settings.max_cached_minutes);
@@ -8,6 +10,7 @@ ReplayStream::ReplayStream(uint32_t replay_flags, QObject *parent) : replay_flag
 
 ReplayStream::~ReplayStream() {
   if (replay) replay->stop();
+  synchronizer.waitForFinished();
 }
 
 static bool event_filter(const Event *e, void *opaque) {
@@ -17,10 +20,12 @@ static bool event_filter(const Event *e, void *opaque) {
 void ReplayStream::mergeSegments() {
   for (auto &[n, seg] : replay->segments()) {
     if (seg && seg->isLoaded() && !processed_segments.count(n)) {
-      const auto &events = seg->log->events;
-      bool append = processed_segments.empty() || *processed_segments.rbegin() < n;
       processed_segments.insert(n);
-      mergeEvents(events.cbegin(), events.cend(), append);
+      // parse in the background, the segment may be released by replay meanwhile.
+      synchronizer.addFuture(QtConcurrent::run([this, log = seg->log]() {
+        auto msgs = std::make_shared<std::unordered_map<MessageId, CanEvents>>(parseEvents(log->events.cbegin(), log->events.cend()));
+        QMetaObject::invokeMethod(this, [this, msgs]() { mergeEvents(std::move(*msgs)); }, Qt::QueuedConnection);
+      }));
     }
   }
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <QFutureSynchronizer>
+
 #include "tools/cabana/streams/abstractstream.h"
 #include "tools/cabana/settings.h"
 
@@ -23,7 +25,7 @@ public:
   inline void setSpeed(float speed) override { replay->setSpeed(speed); }
   inline bool isPaused() const override { return replay->isPaused(); }
   void pause(bool pause) override;
-  const std::vector<Event*> *rawEvents() const override { return replay->events(); }
+  const SegmentedEvents *rawEvents() const override { return replay->events(); }
   inline const std::vector<std::tuple<int, int, TimelineType>> getTimeline() override { return replay->getTimeline(); }
 
 private:
@@ -31,4 +33,5 @@ private:
   std::unique_ptr<Replay> replay = nullptr;
   uint32_t replay_flags = REPLAY_FLAG_NONE;
   std::set<int> processed_segments;
+  QFutureSynchronizer<void> synchronizer;
 };
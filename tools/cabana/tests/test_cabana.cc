@@ -1,10 +1,26 @@
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include <clocale>
+#include <map>
+#include <random>
+#include <sstream>
+
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryDir>
 
 #include "opendbc/can/common.h"
 #undef INFO
 #include "catch2/catch.hpp"
+#include "cereal/messaging/messaging.h"
+#include "tools/replay/filereader.h"
 #include "tools/replay/logreader.h"
+#include "tools/replay/route.h"
 #include "tools/cabana/dbc/dbcmanager.h"
+#include "tools/cabana/historylog.h"
 #include "tools/cabana/streams/abstractstream.h"
+#include "tools/cabana/streams/livestream.h"
+#include "tools/cabana/tools/findsimilarbits.h"
+#include "tools/cabana/util.h"
 
 // demo route, first segment
 const std::string TEST_RLOG_URL = "https://commadata2.blob.core.windows.net/commadata2/4cf7a6ad03080c90/2021-09-29--13-46-36/0/rlog.bz2";
@@ -30,6 +46,94 @@ TEST_CASE("DBCFile::generateDBC") {
   }
 }
 
+TEST_CASE("DBCFile::open") {
+  // the runner points COMMA_CACHE at a temp dir, the first load of a file writes its cache and the second reads it
+  for (const auto &name : allDBCNames()) {
+    QString fn = QString("%1/%2.dbc").arg(OPENDBC_FILE_PATH, name.c_str());
+    QFile f(fn);
+    REQUIRE(f.open(QIODevice::ReadOnly));
+    DBCFile file(name.c_str(), f.readAll());
+    { DBCFile first_load(fn); }
+    REQUIRE(QFile::exists(QString::fromStdString(cacheFilePath(QFileInfo(fn).absoluteFilePath().toStdString()) + ".dbc")));
+    DBCFile cached(fn);
+    const DBC *dbc = dbc_lookup(name);
+    REQUIRE(dbc != nullptr);
+    REQUIRE(file.msgCount() == (int)dbc->msgs.size());
+    REQUIRE(cached.msgCount() == (int)dbc->msgs.size());
+    for (const auto &m : dbc->msgs) {
+      auto msg = file.msg(m.address);
+      auto cached_msg = cached.msg(m.address);
+      REQUIRE((msg && cached_msg));
+      REQUIRE(msg->name.toStdString() == m.name);
+      REQUIRE(msg->size == m.size);
+      REQUIRE(cached_msg->name == msg->name);
+      REQUIRE(cached_msg->size == msg->size);
+      REQUIRE(msg->sigs.size() == (int)m.sigs.size());
+      REQUIRE(cached_msg->sigs.size() == (int)m.sigs.size());
+      for (int i = 0; i < msg->sigs.size(); ++i) {
+        const auto &s = msg->sigs[i];
+        REQUIRE(s.name.toStdString() == m.sigs[i].name);
+        REQUIRE(s.start_bit == m.sigs[i].start_bit);
+        REQUIRE(s.msb == m.sigs[i].msb);
+        REQUIRE(s.lsb == m.sigs[i].lsb);
+        REQUIRE(s.size == m.sigs[i].size);
+        REQUIRE(s.is_signed == m.sigs[i].is_signed);
+        REQUIRE(s.factor == m.sigs[i].factor);
+        REQUIRE(s.offset == m.sigs[i].offset);
+        REQUIRE(s.is_little_endian == m.sigs[i].is_little_endian);
+        REQUIRE(cached_msg->sigs[i] == s);
+        REQUIRE(cached_msg->sigs[i].precision == s.precision);
+      }
+    }
+  }
+}
+
+TEST_CASE("DBCFile::open with a comma decimal locale") {
+  struct LocaleGuard {
+    const std::string prev = setlocale(LC_NUMERIC, nullptr);
+    ~LocaleGuard() { setlocale(LC_NUMERIC, prev.c_str()); }
+  } guard;
+  if (!setlocale(LC_NUMERIC, "de_DE.UTF-8")) {
+    WARN("skipped, the de_DE.UTF-8 locale is not installed");
+    return;
+  }
+
+  DBCFile dbc("", "BO_ 100 TEST: 8 XXX\n"
+                  " SG_ SPEED : 7|16@0+ (0.5,-1.25) [-1.25|32766.25] \"\" XXX\n");
+  auto sig = dbc.msg(100) ? dbc.msg(100)->sig("SPEED") : nullptr;
+  REQUIRE(sig != nullptr);
+  REQUIRE(sig->factor == 0.5);
+  REQUIRE(sig->offset == -1.25);
+  REQUIRE(sig->min == "-1.25");
+  REQUIRE(sig->max == "32766.25");
+}
+
+TEST_CASE("DBCFile::open benchmark", "[.][benchmark]") {
+  std::vector<std::pair<std::string, QString>> files;
+  for (const auto &name : allDBCNames()) {
+    QFile f(QString("%1/%2.dbc").arg(OPENDBC_FILE_PATH, name.c_str()));
+    REQUIRE(f.open(QIODevice::ReadOnly));
+    files.push_back({name, f.readAll()});
+  }
+
+  BENCHMARK("opendbc") {
+    for (const auto &[name, content] : files) {
+      std::istringstream stream(content.toStdString());
+      delete dbc_parse_from_stream(name, stream);
+    }
+  };
+  BENCHMARK("parse") {
+    for (const auto &[name, content] : files) {
+      DBCFile dbc(name.c_str(), content);
+    }
+  };
+  BENCHMARK("cached") {
+    for (const auto &[name, _] : files) {
+      DBCFile dbc(QString("%1/%2.dbc").arg(OPENDBC_FILE_PATH, name.c_str()));
+    }
+  };
+}
+
 TEST_CASE("Parse can messages") {
   DBCManager dbc(nullptr);
   dbc.open({0}, "toyota_new_mc_pt_generated");
@@ -68,3 +172,273 @@ TEST_CASE("Parse can messages") {
     }
   }
 }
+
+TEST_CASE("SignalDecoder") {
+  DBCFile dbc(QString("%1/%2.dbc").arg(OPENDBC_FILE_PATH, "toyota_new_mc_pt_generated"));
+  std::mt19937 rng(0);
+  const size_t count = 100;
+  std::vector<double> values(count);
+  for (auto &[id, m] : dbc.getMessages()) {
+    std::vector<uint8_t> data(m.size * count);
+    std::generate(data.begin(), data.end(), rng);
+    for (auto sig : m.getSignals()) {
+      SignalDecoder decoder(*sig);
+      decoder.decode(data.data(), m.size, count, values.data());
+      for (size_t i = 0; i < count; ++i) {
+        const double expected = get_raw_value(&data[i * m.size], m.size, *sig);
+        REQUIRE(values[i] == expected);
+        REQUIRE(decoder.decode(&data[i * m.size], m.size) == expected);
+      }
+    }
+  }
+}
+
+TEST_CASE("CanEvents") {
+  const uint8_t dat[64] = {1, 2, 3, 4, 5, 6, 7, 8};
+  CanEvents first, second;
+  // timestamps of the second block overflow the 32 bit offsets of the first one
+  for (uint64_t ts : {100ul, 200ul, 200ul, 10'000'000'000ul, 10'000'000'100ul}) {
+    first.append(ts, dat, 8);
+  }
+  second.append(150, dat, 4);
+  second.append(20'000'000'000ul, dat, 64);
+  first.insert(std::move(second));
+
+  REQUIRE(first.size() == 7);
+  REQUIRE(std::is_sorted(first.begin(), first.end(), [](const CanEvent &l, const CanEvent &r) { return l.mono_time < r.mono_time; }));
+  REQUIRE(first[1].mono_time == 150);
+  REQUIRE(first[1].size == 4);
+  REQUIRE(first.back().size == 64);
+  REQUIRE(std::equal(dat, dat + 64, first.back().dat));
+
+  REQUIRE(first.lowerBound(200).index() == 2);
+  REQUIRE(first.upperBound(200).index() == 4);
+  REQUIRE(first.lowerBound(5'000'000'000ul).index() == 4);
+  REQUIRE(first.upperBound(10'000'000'000ul).index() == 5);
+  REQUIRE(first.upperBound(30'000'000'000ul) == first.end());
+  REQUIRE(first.lowerBound(0) == first.begin());
+
+  first.removeBefore(200);
+  REQUIRE(first.size() == 5);
+  REQUIRE(first.front().mono_time == 200);
+  first.removeBefore(10'000'000'050ul);
+  REQUIRE(first.size() == 2);
+  REQUIRE(first.front().mono_time == 10'000'000'100ul);
+  REQUIRE(std::equal(dat, dat + 64, first.back().dat));
+  REQUIRE(first.lowerBound(20'000'000'000ul).index() == 1);
+
+  // out of order events are merged once done appending
+  CanEvents late;
+  for (uint64_t ts : {100ul, 300ul, 200ul, 400ul, 150ul, 150ul, 500ul}) {
+    late.append(ts, dat, ts == 150 ? 4 : 8);
+  }
+  REQUIRE(late.size() == 4);
+  late.finishAppend();
+  REQUIRE(late.size() == 7);
+  REQUIRE(std::is_sorted(late.begin(), late.end(), [](const CanEvent &l, const CanEvent &r) { return l.mono_time < r.mono_time; }));
+  REQUIRE(late[1].mono_time == 150);
+  REQUIRE(late[1].size == 4);
+  REQUIRE(late[3].mono_time == 200);
+  REQUIRE(late[3].size == 8);
+
+  // the revision changes unless the events are only appended
+  const uint32_t revision = late.revision();
+  late.append(600, dat, 8);
+  late.finishAppend();
+  REQUIRE(late.revision() == revision);
+  late.append(250, dat, 8);
+  late.finishAppend();
+  REQUIRE(late.revision() != revision);
+
+  // a segment before the events is prepended as columns, only the overlapping events of one in between are merged
+  CanEvents store, before, between;
+  for (uint64_t ts : {1000ul, 1100ul, 1200ul, 1300ul}) store.append(ts, dat, 8);
+  for (uint64_t ts : {500ul, 600ul}) before.append(ts, dat, 8);
+  for (uint64_t ts : {1050ul, 1150ul, 1400ul}) between.append(ts, dat, 2);
+  REQUIRE(store.interleaved(before) == 0);
+  REQUIRE(store.interleaved(between) == 4);
+  store.insert(std::move(before));
+  store.insert(std::move(between));
+  std::vector<uint64_t> times;
+  for (const auto &e : store) times.push_back(e.mono_time);
+  REQUIRE(times == std::vector<uint64_t>{500, 600, 1000, 1050, 1100, 1150, 1200, 1300, 1400});
+  REQUIRE(store[3].size == 2);
+  REQUIRE(store[4].size == 8);
+  REQUIRE(store.lowerBound(1150).index() == 5);
+}
+
+// FindSimilarBitsDlg::calcBits bit by bit
+static QList<FindSimilarBitsDlg::mismatched_struct> calcBitsReference(const CanEvents &target, const std::vector<std::pair<int, int>> &target_bits,
+                                                                      uint32_t address, const CanEvents &events, bool equal, int min_msgs_cnt) {
+  if ((int64_t)events.size() <= min_msgs_cnt || target.empty()) return {};
+
+  std::vector<int> last_val(target_bits.size(), -1);
+  std::map<std::pair<size_t, size_t>, uint32_t> mismatches;  // (bit, target) -> mismatches
+  size_t t = 0;
+  for (const auto &e : events) {
+    for (; t < target.size() && target[t].mono_time <= e.mono_time; ++t) {
+      for (size_t j = 0; j < target_bits.size(); ++j) {
+        auto [byte_idx, bit_idx] = target_bits[j];
+        if (target[t].size > byte_idx) last_val[j] = (target[t].dat[byte_idx] >> (7 - bit_idx)) & 1;
+      }
+    }
+    for (size_t j = 0; j < target_bits.size(); ++j) {
+      if (last_val[j] < 0) continue;
+      for (size_t i = 0; i < e.size * 8; ++i) {
+        const int bit = (e.dat[i / 8] >> (7 - i % 8)) & 1;
+        mismatches[{i, j}] += equal ? bit != last_val[j] : bit == last_val[j];
+      }
+    }
+  }
+
+  QList<FindSimilarBitsDlg::mismatched_struct> result;
+  for (auto &[key, mismatched] : mismatches) {
+    if (float perc = (mismatched / (double)events.size()) * 100; perc < 50) {
+      result.push_back({address, (uint32_t)key.first / 8, (uint32_t)key.first % 8, mismatched, (uint32_t)events.size(), perc, (int)key.second});
+    }
+  }
+  return result;
+}
+
+TEST_CASE("FindSimilarBitsDlg::calcBits") {
+  std::mt19937 rng(0);
+  const uint8_t sizes[] = {0, 1, 3, 8, 12, 64};
+  const std::vector<std::pair<int, int>> target_bits = {{0, 0}, {1, 7}, {2, 3}, {9, 5}};
+  auto count = GENERATE(1, 63, 64, 65, 300);
+  auto same_size = GENERATE(true, false);
+
+  CanEvents target, events;
+  uint8_t dat[64] = {};
+  for (int i = 0; i < count; ++i) {
+    const uint64_t ts = 1000 + i * 10;
+    if (rng() % 3 == 0) {
+      std::generate(std::begin(dat), std::end(dat), std::ref(rng));
+      target.append(ts - rng() % 20, dat, sizes[rng() % std::size(sizes)]);
+    }
+    // bits that follow the target, some of them inverted, mixed with random ones
+    for (auto &b : dat) b = rng() % 4 == 0 ? rng() : (rng() % 2 ? b : ~b);
+    events.append(ts, dat, same_size ? 8 : sizes[rng() % std::size(sizes)]);
+  }
+  target.finishAppend();
+  INFO("events " << count << ", same size " << same_size);
+
+  for (bool equal : {true, false}) {
+    auto result = FindSimilarBitsDlg::calcBits(target, target_bits, 0x123, events, equal, 0);
+    auto expected = calcBitsReference(target, target_bits, 0x123, events, equal, 0);
+    REQUIRE(result.size() == expected.size());
+    for (int i = 0; i < result.size(); ++i) {
+      REQUIRE(result[i].byte_idx == expected[i].byte_idx);
+      REQUIRE(result[i].bit_idx == expected[i].bit_idx);
+      REQUIRE(result[i].target == expected[i].target);
+      REQUIRE(result[i].mismatches == expected[i].mismatches);
+      REQUIRE(result[i].total == expected[i].total);
+      REQUIRE(result[i].perc == expected[i].perc);
+    }
+  }
+}
+
+TEST_CASE("MinMaxPyramid") {
+  QVector<QPointF> vals;
+  MinMaxPyramid lod;
+  std::mt19937 rng(0);
+  for (int i = 0; i < 10000; ++i) {
+    vals.push_back({i / 100.0, double(rng() % 1000)});
+    if (i % 1000 == 0) lod.update(vals);
+  }
+  lod.update(vals);
+
+  QVector<QPointF> points;
+  for (auto [first, last] : {std::pair{0, 10000}, {123, 4567}, {5000, 5100}}) {
+    lod.downsample(vals, first, last, 200, points);
+    REQUIRE(points.size() <= std::max(last - first <= 200 ? last - first : 0, 200 + 64));
+    REQUIRE(std::is_sorted(points.begin(), points.end(), [](auto &l, auto &r) { return l.x() < r.x(); }));
+    auto cmp = [](auto &l, auto &r) { return l.y() < r.y(); };
+    auto [min, max] = std::minmax_element(vals.begin() + first, vals.begin() + last, cmp);
+    auto [points_min, points_max] = std::minmax_element(points.begin(), points.end(), cmp);
+    REQUIRE(points_min->y() == min->y());
+    REQUIRE(points_max->y() == max->y());
+  }
+}
+
+TEST_CASE("SegmentTree") {
+  QVector<QPointF> vals;
+  SegmentTree tree;
+  std::mt19937 rng(0);
+  for (int i = 0; i < 5000; ++i) {
+    vals.push_back({(double)i, double(rng() % 1000)});
+    // appended a few points at a time, as in live streaming
+    if (rng() % 10 == 0) {
+      tree.update(vals);
+      const int left = rng() % vals.size(), right = left + rng() % (vals.size() - left);
+      auto cmp = [](auto &l, auto &r) { return l.y() < r.y(); };
+      auto [min, max] = std::minmax_element(vals.begin() + left, vals.begin() + right + 1, cmp);
+      REQUIRE(tree.minmax(left, right) == std::pair{min->y(), max->y()});
+    }
+  }
+}
+
+TEST_CASE("HistoryLogModel::fetchData") {
+  DBCFile dbc("", "BO_ 100 TEST: 8 XXX\n"
+                  " SG_ COUNTER : 7|8@0+ (1,0) [0|255] \"\" XXX\n"
+                  " SG_ SPEED : 15|8@0+ (1,0) [0|255] \"\" XXX\n");
+  std::vector<SignalDecoder> decoders;
+  for (auto sig : dbc.msg(100)->getSignals()) decoders.emplace_back(*sig);
+  REQUIRE(decoders.size() == 2);
+
+  // the speed is above 30 in a few short ranges only
+  HistoryLogModel::IndexedEvents indexed;
+  std::mt19937 rng(0);
+  for (int i = 0; i < 100000; ++i) {
+    uint8_t dat[8] = {(uint8_t)i, (uint8_t)(i % 20000 < 100 ? 31 + rng() % 10 : rng() % 30)};
+    indexed.events.append(i * 10'000'000ul, dat, 8);
+  }
+  HistoryLogModel::Filter filter{.sig_idx = 1, .type = HistoryLogModel::Greater, .value = 30};
+  indexed.buildZones(decoders[1], *dbc.msg(100)->sig("SPEED"));
+
+  for (bool reverse : {true, false}) {
+    auto msgs = HistoryLogModel::fetchData(indexed.events, 0, indexed.events.size(), reverse, 0, SIZE_MAX, decoders, filter, &indexed.zones);
+    auto expected = HistoryLogModel::fetchData(indexed.events, 0, indexed.events.size(), reverse, 0, SIZE_MAX, decoders, filter, nullptr);
+    REQUIRE(msgs.size() == 500);
+    REQUIRE(msgs.size() == expected.size());
+    for (size_t i = 0; i < msgs.size(); ++i) {
+      REQUIRE(msgs[i].mono_time == expected[i].mono_time);
+      REQUIRE(msgs[i].sig_values == expected[i].sig_values);
+      REQUIRE(msgs[i].sig_values[1] > 30);
+    }
+  }
+}
+
+TEST_CASE("LogWriter") {
+  QTemporaryDir dir;
+  // a minute apart from the first event starts the second segment, the late event stays in it
+  const std::vector<uint64_t> times = {1'000'000'000ul, 2'000'000'000ul, 61'000'000'000ul, 60'500'000'000ul, 62'000'000'000ul};
+  const std::vector<std::vector<uint64_t>> expected = {{times[0], times[1]}, {times[3], times[2], times[4]}};
+  QString route;
+  {
+    LogWriter writer(dir.path());
+    route = writer.route;
+    for (uint64_t t : times) {
+      MessageBuilder msg;
+      auto event = msg.initEvent();
+      event.setLogMonoTime(t);
+      event.initCan(1)[0].setAddress(t / 1'000'000);
+      auto words = capnp::messageToFlatArray(msg);
+      Event e(words);
+      writer.write(&e);
+    }
+  }
+
+  // reopened like cabana --data_dir <dir> <route>, the reader sorts the events
+  Route r(route, dir.path());
+  REQUIRE(r.load());
+  REQUIRE(r.segments().size() == expected.size());
+  for (const auto &[n, files] : r.segments()) {
+    LogReader log;
+    REQUIRE(log.load(files.rlog.toStdString()));
+    REQUIRE(log.events.size() == expected[n].size());
+    for (size_t i = 0; i < log.events.size(); ++i) {
+      REQUIRE(log.events[i]->mono_time == expected[n][i]);
+      REQUIRE(log.events[i]->event.getCan()[0].getAddress() == expected[n][i] / 1'000'000);
+    }
+  }
+}
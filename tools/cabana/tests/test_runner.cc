@@ -1,10 +1,17 @@
 #define CATCH_CONFIG_RUNNER
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
 #include "catch2/catch.hpp"
+#include <cstdlib>
+
 #include <QCoreApplication>
+#include <QTemporaryDir>
 
 int main(int argc, char **argv) {
   // unit tests for Qt
   QCoreApplication app(argc, argv);
+  // keep the files cached by the tests out of the user's cache
+  QTemporaryDir cache_dir;
+  setenv("COMMA_CACHE", cache_dir.path().toStdString().c_str(), 1);
   const int res = Catch::Session().run(argc, argv);
   return (res < 0xff ? res : 0xff);
 }
@@ -1,5 +1,10 @@
 #include "tools/cabana/tools/findsimilarbits.h"
 
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <memory>
+
 #include <QGridLayout>
 #include <QHeaderView>
 #include <QHBoxLayout>
@@ -7,9 +12,7 @@
 #include <QLabel>
 #include <QPushButton>
 #include <QRadioButton>
-
-#include "tools/cabana/dbc/dbcmanager.h"
-#include "tools/cabana/streams/abstractstream.h"
+#include <QtConcurrent>
 
 FindSimilarBitsDlg::FindSimilarBitsDlg(QWidget *parent) : QDialog(parent, Qt::WindowFlags() | Qt::Window) {
   setWindowTitle(tr("Find similar bits"));
@@ -48,9 +51,13 @@ FindSimilarBitsDlg::FindSimilarBitsDlg(QWidget *parent) : QDialog(parent, Qt::Wi
   bit_idx_sb->setFixedWidth(50);
   bit_idx_sb->setRange(0, 7);
 
+  sig_cb = new QComboBox(this);
+  updateSignals();
+
   src_layout->addWidget(new QLabel(tr("Bus")));
   src_layout->addWidget(src_bus_combo);
   src_layout->addWidget(msg_cb);
+  src_layout->addWidget(sig_cb);
   src_layout->addWidget(new QLabel(tr("Byte Index")));
   src_layout->addWidget(byte_idx_sb);
   src_layout->addWidget(new QLabel(tr("Bit Index")));
@@ -87,8 +94,17 @@ FindSimilarBitsDlg::FindSimilarBitsDlg(QWidget *parent) : QDialog(parent, Qt::Wi
   table->horizontalHeader()->setStretchLastSection(true);
   main_layout->addWidget(table);
 
+  watcher = new QFutureWatcher<QList<mismatched_struct>>(this);
+
   setMinimumSize({700, 500});
+  QObject::connect(msg_cb, qOverload<int>(&QComboBox::currentIndexChanged), this, &FindSimilarBitsDlg::updateSignals);
+  QObject::connect(sig_cb, qOverload<int>(&QComboBox::currentIndexChanged), [this](int index) {
+    byte_idx_sb->setEnabled(index == 0);
+    bit_idx_sb->setEnabled(index == 0);
+  });
   QObject::connect(search_btn, &QPushButton::clicked, this, &FindSimilarBitsDlg::find);
+  QObject::connect(watcher, &QFutureWatcher<QList<mismatched_struct>>::resultReadyAt, [this](int i) { appendRows(watcher->resultAt(i)); });
+  QObject::connect(watcher, &QFutureWatcher<QList<mismatched_struct>>::finished, this, &FindSimilarBitsDlg::searchFinished);
   QObject::connect(table, &QTableWidget::doubleClicked, [this](const QModelIndex &index) {
     if (index.isValid()) {
       MessageId msg_id = {.source = (uint8_t)find_bus_combo->currentData().toUInt(), .address = table->item(index.row(), 0)->text().toUInt(0, 16)};
@@ -97,75 +113,182 @@ FindSimilarBitsDlg::FindSimilarBitsDlg(QWidget *parent) : QDialog(parent, Qt::Wi
   });
 }
 
+FindSimilarBitsDlg::~FindSimilarBitsDlg() {
+  watcher->cancel();
+  watcher->waitForFinished();
+}
+
+void FindSimilarBitsDlg::updateSignals() {
+  sig_cb->clear();
+  sig_cb->addItem(tr("Bit"));
+  if (auto m = dbc()->msg({.source = 0, .address = msg_cb->currentData().toUInt()})) {
+    for (auto sig : m->getSignals()) {
+      sig_cb->addItem(sig->name);
+    }
+  }
+}
+
 void FindSimilarBitsDlg::find() {
   search_btn->setEnabled(false);
   table->clear();
-  uint32_t selected_address = msg_cb->currentData().toUInt();
-  auto msg_mismatched = calcBits(src_bus_combo->currentText().toUInt(), selected_address, byte_idx_sb->value(), bit_idx_sb->value(),
-                                 find_bus_combo->currentText().toUInt(), equal_combo->currentIndex() == 0, min_msgs->text().toInt());
-  table->setRowCount(msg_mismatched.size());
-  table->setColumnCount(6);
-  table->setHorizontalHeaderLabels({"address", "byte idx", "bit idx", "mismatches", "total msgs", "% mismatched"});
-  for (int i = 0; i < msg_mismatched.size(); ++i) {
-    auto &m = msg_mismatched[i];
-    table->setItem(i, 0, new QTableWidgetItem(QString("%1").arg(m.address, 1, 16)));
-    table->setItem(i, 1, new QTableWidgetItem(QString::number(m.byte_idx)));
-    table->setItem(i, 2, new QTableWidgetItem(QString::number(m.bit_idx)));
-    table->setItem(i, 3, new QTableWidgetItem(QString::number(m.mismatches)));
-    table->setItem(i, 4, new QTableWidgetItem(QString::number(m.total)));
-    table->setItem(i, 5, new QTableWidgetItem(QString::number(m.perc, 'f', 2)));
+  table->setRowCount(0);
+  table->setColumnCount(7);
+  table->setHorizontalHeaderLabels({"address", "byte idx", "bit idx", "target bit", "mismatches", "total msgs", "% mismatched"});
+  results.clear();
+
+  const uint8_t bus = src_bus_combo->currentText().toUInt();
+  const uint8_t find_bus = find_bus_combo->currentText().toUInt();
+  const MessageId target_id = {.source = bus, .address = msg_cb->currentData().toUInt()};
+  target_bits.clear();
+  auto m = dbc()->msg({.source = 0, .address = target_id.address});
+  if (auto sig = m && sig_cb->currentIndex() > 0 ? m->sig(sig_cb->currentText()) : nullptr) {
+    // all bits of the signal, in the bit order of the binary view
+    auto [start, end] = getSignalRange(sig);
+    for (int j = start; j <= end; ++j) {
+      int bit_index = sig->is_little_endian ? bigEndianBitIndex(j) : j;
+      target_bits.push_back({bit_index / 8, bit_index % 8});
+    }
+  } else {
+    target_bits.push_back({byte_idx_sb->value(), bit_idx_sb->value()});
+  }
+
+  // the events are copied since the stream keeps merging new events on the GUI thread
+  struct Candidate {
+    uint32_t address;
+    CanEvents events;
+  };
+  QList<Candidate> candidates;
+  auto target = std::make_shared<CanEvents>();
+  for (const auto &[id, events] : can->events()) {
+    if (id == target_id) *target = events;
+    if (id.source == find_bus) candidates.push_back({id.address, events});
+  }
+
+  const bool equal = equal_combo->currentIndex() == 0;
+  const int min_msgs_cnt = min_msgs->text().toInt();
+  std::function<QList<mismatched_struct>(const Candidate &)> calc = [target, bits = target_bits, equal, min_msgs_cnt](const Candidate &c) {
+    return calcBits(*target, bits, c.address, c.events, equal, min_msgs_cnt);
+  };
+  watcher->setFuture(QtConcurrent::mapped(candidates, calc));
+}
+
+void FindSimilarBitsDlg::appendRows(const QList<mismatched_struct> &rows) {
+  int row = table->rowCount();
+  table->setRowCount(row + rows.size());
+  for (auto &m : rows) {
+    auto &[byte_idx, bit_idx] = target_bits[m.target];
+    table->setItem(row, 0, new QTableWidgetItem(QString("%1").arg(m.address, 1, 16)));
+    table->setItem(row, 1, new QTableWidgetItem(QString::number(m.byte_idx)));
+    table->setItem(row, 2, new QTableWidgetItem(QString::number(m.bit_idx)));
+    table->setItem(row, 3, new QTableWidgetItem(QString("%1.%2").arg(byte_idx).arg(bit_idx)));
+    table->setItem(row, 4, new QTableWidgetItem(QString::number(m.mismatches)));
+    table->setItem(row, 5, new QTableWidgetItem(QString::number(m.total)));
+    table->setItem(row, 6, new QTableWidgetItem(QString::number(m.perc, 'f', 2)));
+    ++row;
+  }
+}
+
+void FindSimilarBitsDlg::searchFinished() {
+  // rows were appended in the order the messages finished, sort them once all are in.
+  for (int i = 0; i < watcher->future().resultCount(); ++i) {
+    results.append(watcher->resultAt(i));
   }
+  std::stable_sort(results.begin(), results.end(), [](auto &l, auto &r) { return l.perc < r.perc; });
+  table->setRowCount(0);
+  appendRows(results);
   search_btn->setEnabled(true);
 }
 
-QList<FindSimilarBitsDlg::mismatched_struct> FindSimilarBitsDlg::calcBits(uint8_t bus, uint32_t selected_address, int byte_idx,
-                                                                          int bit_idx, uint8_t find_bus, bool equal, int min_msgs_cnt) {
-  QHash<uint32_t, QVector<uint32_t>> mismatches;
-  QHash<uint32_t, uint32_t> msg_count;
-  auto events = can->rawEvents();
-  int bit_to_find = -1;
-  for (auto e : *events) {
-    if (e->which == cereal::Event::Which::CAN) {
-      for (const auto &c : e->event.getCan()) {
-        uint8_t src = c.getSrc();
-        uint32_t address = c.getAddress();
-        const auto dat = c.getDat();
-        if (src == bus) {
-          if (address == selected_address && dat.size() > byte_idx) {
-            bit_to_find = ((dat[byte_idx] >> (7 - bit_idx)) & 1) != 0;
+// transposes a 64x64 bit matrix in place, bit j of a[i] becomes bit i of a[j].
+static void transpose64(uint64_t a[64]) {
+  uint64_t m = 0x00000000FFFFFFFFULL;
+  for (int j = 32; j != 0; j >>= 1, m ^= (m << j)) {
+    for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+      uint64_t t = ((a[k] >> j) ^ a[k | j]) & m;
+      a[k] ^= t << j;
+      a[k | j] ^= t;
+    }
+  }
+}
+
+QList<FindSimilarBitsDlg::mismatched_struct> FindSimilarBitsDlg::calcBits(const CanEvents &target, const std::vector<std::pair<int, int>> &target_bits,
+                                                                          uint32_t address, const CanEvents &events, bool equal, int min_msgs_cnt) {
+  const size_t cnt = events.size();
+  if ((int64_t)cnt <= min_msgs_cnt || target.empty()) return {};
+
+  size_t max_size = 0;
+  bool same_size = true;
+  for (const auto &e : events) {
+    same_size = same_size && e.size == events.front().size;
+    max_size = std::max<size_t>(max_size, e.size);
+  }
+
+  // the frames are processed in blocks of 64. each block is transposed to one word per bit holding that bit of all frames,
+  // which is compared with the word of the last target bit values before the frames and counted with a popcount.
+  const size_t num_targets = target_bits.size();
+  const size_t words = (max_size + 7) / 8;
+  std::vector<uint32_t> mismatches(max_size * 8 * num_targets), compared(max_size * num_targets);
+  std::vector<uint64_t> cols(words * 64), byte_valid(max_size), target_vals(num_targets), target_valid(num_targets);
+  std::vector<uint8_t> last_val(num_targets), last_valid(num_targets);
+  size_t t = 0;
+  for (size_t first = 0; first < cnt; first += 64) {
+    const size_t n = std::min<size_t>(64, cnt - first);
+    std::fill(cols.begin(), cols.end(), 0);
+    std::fill(byte_valid.begin(), byte_valid.end(), same_size ? (n == 64 ? ~0ULL : (1ULL << n) - 1) : 0);
+    std::fill(target_vals.begin(), target_vals.end(), 0);
+    std::fill(target_valid.begin(), target_valid.end(), 0);
+    for (size_t k = 0; k < n; ++k) {
+      const CanEvent e = events[first + k];
+      for (; t < target.size() && target.monoTime(t) <= e.mono_time; ++t) {
+        const CanEvent te = target[t];
+        for (size_t j = 0; j < num_targets; ++j) {
+          auto [byte_idx, bit_idx] = target_bits[j];
+          if (te.size > byte_idx) {
+            last_val[j] = (te.dat[byte_idx] >> (7 - bit_idx)) & 1;
+            last_valid[j] = 1;
           }
         }
-        if (src == find_bus) {
-          ++msg_count[address];
-          if (bit_to_find == -1) continue;
+      }
+      for (size_t j = 0; j < num_targets; ++j) {
+        target_vals[j] |= (uint64_t)last_val[j] << k;
+        target_valid[j] |= (uint64_t)last_valid[j] << k;
+      }
+      for (size_t w = 0; w * 8 < e.size; ++w) {
+        memcpy(&cols[w * 64 + k], e.dat + w * 8, std::min<size_t>(8, e.size - w * 8));
+      }
+      if (!same_size) {
+        for (size_t i = 0; i < e.size; ++i) byte_valid[i] |= 1ULL << k;
+      }
+    }
 
-          auto &mismatched = mismatches[address];
-          if (mismatched.size() < dat.size() * 8) {
-            mismatched.resize(dat.size() * 8);
-          }
-          for (int i = 0; i < dat.size(); ++i) {
-            for (int j = 0; j < 8; ++j) {
-              int bit = ((dat[i] >> (7 - j)) & 1) != 0;
-              mismatched[i * 8 + j] += equal ? (bit != bit_to_find) : (bit == bit_to_find);
-            }
-          }
+    for (size_t w = 0; w < words; ++w) {
+      transpose64(&cols[w * 64]);
+    }
+    for (size_t j = 0; j < num_targets; ++j) {
+      if (!target_valid[j]) continue;
+
+      for (size_t i = 0; i < max_size; ++i) {
+        const uint64_t valid = target_valid[j] & byte_valid[i];
+        compared[i * num_targets + j] += __builtin_popcountll(valid);
+        for (int b = 0; b < 8; ++b) {
+          // bit b of a little endian word is bit 7 - b in the MSB first order of bit_idx
+          const uint64_t diff = cols[(i / 8) * 64 + (i % 8) * 8 + b] ^ target_vals[j];
+          mismatches[((i * 8) + 7 - b) * num_targets + j] += __builtin_popcountll((equal ? diff : ~diff) & valid);
         }
       }
     }
   }
 
   QList<mismatched_struct> result;
-  result.reserve(mismatches.size());
-  for (auto it = mismatches.begin(); it != mismatches.end(); ++it) {
-    if (auto cnt = msg_count[it.key()]; cnt > min_msgs_cnt) {
-      auto &mismatched = it.value();
-      for (int i = 0; i < mismatched.size(); ++i) {
-        if (float perc = (mismatched[i] / (double)cnt) * 100; perc < 50) {
-          result.push_back({it.key(), (uint32_t)i / 8, (uint32_t)i % 8, mismatched[i], cnt, perc});
-        }
+  for (size_t i = 0; i < max_size * 8; ++i) {
+    for (size_t j = 0; j < num_targets; ++j) {
+      if (compared[(i / 8) * num_targets + j] == 0) continue;
+
+      const uint32_t mismatched = mismatches[i * num_targets + j];
+      if (float perc = (mismatched / (double)cnt) * 100; perc < 50) {
+        result.push_back({address, (uint32_t)i / 8, (uint32_t)i % 8, mismatched, (uint32_t)cnt, perc, (int)j});
       }
     }
   }
-  std::sort(result.begin(), result.end(), [](auto &l, auto &r) { return l.perc < r.perc; });
   return result;
 }
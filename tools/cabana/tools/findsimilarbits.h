@@ -1,34 +1,50 @@
 #pragma once
 
+#include <utility>
+#include <vector>
+
 #include <QComboBox>
 #include <QDialog>
+#include <QFutureWatcher>
 #include <QLineEdit>
 #include <QSpinBox>
 #include <QTableWidget>
 
 #include "tools/cabana/dbc/dbcmanager.h"
+#include "tools/cabana/streams/abstractstream.h"
 
 class FindSimilarBitsDlg : public QDialog {
   Q_OBJECT
 
 public:
   FindSimilarBitsDlg(QWidget *parent);
+  ~FindSimilarBitsDlg();
 
-signals:
-  void openMessage(const MessageId &msg_id);
-
-private:
   struct mismatched_struct {
     uint32_t address, byte_idx, bit_idx, mismatches, total;
     float perc;
+    int target;  // index into the target bits
   };
-  QList<mismatched_struct> calcBits(uint8_t bus, uint32_t selected_address, int byte_idx, int bit_idx, uint8_t find_bus,
-                                    bool equal, int min_msgs_cnt);
+  // counts the frames of a message in which each of its bits mismatches the last value of each (byte_idx, bit_idx) target bit
+  // of the target message. bits with less than 50% mismatches are returned if the message has more than min_msgs_cnt frames.
+  static QList<mismatched_struct> calcBits(const CanEvents &target, const std::vector<std::pair<int, int>> &target_bits,
+                                           uint32_t address, const CanEvents &events, bool equal, int min_msgs_cnt);
+
+signals:
+  void openMessage(const MessageId &msg_id);
+
+private:
+  void updateSignals();
   void find();
+  void appendRows(const QList<mismatched_struct> &rows);
+  void searchFinished();
 
   QTableWidget *table;
-  QComboBox *src_bus_combo, *find_bus_combo, *msg_cb, *equal_combo;
+  QComboBox *src_bus_combo, *find_bus_combo, *msg_cb, *sig_cb, *equal_combo;
   QSpinBox *byte_idx_sb, *bit_idx_sb;
   QPushButton *search_btn;
   QLineEdit *min_msgs;
+  QFutureWatcher<QList<mismatched_struct>> *watcher;
+  std::vector<std::pair<int, int>> target_bits;
+  QList<mismatched_struct> results;
 };
@@ -8,35 +8,129 @@
 
 // SegmentTree
 
+static const std::pair<double, double> EMPTY_RANGE = {std::numeric_limits<double>::max(), std::numeric_limits<double>::lowest()};
+
+static inline std::pair<double, double> merge_range(const std::pair<double, double> &l, const std::pair<double, double> &r) {
+  return {std::min(l.first, r.first), std::max(l.second, r.second)};
+}
+
 void SegmentTree::build(const QVector<QPointF> &arr) {
-  size = arr.size();
-  tree.resize(4 * size);  // size of the tree is 4 times the size of the array
-  if (size > 0) {
-    build_tree(arr, 1, 0, size - 1);
-  }
+  tree.clear();
+  capacity = size = 0;
+  update(arr);
 }
 
-void SegmentTree::build_tree(const QVector<QPointF> &arr, int n, int left, int right) {
-  if (left == right) {
-    const double y = arr[left].y();
+void SegmentTree::update(const QVector<QPointF> &arr) {
+  const int new_size = arr.size();
+  if (new_size <= size) return;
+
+  bool rebuild = false;
+  if (new_size > capacity) {
+    int new_capacity = std::max(capacity, 1);
+    while (new_capacity < new_size) new_capacity *= 2;
+    std::vector<std::pair<double, double>> new_tree(2 * new_capacity, EMPTY_RANGE);
+    std::copy_n(tree.begin() + capacity, size, new_tree.begin() + new_capacity);
+    tree.swap(new_tree);
+    capacity = new_capacity;
+    rebuild = true;
+  }
+  // rebuilding the internal nodes is cheaper than updating the paths of many new points
+  rebuild = rebuild || (new_size - size) * std::log2(capacity) > capacity;
+  for (int i = size; i < new_size; ++i) {
+    const double y = arr[i].y();
+    int n = capacity + i;
     tree[n] = {y, y};
-  } else {
-    const int mid = (left + right) >> 1;
-    build_tree(arr, 2 * n, left, mid);
-    build_tree(arr, 2 * n + 1, mid + 1, right);
-    tree[n] = {std::min(tree[2 * n].first, tree[2 * n + 1].first), std::max(tree[2 * n].second, tree[2 * n + 1].second)};
+    if (!rebuild) {
+      for (n /= 2; n > 0; n /= 2) {
+        tree[n] = merge_range(tree[2 * n], tree[2 * n + 1]);
+      }
+    }
+  }
+  size = new_size;
+  if (rebuild) {
+    build_tree();
   }
 }
 
-std::pair<double, double> SegmentTree::get_minmax(int n, int left, int right, int range_left, int range_right) const {
-  if (range_left > right || range_right < left)
-    return {std::numeric_limits<double>::max(), std::numeric_limits<double>::lowest()};
-  if (range_left <= left && range_right >= right)
-    return tree[n];
-  int mid = (left + right) >> 1;
-  auto l = get_minmax(2 * n, left, mid, range_left, range_right);
-  auto r = get_minmax(2 * n + 1, mid + 1, right, range_left, range_right);
-  return {std::min(l.first, r.first), std::max(l.second, r.second)};
+void SegmentTree::build_tree() {
+  for (int n = capacity - 1; n > 0; --n) {
+    tree[n] = merge_range(tree[2 * n], tree[2 * n + 1]);
+  }
+}
+
+std::pair<double, double> SegmentTree::minmax(int left, int right) const {
+  auto ret = EMPTY_RANGE;
+  left = std::max(left, 0);
+  right = std::min(right, size - 1);
+  for (int l = left + capacity, r = right + capacity + 1; l < r; l /= 2, r /= 2) {
+    if (l & 1) ret = merge_range(ret, tree[l++]);
+    if (r & 1) ret = merge_range(ret, tree[--r]);
+  }
+  return ret;
+}
+
+// MinMaxPyramid
+
+void MinMaxPyramid::clear() {
+  levels.clear();
+  size = 0;
+}
+
+void MinMaxPyramid::update(const QVector<QPointF> &vals) {
+  auto merge = [&vals](const Bucket &l, const Bucket &r) -> Bucket {
+    return {vals[r.min_idx].y() < vals[l.min_idx].y() ? r.min_idx : l.min_idx,
+            vals[r.max_idx].y() >= vals[l.max_idx].y() ? r.max_idx : l.max_idx};
+  };
+
+  for (; size < vals.size(); ++size) {
+    for (int n = 0; n < levels.size(); ++n) {
+      auto &buckets = levels[n];
+      if ((size >> (n + 1)) == buckets.size()) {
+        buckets.push_back({size, size});
+      } else {
+        buckets.back() = merge(buckets.back(), {size, size});
+      }
+    }
+    // add a level once its first bucket is complete
+    const int n = levels.size();
+    if (size + 1 == (2 << n)) {
+      auto &buckets = levels.emplace_back();
+      buckets.push_back(n == 0 ? merge({0, 0}, {1, 1}) : merge(levels[n - 1][0], levels[n - 1][1]));
+    }
+  }
+}
+
+void MinMaxPyramid::downsample(const QVector<QPointF> &vals, int first, int last, int max_points, QVector<QPointF> &out) const {
+  out.clear();
+  if (last - first <= max_points || levels.empty()) {
+    out.reserve(last - first);
+    std::copy(vals.begin() + first, vals.begin() + last, std::back_inserter(out));
+    return;
+  }
+
+  // the finest level with at most max_points / 2 buckets in range
+  int level = 0;
+  while (level + 1 < levels.size() && ((last - first) >> (level + 1)) > max_points / 2) {
+    ++level;
+  }
+  out.reserve(max_points * 2);
+  for (int i = first; i < last;) {
+    // the largest aligned bucket starting at i, the edges of the range are covered by smaller buckets.
+    int n = level;
+    while (n >= 0 && ((i & ((2 << n) - 1)) != 0 || i + (2 << n) > last)) {
+      --n;
+    }
+    if (n < 0) {
+      out.push_back(vals[i++]);
+    } else {
+      const auto &bucket = levels[n][i >> (n + 1)];
+      out.push_back(vals[std::min(bucket.min_idx, bucket.max_idx)]);
+      if (bucket.min_idx != bucket.max_idx) {
+        out.push_back(vals[std::max(bucket.min_idx, bucket.max_idx)]);
+      }
+      i += 2 << n;
+    }
+  }
 }
 
 // MessageBytesDelegate
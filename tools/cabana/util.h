@@ -47,16 +47,40 @@ enum {
   BytesRole = Qt::UserRole + 2
 };
 
+// range min/max of the y values of a series. the leaves are stored after the internal nodes of a
+// complete binary tree, which doubles its capacity as points are appended.
 class SegmentTree {
 public:
   SegmentTree() = default;
   void build(const QVector<QPointF> &arr);
-  inline std::pair<double, double> minmax(int left, int right) const { return get_minmax(1, 0, size - 1, left, right); }
+  // appends the points added to arr since the last call, in O(log n) per point
+  void update(const QVector<QPointF> &arr);
+  // min and max of arr[left, right]
+  std::pair<double, double> minmax(int left, int right) const;
 
 private:
-  std::pair<double, double> get_minmax(int n, int left, int right, int range_left, int range_right) const;
-  void build_tree(const QVector<QPointF> &arr, int n, int left, int right);
+  void build_tree();
   std::vector<std::pair<double ,double>> tree;
+  int capacity = 0;
+  int size = 0;
+};
+
+// min/max level-of-detail pyramid of a series. a bucket of level n covers 2^(n+1) points and keeps the
+// indices of their min and max points. the pyramid is extended as points are appended to the series.
+class MinMaxPyramid {
+public:
+  void clear();
+  // indexes the points appended to vals since the last call
+  void update(const QVector<QPointF> &vals);
+  // the points of vals[first, last), reduced to the min and max points of about max_points / 2 buckets.
+  void downsample(const QVector<QPointF> &vals, int first, int last, int max_points, QVector<QPointF> &out) const;
+
+private:
+  struct Bucket {
+    int min_idx;
+    int max_idx;
+  };
+  std::vector<std::vector<Bucket>> levels;
   int size = 0;
 };
 
@@ -1,15 +1,25 @@
 #include "tools/cabana/videowidget.h"
 
+#include <QBuffer>
 #include <QButtonGroup>
+#include <QDataStream>
+#include <QFile>
 #include <QMouseEvent>
 #include <QPainter>
+#include <QSaveFile>
 #include <QStackedLayout>
 #include <QStyleOptionSlider>
 #include <QVBoxLayout>
 #include <QtConcurrent>
 
+#include "tools/replay/filereader.h"
+
 const int MIN_VIDEO_HEIGHT = 100;
 const int THUMBNAIL_MARGIN = 3;
+const int THUMBNAIL_HEIGHT = MIN_VIDEO_HEIGHT - THUMBNAIL_MARGIN * 2;
+const int THUMBNAIL_PREFETCH = 5;  // thumbnails decoded on each side of the hovered one
+const int MAX_DECODED_THUMBNAILS = 100;
+const quint32 THUMBNAIL_CACHE_VERSION = 1;
 
 static const QColor timeline_colors[] = {
   [(int)TimelineType::None] = QColor(111, 143, 175),
@@ -154,6 +164,7 @@ void VideoWidget::updatePlayBtnState() {
 
 // Slider
 Slider::Slider(QWidget *parent) : timer(this), thumbnail_label(parent), QSlider(Qt::Horizontal, parent) {
+  decoded_thumbnails.setMaxCost(MAX_DECODED_THUMBNAILS);
   timer.callOnTimeout([this]() {
     timeline = can->getTimeline();
     std::sort(timeline.begin(), timeline.end(), sortTimelineBasedOnEventPriority);
@@ -161,11 +172,14 @@ Slider::Slider(QWidget *parent) : timer(this), thumbnail_label(parent), QSlider(
   });
   setMouseTracking(true);
   QObject::connect(can, &AbstractStream::streamStarted, this, &Slider::streamStarted);
+  QObject::connect(&decode_watcher, &QFutureWatcher<std::pair<uint64_t, QImage>>::resultReadyAt, this, &Slider::thumbnailDecoded);
+  QObject::connect(&decode_watcher, &QFutureWatcher<std::pair<uint64_t, QImage>>::finished, this, &Slider::decodeFinished);
 }
 
 Slider::~Slider() {
   abort_load_thumbnail = true;
   thumnail_future.waitForFinished();
+  decode_watcher.waitForFinished();
 }
 
 void Slider::streamStarted() {
@@ -173,35 +187,140 @@ void Slider::streamStarted() {
   thumnail_future.waitForFinished();
   abort_load_thumbnail = false;
   thumbnails.clear();
+  alerts.clear();
+  decoded_thumbnails.clear();
   timeline.clear();
   timer.start(2000);
-  thumnail_future = QtConcurrent::run(this, &Slider::loadThumbnails);
+  qlogs.clear();
+  if (auto route = can->route()) {
+    for (auto it = route->segments().rbegin(); it != route->segments().rend(); ++it) {
+      if (!it->second.qlog.isEmpty()) qlogs.push_back(it->second.qlog);
+    }
+  }
+  thumnail_future = QtConcurrent::map(qlogs, [this](const QString &qlog) { loadThumbnails(qlog); });
+}
+
+// the downscaled thumbnails and the alerts of a segment are cached next to its qlog in the download cache
+static bool readThumbnailCache(const QString &fn, std::map<uint64_t, QByteArray> &thumbnails, std::map<uint64_t, AlertInfo> &alerts) {
+  QFile f(fn);
+  if (!f.open(QIODevice::ReadOnly)) return false;
+
+  QDataStream in(&f);
+  quint32 version = 0, height = 0, count = 0;
+  in >> version >> height;
+  if (version != THUMBNAIL_CACHE_VERSION || height != (quint32)THUMBNAIL_HEIGHT) return false;
+
+  in >> count;
+  for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+    quint64 ts;
+    in >> ts;
+    in >> thumbnails[ts];
+  }
+  in >> count;
+  for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+    quint64 ts;
+    qint32 status;
+    AlertInfo alert;
+    in >> ts >> status >> alert.text1 >> alert.text2;
+    alert.status = (cereal::ControlsState::AlertStatus)status;
+    alerts[ts] = alert;
+  }
+  return in.status() == QDataStream::Ok;
+}
+
+static void writeThumbnailCache(const QString &fn, const std::map<uint64_t, QByteArray> &thumbnails, const std::map<uint64_t, AlertInfo> &alerts) {
+  QSaveFile f(fn);
+  if (!f.open(QIODevice::WriteOnly)) return;
+
+  QDataStream out(&f);
+  out << THUMBNAIL_CACHE_VERSION << (quint32)THUMBNAIL_HEIGHT << (quint32)thumbnails.size();
+  for (auto &[ts, jpeg] : thumbnails) {
+    out << (quint64)ts << jpeg;
+  }
+  out << (quint32)alerts.size();
+  for (auto &[ts, alert] : alerts) {
+    out << (quint64)ts << (qint32)alert.status << alert.text1 << alert.text2;
+  }
+  f.commit();
 }
 
-void Slider::loadThumbnails() {
-  const auto &segments = can->route()->segments();
-  for (auto it = segments.rbegin(); it != segments.rend() && !abort_load_thumbnail; ++it) {
+void Slider::loadThumbnails(const QString &qlog) {
+  if (abort_load_thumbnail) return;
+
+  const QString cache_file = QString::fromStdString(cacheFilePath(qlog.toStdString()) + ".thumbnails");
+  std::map<uint64_t, QByteArray> seg_thumbnails;
+  std::map<uint64_t, AlertInfo> seg_alerts;
+  if (!readThumbnailCache(cache_file, seg_thumbnails, seg_alerts)) {
+    seg_thumbnails.clear();
+    seg_alerts.clear();
     LogReader log;
-    std::string qlog = it->second.qlog.toStdString();
-    if (!qlog.empty() && log.load(qlog, &abort_load_thumbnail, {cereal::Event::Which::THUMBNAIL, cereal::Event::Which::CONTROLS_STATE}, true, 0, 3)) {
-      for (auto ev = log.events.cbegin(); ev != log.events.cend() && !abort_load_thumbnail; ++ev) {
-        if ((*ev)->which == cereal::Event::Which::THUMBNAIL) {
-          auto thumb = (*ev)->event.getThumbnail();
-          auto data = thumb.getThumbnail();
-          if (QPixmap pm; pm.loadFromData(data.begin(), data.size(), "jpeg")) {
-            pm = pm.scaledToHeight(MIN_VIDEO_HEIGHT - THUMBNAIL_MARGIN * 2, Qt::SmoothTransformation);
-            std::lock_guard lk(thumbnail_lock);
-            thumbnails[thumb.getTimestampEof()] = pm;
-          }
-        } else if ((*ev)->which == cereal::Event::Which::CONTROLS_STATE) {
-          auto cs = (*ev)->event.getControlsState();
-          if (cs.getAlertType().size() > 0 && cs.getAlertText1().size() > 0) {
-            std::lock_guard lk(thumbnail_lock);
-            alerts.emplace((*ev)->mono_time, AlertInfo{cs.getAlertStatus(), cs.getAlertText1().cStr(), cs.getAlertText2().cStr()});
-          }
+    if (!log.load(qlog.toStdString(), &abort_load_thumbnail, {cereal::Event::Which::THUMBNAIL, cereal::Event::Which::CONTROLS_STATE}, true, 0, 3)) {
+      return;
+    }
+    for (auto ev = log.events.cbegin(); ev != log.events.cend() && !abort_load_thumbnail; ++ev) {
+      if ((*ev)->which == cereal::Event::Which::THUMBNAIL) {
+        auto thumb = (*ev)->event.getThumbnail();
+        auto data = thumb.getThumbnail();
+        if (QImage img; img.loadFromData(data.begin(), data.size(), "jpeg")) {
+          QBuffer buffer(&seg_thumbnails[thumb.getTimestampEof()]);
+          buffer.open(QIODevice::WriteOnly);
+          img.scaledToHeight(THUMBNAIL_HEIGHT, Qt::SmoothTransformation).save(&buffer, "jpeg", 90);
+        }
+      } else if ((*ev)->which == cereal::Event::Which::CONTROLS_STATE) {
+        auto cs = (*ev)->event.getControlsState();
+        if (cs.getAlertType().size() > 0 && cs.getAlertText1().size() > 0) {
+          seg_alerts.emplace((*ev)->mono_time, AlertInfo{cs.getAlertStatus(), cs.getAlertText1().cStr(), cs.getAlertText2().cStr()});
         }
       }
     }
+    if (abort_load_thumbnail) return;
+
+    writeThumbnailCache(cache_file, seg_thumbnails, seg_alerts);
+  }
+
+  std::lock_guard lk(thumbnail_lock);
+  thumbnails.merge(seg_thumbnails);
+  alerts.merge(seg_alerts);
+}
+
+static std::pair<uint64_t, QImage> decodeThumbnail(const std::pair<uint64_t, QByteArray> &jpeg) {
+  return {jpeg.first, QImage::fromData(jpeg.second, "jpeg")};
+}
+
+void Slider::decodeThumbnails(std::map<uint64_t, QByteArray>::const_iterator it) {
+  if (decode_watcher.isRunning()) {
+    pending_decode = it->first;
+    return;
+  }
+
+  std::vector<std::pair<uint64_t, QByteArray>> jpegs;
+  auto first = it;
+  for (int i = 0; i < THUMBNAIL_PREFETCH && first != thumbnails.begin(); ++i) --first;
+  for (int i = 0; first != thumbnails.end() && i < THUMBNAIL_PREFETCH * 2 + 1; ++first, ++i) {
+    if (!decoded_thumbnails.contains(first->first)) jpegs.push_back(*first);
+  }
+  if (!jpegs.empty()) {
+    decode_watcher.setFuture(QtConcurrent::mapped(jpegs, decodeThumbnail));
+  }
+}
+
+void Slider::thumbnailDecoded(int index) {
+  auto [ts, img] = decode_watcher.resultAt(index);
+  if (!img.isNull()) {
+    decoded_thumbnails.insert(ts, new QPixmap(QPixmap::fromImage(img)));
+    if (ts == hovered_thumbnail && hover_x >= 0) {
+      showThumbnail(hover_x);
+    }
+  }
+}
+
+void Slider::decodeFinished() {
+  if (pending_decode != 0) {
+    std::lock_guard lk(thumbnail_lock);
+    if (auto it = thumbnails.find(pending_decode); it != thumbnails.end()) {
+      decodeThumbnails(it);
+    }
+    pending_decode = 0;
   }
 }
 
@@ -251,23 +370,35 @@ void Slider::mousePressEvent(QMouseEvent *e) {
 }
 
 void Slider::mouseMoveEvent(QMouseEvent *e) {
+  hover_x = e->pos().x();
+  showThumbnail(hover_x);
+  QSlider::mouseMoveEvent(e);
+}
+
+void Slider::showThumbnail(int pos_x) {
   QPixmap thumb;
   AlertInfo alert;
-  double seconds = (minimum() + e->pos().x() * ((maximum() - minimum()) / (double)width())) / 1000.0;
+  double seconds = (minimum() + pos_x * ((maximum() - minimum()) / (double)width())) / 1000.0;
   {
     std::lock_guard lk(thumbnail_lock);
     uint64_t mono_time = (seconds + can->routeStartTime()) * 1e9;
-    auto it = thumbnails.lowerBound(mono_time);
-    if (it != thumbnails.end()) thumb = it.value();
+    auto it = thumbnails.lower_bound(mono_time);
+    if (it != thumbnails.end()) {
+      hovered_thumbnail = it->first;
+      if (auto pm = decoded_thumbnails.object(it->first)) {
+        thumb = *pm;
+      } else {
+        decodeThumbnails(it);
+      }
+    }
     auto alert_it = alerts.lower_bound(mono_time);
     if (alert_it != alerts.end() && (alert_it->first - mono_time) < 1e9) {
       alert = alert_it->second;
     }
   }
-  int x = std::clamp(e->pos().x() - thumb.width() / 2, THUMBNAIL_MARGIN, rect().right() - thumb.width() - THUMBNAIL_MARGIN);
+  int x = std::clamp(pos_x - thumb.width() / 2, THUMBNAIL_MARGIN, rect().right() - thumb.width() - THUMBNAIL_MARGIN);
   int y = -thumb.height();
   thumbnail_label.showPixmap(mapToParent({x, y}), utils::formatSeconds(seconds), thumb, alert);
-  QSlider::mouseMoveEvent(e);
 }
 
 bool Slider::event(QEvent *event) {
@@ -277,6 +408,7 @@ bool Slider::event(QEvent *event) {
     case QEvent::FocusIn:
     case QEvent::FocusOut:
     case QEvent::Leave:
+      hover_x = -1;
       thumbnail_label.hide();
       break;
     default:
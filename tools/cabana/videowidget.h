@@ -1,10 +1,16 @@
 #pragma once
 
 #include <atomic>
+#include <map>
 #include <mutex>
+#include <utility>
+#include <vector>
 
+#include <QCache>
 #include <QHBoxLayout>
 #include <QFuture>
+#include <QFutureWatcher>
+#include <QImage>
 #include <QLabel>
 #include <QPushButton>
 #include <QSlider>
@@ -44,14 +50,25 @@ private:
   void sliderChange(QAbstractSlider::SliderChange change) override;
   void paintEvent(QPaintEvent *ev) override;
   void streamStarted();
-  void loadThumbnails();
+  void loadThumbnails(const QString &qlog);
+  void showThumbnail(int x);
+  // decodes the thumbnail and its neighbors, called with thumbnail_lock held
+  void decodeThumbnails(std::map<uint64_t, QByteArray>::const_iterator it);
+  void thumbnailDecoded(int index);
+  void decodeFinished();
 
   int slider_x = -1;
+  int hover_x = -1;
   std::vector<std::tuple<int, int, TimelineType>> timeline;
   std::mutex thumbnail_lock;
   std::atomic<bool> abort_load_thumbnail = false;
-  QMap<uint64_t, QPixmap> thumbnails;
+  std::vector<QString> qlogs;
+  std::map<uint64_t, QByteArray> thumbnails;  // downscaled jpeg by timestamp
   std::map<uint64_t, AlertInfo> alerts;
+  QCache<uint64_t, QPixmap> decoded_thumbnails;
+  QFutureWatcher<std::pair<uint64_t, QImage>> decode_watcher;
+  uint64_t hovered_thumbnail = 0;
+  uint64_t pending_decode = 0;
   QFuture<void> thumnail_future;
   InfoLabel thumbnail_label;
   QTimer timer;
@@ -1,9 +1,62 @@
 #include "tools/replay/camera.h"
 #include "tools/replay/util.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
-CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS]) {
+#include <QtConcurrent>
+
+#include "common/timing.h"
+
+// class FrameCache
+
+void FrameCache::setCapacity(size_t frames) {
+  capacity_ = frames;
+  while (frames_.size() > capacity_) {
+    index_.erase(frames_.back().first);
+    frames_.pop_back();
+  }
+}
+
+bool FrameCache::get(int seg, int id, uint8_t *yuv, size_t size) {
+  auto it = index_.find({seg, id});
+  if (it == index_.end() || it->second->second.size() != size) return false;
+
+  frames_.splice(frames_.begin(), frames_, it->second);
+  memcpy(yuv, it->second->second.data(), size);
+  return true;
+}
+
+std::vector<uint8_t> FrameCache::insert(int seg, int id, std::vector<uint8_t> &&yuv) {
+  std::vector<uint8_t> evicted;
+  if (capacity_ == 0) return std::move(yuv);
+
+  const Key key = {seg, id};
+  if (auto it = index_.find(key); it != index_.end()) {
+    evicted.swap(it->second->second);
+    frames_.erase(it->second);
+    index_.erase(it);
+  } else if (frames_.size() >= capacity_) {
+    evicted.swap(frames_.back().second);
+    index_.erase(frames_.back().first);
+    frames_.pop_back();
+  }
+  frames_.emplace_front(key, std::move(yuv));
+  index_[key] = frames_.begin();
+  return evicted;
+}
+
+void FrameCache::clear() {
+  frames_.clear();
+  index_.clear();
+}
+
+// class CameraServer
+
+CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS], size_t cache_size_mb)
+    : cache_size_(cache_size_mb * 1024 * 1024) {
+  decoder_pool_.setMaxThreadCount(MAX_CAMERAS);
   for (int i = 0; i < MAX_CAMERAS; ++i) {
     std::tie(cameras_[i].width, cameras_[i].height) = camera_size[i];
   }
@@ -11,12 +64,15 @@ CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS]) {
 }
 
 CameraServer::~CameraServer() {
+  exit_ = true;
   for (auto &cam : cameras_) {
+    cam.cv.notify_all();
     if (cam.thread.joinable()) {
       cam.queue.push({});
       cam.thread.join();
     }
   }
+  decoder_pool_.waitForDone();
   vipc_server_.reset(nullptr);
 }
 
@@ -26,6 +82,11 @@ void CameraServer::startVipcServer() {
     if (cam.width > 0 && cam.height > 0) {
       rInfo("camera[%d] frame size %dx%d", cam.type, cam.width, cam.height);
       vipc_server_->create_buffers(cam.stream_type, YUV_BUFFER_COUNT, false, cam.width, cam.height);
+      {
+        std::lock_guard lk(cam.mutex);
+        cam.cache.clear();
+        cam.cache.setCapacity(std::max<size_t>(cache_size_ / (cam.width * cam.height * 3 / 2), 40));
+      }
       if (!cam.thread.joinable()) {
         cam.thread = std::thread(&CameraServer::cameraThread, this, std::ref(cam));
       }
@@ -35,21 +96,15 @@ void CameraServer::startVipcServer() {
 }
 
 void CameraServer::cameraThread(Camera &cam) {
-  auto read_frame = [&](FrameReader *fr, int frame_id) {
-    VisionBuf *yuv_buf = vipc_server_->get_buffer(cam.stream_type);
-    assert(yuv_buf);
-    bool ret = fr->get(frame_id, (uint8_t *)yuv_buf->addr);
-    return ret ? yuv_buf : nullptr;
-  };
-
   while (true) {
     const auto [fr, eidx] = cam.queue.pop();
     if (!fr) break;
 
+    const int seg = eidx.getSegmentNum();
     const int id = eidx.getSegmentId();
-    bool prefetched = (id == cam.cached_id && eidx.getSegmentNum() == cam.cached_seg);
-    auto yuv = prefetched ? cam.cached_buf : read_frame(fr, id);
-    if (yuv) {
+    VisionBuf *yuv = vipc_server_->get_buffer(cam.stream_type);
+    assert(yuv);
+    if (getFrame(cam, fr, seg, id, yuv)) {
       VisionIpcBufExtra extra = {
           .frame_id = eidx.getFrameId(),
           .timestamp_sof = eidx.getTimestampSof(),
@@ -57,19 +112,134 @@ void CameraServer::cameraThread(Camera &cam) {
       };
       yuv->set_frame_id(eidx.getFrameId());
       vipc_server_->send(yuv, &extra);
+      ++frames_sent_;
     } else {
       rError("camera[%d] failed to get frame: %lu", cam.type, eidx.getSegmentId());
     }
 
-    cam.cached_id = id + 1;
-    cam.cached_seg = eidx.getSegmentNum();
-    cam.cached_buf = read_frame(fr, cam.cached_id);
+    {
+      std::lock_guard lk(publish_lock_);
+      --publishing_;
+      --cam.publishing;
+    }
+    publish_cv_.notify_all();
+  }
+}
+
+bool CameraServer::getFrame(Camera &cam, const std::shared_ptr<FrameReader> &fr, int seg, int id, VisionBuf *buf) {
+  auto in_flight = [&]() {
+    return cam.prefetching && cam.prefetch_fr == fr && cam.prefetch_seg == seg &&
+           id >= cam.prefetch_next && id < cam.prefetch_end;
+  };
 
-    --publishing_;
+  std::unique_lock lk(cam.mutex);
+  prefetch(cam, fr, seg, id);
+  if (!cam.cache.contains(seg, id) && in_flight()) {
+    cam.direct_buf = buf;
+    cam.direct_seg = seg;
+    cam.direct_id = id;
+    cam.direct_decoded = false;
   }
+  cam.cv.wait(lk, [&]() { return exit_ || cam.cache.contains(seg, id) || !in_flight(); });
+
+  bool ret = cam.direct_decoded || cam.cache.get(seg, id, (uint8_t *)buf->addr, fr->getYUVSize());
+  cam.direct_buf = nullptr;
+  cam.direct_decoded = false;
+  return ret;
 }
 
-void CameraServer::pushFrame(CameraType type, FrameReader *fr, const cereal::EncodeIndex::Reader &eidx) {
+void CameraServer::prefetch(Camera &cam, const std::shared_ptr<FrameReader> &fr, int seg, int id) {
+  // decode ahead to the end of the next GOP, while leaving room in the cache for the frames being played.
+  // nextKeyFrame() doesn't go past the frames demuxed so far, unlike getFrameCount() it doesn't wait for the demux.
+  const int end = std::min<int>(fr->nextKeyFrame(fr->nextKeyFrame(id)), id + std::max<int>(cam.cache.capacity() / 2, 1));
+  int begin = id;
+  while (begin < end && cam.cache.contains(seg, begin)) {
+    ++begin;
+  }
+  if (begin == end) return;
+
+  if (cam.prefetching && cam.prefetch_fr == fr && cam.prefetch_seg == seg &&
+      begin >= cam.prefetch_next && begin <= cam.prefetch_end) {
+    // the playhead is behind the prefetch task, just extend its range.
+    cam.prefetch_end = std::max(cam.prefetch_end, end);
+    return;
+  }
+
+  cam.prefetch_fr = fr;
+  cam.prefetch_seg = seg;
+  cam.prefetch_next = begin;
+  cam.prefetch_end = end;
+  if (!cam.prefetching) {
+    cam.prefetching = true;
+    QtConcurrent::run(&decoder_pool_, [this, &cam]() { prefetchThread(cam); });
+  }
+}
+
+void CameraServer::prefetchThread(Camera &cam) {
+  std::vector<uint8_t> yuv;
+  std::unique_lock lk(cam.mutex);
+  while (!exit_ && cam.prefetch_next < cam.prefetch_end) {
+    const std::shared_ptr<FrameReader> fr = cam.prefetch_fr;
+    const int seg = cam.prefetch_seg;
+    const int id = cam.prefetch_next;
+    bool ret = true;
+    if (!cam.cache.contains(seg, id)) {
+      const bool direct = cam.direct_buf && cam.direct_seg == seg && cam.direct_id == id;
+      uint8_t *dst = direct ? (uint8_t *)cam.direct_buf->addr : nullptr;
+      if (!dst) {
+        yuv.resize(fr->getYUVSize());
+        dst = yuv.data();
+      }
+
+      lk.unlock();
+      if (auto prev = cam.decoding_fr.lock(); prev != fr) {
+        if (prev) prev->releaseDecoder();
+        cam.decoding_fr = fr;
+      }
+      const uint64_t start_ts = nanos_since_boot();
+      ret = fr->get(id, dst);
+      const uint64_t decode_ns = nanos_since_boot() - start_ts;
+      lk.lock();
+
+      updateDecodeStats(cam, decode_ns);
+      if (direct) {
+        cam.direct_decoded = ret;
+      } else if (ret) {
+        yuv = cam.cache.insert(seg, id, std::move(yuv));
+      }
+    }
+    // the range may have been moved while decoding
+    if (cam.prefetch_fr == fr && cam.prefetch_seg == seg && cam.prefetch_next == id) {
+      cam.prefetch_next = id + 1;
+      if (!ret) {
+        // give up the range, the next request restarts from the frame after the broken one.
+        cam.prefetch_end = cam.prefetch_next;
+      }
+    }
+    cam.cv.notify_all();
+  }
+  cam.prefetch_fr.reset();
+  cam.prefetching = false;
+  cam.cv.notify_all();
+}
+
+void CameraServer::updateDecodeStats(Camera &cam, uint64_t decode_ns) {
+  ++cam.decoded_frames;
+  cam.decode_ns += decode_ns;
+
+  const uint64_t ts = nanos_since_boot();
+  if (cam.decode_stats_ts == 0) {
+    cam.decode_stats_ts = ts;
+  } else if (ts - cam.decode_stats_ts >= 10 * 1e9) {
+    cam.decode_fps = cam.decoded_frames / (cam.decode_ns / 1e9);
+    rDebug("camera[%d] decoding at %.1f fps", cam.type, cam.decode_fps.load());
+    cam.decoded_frames = 0;
+    cam.decode_ns = 0;
+    cam.decode_stats_ts = ts;
+  }
+}
+
+void CameraServer::pushFrame(CameraType type, std::shared_ptr<FrameReader> fr, const cereal::EncodeIndex::Reader &eidx) {
   auto &cam = cameras_[type];
   if (cam.width != fr->width || cam.height != fr->height) {
     cam.width = fr->width;
@@ -78,12 +248,20 @@ void CameraServer::pushFrame(CameraType type, FrameReader *fr, const cereal::Enc
     startVipcServer();
   }
 
-  ++publishing_;
+  {
+    std::lock_guard lk(publish_lock_);
+    ++publishing_;
+    ++cam.publishing;
+  }
   cam.queue.push({fr, eidx});
 }
 
-void CameraServer::waitForSent() {
-  while (publishing_ > 0) {
-    std::this_thread::yield();
-  }
+void CameraServer::waitForSent(int max_pending) {
+  std::unique_lock lk(publish_lock_);
+  publish_cv_.wait(lk, [=]() { return publishing_ <= max_pending; });
+}
+
+void CameraServer::waitForSent(CameraType type, int max_pending) {
+  std::unique_lock lk(publish_lock_);
+  publish_cv_.wait(lk, [&]() { return cameras_[type].publishing <= max_pending; });
 }
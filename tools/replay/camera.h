@@ -1,17 +1,54 @@
 #pragma once
 
 #include <unistd.h>
+
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <QThreadPool>
+
 #include "cereal/visionipc/visionipc_server.h"
 #include "common/queue.h"
 #include "tools/replay/framereader.h"
 #include "tools/replay/logreader.h"
 
+const size_t FRAME_CACHE_SIZE_MB = 256;  // per camera
+
+// decoded frames keyed by (segment, frame id), the least recently used frames are dropped first.
+class FrameCache {
+public:
+  void setCapacity(size_t frames);
+  size_t capacity() const { return capacity_; }
+  size_t size() const { return frames_.size(); }
+  bool contains(int seg, int id) const { return index_.count({seg, id}) > 0; }
+  bool get(int seg, int id, uint8_t *yuv, size_t size);
+  // returns the buffer of an evicted frame for reuse.
+  std::vector<uint8_t> insert(int seg, int id, std::vector<uint8_t> &&yuv);
+  void clear();
+
+private:
+  using Key = std::pair<int, int>;
+  std::list<std::pair<Key, std::vector<uint8_t>>> frames_;
+  std::map<Key, decltype(frames_)::iterator> index_;
+  size_t capacity_ = 0;
+};
+
 class CameraServer {
 public:
-  CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr);
+  CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr, size_t cache_size_mb = FRAME_CACHE_SIZE_MB);
   ~CameraServer();
-  void pushFrame(CameraType type, FrameReader* fr, const cereal::EncodeIndex::Reader& eidx);
-  void waitForSent();
+  void pushFrame(CameraType type, std::shared_ptr<FrameReader> fr, const cereal::EncodeIndex::Reader& eidx);
+  // blocks until at most max_pending frames are waiting to be sent
+  void waitForSent(int max_pending = 0);
+  // blocks until at most max_pending frames of the camera are waiting to be sent
+  void waitForSent(CameraType type, int max_pending);
+  uint64_t framesSent() const { return frames_sent_; }
+  // decoding throughput of the camera, in frames per second of decoding time.
+  float decodeFps(CameraType type) const { return cameras_[type].decode_fps; }
 
 protected:
   struct Camera {
@@ -20,13 +57,39 @@ protected:
     int width;
     int height;
     std::thread thread;
-    SafeQueue<std::pair<FrameReader*, const cereal::EncodeIndex::Reader>> queue;
-    int cached_id = -1;
-    int cached_seg = -1;
-    VisionBuf * cached_buf;
+    SafeQueue<std::pair<std::shared_ptr<FrameReader>, const cereal::EncodeIndex::Reader>> queue;
+    int publishing = 0;  // frames pushed and not sent yet, protected by publish_lock_
+
+    // all frames of a camera are decoded sequentially by one prefetch task,
+    // which decodes [prefetch_next, prefetch_end) of prefetch_seg into the cache.
+    std::mutex mutex;
+    std::condition_variable cv;
+    FrameCache cache;
+    std::shared_ptr<FrameReader> prefetch_fr;
+    int prefetch_seg = -1;
+    int prefetch_next = 0;
+    int prefetch_end = 0;
+    bool prefetching = false;
+    // the frame the camera thread is waiting for is decoded straight into its vipc buffer.
+    VisionBuf *direct_buf = nullptr;
+    int direct_seg = -1;
+    int direct_id = -1;
+    bool direct_decoded = false;
+
+    // the reader which has its decoder open, the others are released when the camera moves on
+    std::weak_ptr<FrameReader> decoding_fr;
+
+    int decoded_frames = 0;
+    uint64_t decode_ns = 0;
+    uint64_t decode_stats_ts = 0;
+    std::atomic<float> decode_fps = 0;
   };
   void startVipcServer();
   void cameraThread(Camera &cam);
+  bool getFrame(Camera &cam, const std::shared_ptr<FrameReader> &fr, int seg, int id, VisionBuf *buf);
+  void prefetch(Camera &cam, const std::shared_ptr<FrameReader> &fr, int seg, int id);
+  void prefetchThread(Camera &cam);
+  void updateDecodeStats(Camera &cam, uint64_t decode_ns);
 
   Camera cameras_[MAX_CAMERAS] = {
       {.type = RoadCam, .stream_type = VISION_STREAM_ROAD},
@@ -34,5 +97,11 @@ protected:
       {.type = WideRoadCam, .stream_type = VISION_STREAM_WIDE_ROAD},
   };
   std::atomic<int> publishing_ = 0;
+  std::atomic<uint64_t> frames_sent_ = 0;
+  std::mutex publish_lock_;
+  std::condition_variable publish_cv_;
+  std::atomic<bool> exit_ = false;
+  const size_t cache_size_;
+  QThreadPool decoder_pool_;
   std::unique_ptr<VisionIpcServer> vipc_server_;
 };
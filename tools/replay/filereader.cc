@@ -1,6 +1,12 @@
 #include "tools/replay/filereader.h"
 
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <vector>
 
 #include "common/util.h"
 #include "tools/replay/util.h"
@@ -15,8 +21,29 @@ std::string cacheFilePath(const std::string &url) {
   return cache_path + sha256(getUrlWithoutQuery(url));
 }
 
+static std::string blockCacheFilePath(const std::string &url, size_t block) {
+  return cacheFilePath(url) + "." + std::to_string(block) + ".blk";
+}
+
+static bool writeFileAtomic(const std::string &file, const std::string &content) {
+  const std::string tmp_file = file + "." + util::random_string(8);
+  if (util::write_file(tmp_file.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT) != 0) {
+    ::unlink(tmp_file.c_str());
+    return false;
+  }
+  return ::rename(tmp_file.c_str(), file.c_str()) == 0;
+}
+
+std::string localFilePath(const std::string &url, bool cache_to_local) {
+  const bool is_remote = isRemoteFile(url);
+  if (is_remote && !cache_to_local) return {};
+
+  const std::string local_file = is_remote ? cacheFilePath(url) : url;
+  return util::file_exists(local_file) ? local_file : "";
+}
+
 std::string FileReader::read(const std::string &file, std::atomic<bool> *abort) {
-  const bool is_remote = file.find("https://") == 0;
+  const bool is_remote = isRemoteFile(file);
   const std::string local_file = is_remote ? cacheFilePath(file) : file;
   std::string result;
 
@@ -32,6 +59,92 @@ std::string FileReader::read(const std::string &file, std::atomic<bool> *abort)
   return result;
 }
 
+std::string FileReader::read(const std::string &file, size_t offset, size_t size, std::atomic<bool> *abort) {
+  const size_t file_size = getFileSize(file, abort);
+  if (offset >= file_size || size == 0) return {};
+  size = std::min(size, file_size - offset);
+
+  if (std::string local_file = localFilePath(file, cache_to_local_); !local_file.empty()) {
+    std::string result(size, '\0');
+    std::ifstream fs(local_file, std::ios::binary | std::ios::in);
+    fs.seekg(offset).read(result.data(), size);
+    return fs.gcount() == size ? result : "";
+  }
+
+  const size_t first = offset / RANGE_BLOCK_SIZE;
+  const size_t last = (offset + size - 1) / RANGE_BLOCK_SIZE;
+  std::vector<std::string> blocks(last - first + 1);
+  if (cache_to_local_) {
+    for (size_t i = first; i <= last; ++i) {
+      blocks[i - first] = util::read_file(blockCacheFilePath(file, i));
+    }
+  }
+
+  // fetch each run of consecutive missing blocks with a single request
+  for (size_t i = first; i <= last;) {
+    if (!blocks[i - first].empty()) {
+      ++i;
+      continue;
+    }
+    size_t end = i;
+    while (end <= last && blocks[end - first].empty()) ++end;
+
+    const size_t range_begin = i * RANGE_BLOCK_SIZE;
+    const size_t range_end = std::min(end * RANGE_BLOCK_SIZE, file_size);
+    std::string data = downloadRange(file, range_begin, range_end - range_begin, abort);
+    if (data.empty()) return {};
+
+    for (; i < end; ++i) {
+      std::string &block = blocks[i - first];
+      block = data.substr((i * RANGE_BLOCK_SIZE) - range_begin, RANGE_BLOCK_SIZE);
+      if (cache_to_local_ && !writeFileAtomic(blockCacheFilePath(file, i), block)) {
+        rWarning("failed to write cache block %zu of %s", i, file.c_str());
+      }
+    }
+  }
+
+  std::string result;
+  result.reserve((last - first + 1) * RANGE_BLOCK_SIZE);
+  for (const auto &block : blocks) {
+    result += block;
+  }
+  if (cache_to_local_ && (last + 1) * RANGE_BLOCK_SIZE >= file_size) {
+    mergeCachedBlocks(file, file_size);
+  }
+  return result.substr(offset - first * RANGE_BLOCK_SIZE, size);
+}
+
+size_t FileReader::getFileSize(const std::string &file, std::atomic<bool> *abort) {
+  if (file != sized_file_ || file_size_ == 0) {
+    struct stat st = {};
+    if (std::string local_file = localFilePath(file, cache_to_local_); !local_file.empty()) {
+      file_size_ = stat(local_file.c_str(), &st) == 0 ? st.st_size : 0;
+    } else {
+      file_size_ = isRemoteFile(file) ? getRemoteFileSize(file, abort) : 0;
+    }
+    sized_file_ = file;
+  }
+  return file_size_;
+}
+
+void FileReader::mergeCachedBlocks(const std::string &url, size_t file_size) {
+  const size_t block_count = (file_size + RANGE_BLOCK_SIZE - 1) / RANGE_BLOCK_SIZE;
+  for (size_t i = 0; i < block_count; ++i) {
+    if (!util::file_exists(blockCacheFilePath(url, i))) return;
+  }
+
+  std::string content;
+  content.reserve(file_size);
+  for (size_t i = 0; i < block_count; ++i) {
+    content += util::read_file(blockCacheFilePath(url, i));
+  }
+  if (content.size() == file_size && writeFileAtomic(cacheFilePath(url), content)) {
+    for (size_t i = 0; i < block_count; ++i) {
+      ::unlink(blockCacheFilePath(url, i).c_str());
+    }
+  }
+}
+
 std::string FileReader::download(const std::string &url, std::atomic<bool> *abort) {
   for (int i = 0; i <= max_retries_ && !(abort && *abort); ++i) {
     if (i > 0) rWarning("download failed, retrying %d", i);
@@ -43,3 +156,41 @@ std::string FileReader::download(const std::string &url, std::atomic<bool> *abor
   }
   return {};
 }
+
+std::string FileReader::downloadRange(const std::string &url, size_t offset, size_t size, std::atomic<bool> *abort) {
+  for (int i = 0; i <= max_retries_ && !(abort && *abort); ++i) {
+    if (i > 0) rWarning("download failed, retrying %d", i);
+
+    std::string result = httpGetRange(url, offset, size, abort);
+    if (!result.empty()) {
+      return result;
+    }
+  }
+  return {};
+}
+
+// class MappedFile
+
+MappedFile::MappedFile(const std::string &fn) {
+  unique_fd fd(HANDLE_EINTR(open(fn.c_str(), O_RDONLY | O_CLOEXEC)));
+  if (fd < 0) return;
+
+  struct stat st = {};
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) return;
+
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    rWarning("failed to mmap %s: %s", fn.c_str(), strerror(errno));
+    return;
+  }
+  // the whole file is parsed right after mapping, let the kernel read ahead.
+  madvise(addr, st.st_size, MADV_WILLNEED);
+  data_ = addr;
+  size_ = st.st_size;
+}
+
+MappedFile::~MappedFile() {
+  if (data_) {
+    munmap(data_, size_);
+  }
+}
@@ -3,18 +3,47 @@
 #include <atomic>
 #include <string>
 
+// remote files are fetched and cached in blocks of this size by range reads
+const size_t RANGE_BLOCK_SIZE = 1024 * 1024;
+
 class FileReader {
 public:
   FileReader(bool cache_to_local, size_t chunk_size = 0, int retries = 3)
       : cache_to_local_(cache_to_local), chunk_size_(chunk_size), max_retries_(retries) {}
   virtual ~FileReader() {}
   std::string read(const std::string &file, std::atomic<bool> *abort = nullptr);
+  // read [offset, offset + size) of file. missing blocks of a remote file are fetched with one http range request,
+  // and kept in the local cache if cache_to_local is set. once all blocks are cached, they are merged into the
+  // regular cache file.
+  std::string read(const std::string &file, size_t offset, size_t size, std::atomic<bool> *abort = nullptr);
+  size_t getFileSize(const std::string &file, std::atomic<bool> *abort = nullptr);
 
 private:
   std::string download(const std::string &url, std::atomic<bool> *abort);
+  std::string downloadRange(const std::string &url, size_t offset, size_t size, std::atomic<bool> *abort);
+  void mergeCachedBlocks(const std::string &url, size_t file_size);
   size_t chunk_size_;
   int max_retries_;
   bool cache_to_local_;
+  std::string sized_file_;
+  size_t file_size_ = 0;
+};
+
+// read-only, page-aligned mapping of a local file. the mapping is released on destruction.
+class MappedFile {
+public:
+  MappedFile(const std::string &fn);
+  ~MappedFile();
+  inline bool valid() const { return data_ != nullptr; }
+  inline const char *data() const { return (const char *)data_; }
+  inline size_t size() const { return size_; }
+
+private:
+  void *data_ = nullptr;
+  size_t size_ = 0;
 };
 
+inline bool isRemoteFile(const std::string &url) { return url.find("https://") == 0 || url.find("http://") == 0; }
 std::string cacheFilePath(const std::string &url);
+// returns the path of the local file for url: the file itself, or its cache entry if it has been downloaded.
+std::string localFilePath(const std::string &url, bool cache_to_local);
@@ -1,10 +1,14 @@
 #include "tools/replay/framereader.h"
 #include "tools/replay/util.h"
 
+#include <sys/stat.h>
+
 #include <cassert>
+#include <cstring>
 #include "libyuv.h"
 
 #include "cereal/visionipc/visionbuf.h"
+#include "common/util.h"
 
 #ifdef __APPLE__
 #define HW_DEVICE_TYPE AV_HWDEVICE_TYPE_VIDEOTOOLBOX
@@ -33,6 +37,77 @@ int readPacket(void *opaque, uint8_t *buf, int buf_size) {
   return buf_size;
 }
 
+// remote videos are demuxed through windows of this size, read with range requests
+const int64_t RANGE_WINDOW_SIZE = 4 * RANGE_BLOCK_SIZE;
+
+// reads a remote video for the demuxer through the block cache of FileReader. the last window read is
+// kept in memory, so that the packets can be checked against the data they were demuxed from.
+struct range_data {
+  FileReader *reader;
+  const std::string *url;
+  std::atomic<bool> *abort;
+  int64_t size;
+  int64_t offset = 0;
+  int64_t window_begin = 0;
+  std::string window;
+
+  // returns [pos, pos + len) of the file, or nullptr if it could not be read
+  const char *get(int64_t pos, int64_t len) {
+    if (pos < 0 || pos + len > size) return nullptr;
+
+    if (pos < window_begin || pos + len > window_begin + (int64_t)window.size()) {
+      window_begin = pos / RANGE_BLOCK_SIZE * RANGE_BLOCK_SIZE;
+      const int64_t window_end = std::min(size, std::max(window_begin + RANGE_WINDOW_SIZE, pos + len));
+      window = reader->read(*url, window_begin, window_end - window_begin, abort);
+      if (window.size() != window_end - window_begin) {
+        window.clear();
+        return nullptr;
+      }
+    }
+    return window.data() + (pos - window_begin);
+  }
+};
+
+int readRange(void *opaque, uint8_t *buf, int buf_size) {
+  struct range_data *rd = (struct range_data *)opaque;
+  buf_size = std::min<int64_t>(buf_size, rd->size - rd->offset);
+  if (buf_size <= 0) return AVERROR_EOF;
+
+  const char *data = rd->get(rd->offset, buf_size);
+  if (!data) return AVERROR(EIO);
+
+  memcpy(buf, data, buf_size);
+  rd->offset += buf_size;
+  return buf_size;
+}
+
+int64_t seekRange(void *opaque, int64_t offset, int whence) {
+  struct range_data *rd = (struct range_data *)opaque;
+  switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE: return rd->size;
+    case SEEK_SET: rd->offset = offset; break;
+    case SEEK_CUR: rd->offset += offset; break;
+    case SEEK_END: rd->offset = rd->size + offset; break;
+    default: return -1;
+  }
+  return rd->offset;
+}
+
+const char FRAME_INDEX_MAGIC[4] = {'F', 'I', 'D', 'X'};
+const uint32_t FRAME_INDEX_VERSION = 2;
+
+struct FrameIndexHeader {
+  char magic[4];
+  uint32_t version;
+  int32_t codec_id;
+  int32_t width;
+  int32_t height;
+  uint32_t count;
+  // the video the index was built from, mtime is 0 for a remote video
+  uint64_t video_size;
+  int64_t video_mtime;
+};
+
 enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts) {
   enum AVPixelFormat *hw_pix_fmt = reinterpret_cast<enum AVPixelFormat *>(ctx->opaque);
   for (const enum AVPixelFormat *p = pix_fmts; *p != -1; p++) {
@@ -46,16 +121,20 @@ enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *
 
 }  // namespace
 
-FrameReader::FrameReader() {
+FrameReader::FrameReader(int decoder_threads) : decoder_threads_(decoder_threads) {
   av_log_set_level(AV_LOG_QUIET);
 }
 
 FrameReader::~FrameReader() {
+  stop_demux_ = true;
+  if (demux_thread_.joinable()) demux_thread_.join();
+
   for (AVPacket *pkt : packets) {
     av_packet_free(&pkt);
   }
 
   if (decoder_ctx) avcodec_free_context(&decoder_ctx);
+  if (codecpar_) avcodec_parameters_free(&codecpar_);
   if (input_ctx) avformat_close_input(&input_ctx);
   if (hw_device_ctx) av_buffer_unref(&hw_device_ctx);
 
@@ -66,25 +145,103 @@ FrameReader::~FrameReader() {
 }
 
 bool FrameReader::load(const std::string &url, bool no_hw_decoder, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
-  FileReader f(local_cache, chunk_size, retries);
-  std::string data = f.read(url, abort);
-  if (data.empty()) return false;
+  const std::string index_file = local_cache || !isRemoteFile(url) ? cacheFilePath(url) + ".idx" : "";
+  const std::string local_file = localFilePath(url, local_cache);
+  video_file_ = isRemoteFile(url) ? cacheFilePath(url) : url;
+  if (local_file.empty() && isRemoteFile(url) && local_cache) {
+    // a video which is not downloaded yet is read with range requests, which are cached in blocks.
+    // the packet table comes from the index, or from a demux streaming through the blocks, and the
+    // GOPs are fetched as they are decoded.
+    remote_reader_ = std::make_unique<FileReader>(true, chunk_size, retries);
+    url_ = url;
+    abort_ = abort;
+    if (util::file_exists(index_file)) {
+      if (loadIndex(index_file, no_hw_decoder)) return true;
+      // the index is valid, but the video could not be opened
+      if (!packet_info_.empty()) return false;
+    }
+    // the size is fetched once here, the reader is shared with the demux thread
+    if (remote_reader_->getFileSize(url, abort) == 0) return false;
+
+    // the demux reads the whole file, it goes on in the background once the first GOP can be decoded.
+    demuxing_ = true;
+    demux_thread_ = std::thread([this, no_hw_decoder, index_file]() {
+      if (demux(no_hw_decoder, &stop_demux_)) saveIndex(index_file);
+      {
+        std::lock_guard lk(demux_lock_);
+        demuxing_ = false;
+      }
+      demux_cv_.notify_all();
+    });
+    std::unique_lock lk(demux_lock_);
+    while (!demux_cv_.wait_for(lk, std::chrono::milliseconds(100), [this]() { return !demuxing_ || key_frames_count_ > 1; })) {
+      if (abort && *abort) stop_demux_ = true;
+    }
+    // a demux which fails later on leaves the frames before the error
+    valid_ = valid_ || (demuxing_ && !packet_info_.empty());
+    return valid_;
+  }
+
+  if (!local_file.empty()) {
+    mapped_file_ = std::make_unique<MappedFile>(local_file);
+  }
+  if (mapped_file_ && mapped_file_->valid()) {
+    data_ = mapped_file_->data();
+    data_size_ = mapped_file_->size();
+  } else {
+    mapped_file_.reset(nullptr);
+    FileReader f(local_cache, chunk_size, retries);
+    owned_data_ = f.read(url, abort);
+    if (owned_data_.empty()) return false;
+
+    data_ = owned_data_.data();
+    data_size_ = owned_data_.size();
+  }
+
+  if (!index_file.empty() && util::file_exists(index_file)) {
+    if (loadIndex(index_file, no_hw_decoder)) return true;
+    if (!packet_info_.empty()) return false;
+  }
 
-  return load((std::byte *)data.data(), data.size(), no_hw_decoder, abort);
+  if (!demux(no_hw_decoder, abort)) return false;
+
+  if (!index_file.empty() && !util::file_exists(index_file)) {
+    saveIndex(index_file);
+  }
+  return true;
 }
 
 bool FrameReader::load(const std::byte *data, size_t size, bool no_hw_decoder, std::atomic<bool> *abort) {
+  owned_data_.assign((const char *)data, size);
+  data_ = owned_data_.data();
+  data_size_ = owned_data_.size();
+  return demux(no_hw_decoder, abort);
+}
+
+bool FrameReader::demux(bool no_hw_decoder, std::atomic<bool> *abort) {
   input_ctx = avformat_alloc_context();
   if (!input_ctx) return false;
 
   struct buffer_data bd = {
-    .data = (const uint8_t*)data,
+    .data = (const uint8_t*)data_,
     .offset = 0,
-    .size = size,
+    .size = data_size_,
   };
+  struct range_data rd = {
+    .reader = remote_reader_.get(),
+    .url = &url_,
+    .abort = abort,
+    .size = remote_reader_ ? (int64_t)remote_reader_->getFileSize(url_, abort) : 0,
+  };
+  if (remote_reader_ && rd.size == 0) return false;
+
   const int avio_ctx_buffer_size = 64 * 1024;
   unsigned char *avio_ctx_buffer = (unsigned char *)av_malloc(avio_ctx_buffer_size);
-  avio_ctx_ = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 0, &bd, readPacket, nullptr, nullptr);
+  if (remote_reader_) {
+    avio_ctx_ = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 0, &rd, readRange, nullptr, seekRange);
+  } else {
+    avio_ctx_ = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 0, &bd, readPacket, nullptr, nullptr);
+  }
   input_ctx->pb = avio_ctx_;
 
   input_ctx->probesize = 10 * 1024 * 1024;  // 10MB
@@ -110,6 +267,79 @@ bool FrameReader::load(const std::byte *data, size_t size, bool no_hw_decoder, s
   ret = avcodec_parameters_to_context(decoder_ctx, video->codecpar);
   if (ret != 0) return false;
 
+  if (!openDecoder(no_hw_decoder)) return false;
+
+  // while demuxing in the background, the packets read are added to the table whenever it is not being decoded from.
+  std::vector<std::pair<PacketInfo, AVPacket *>> pending;
+  auto add_pending = [&]() {
+    for (auto &[info, pkt] : pending) {
+      packet_info_.push_back(info);
+      // some stream seems to contain no keyframes
+      key_frames_count_ += info.flags & AV_PKT_FLAG_KEY;
+      if (pkt) {
+        packets.resize(packet_info_.size(), nullptr);
+        packets.back() = pkt;
+        // frames are matched to packets by pts
+        pkt->pts = pkt->dts = packet_info_.size() - 1;
+      }
+    }
+    pending.clear();
+  };
+
+  packet_info_.reserve(60 * 20);  // 20fps, one minute
+  bool has_contiguous_packets = false, eof = false;
+  while (!(abort && *abort)) {
+    AVPacket *pkt = av_packet_alloc();
+    ret = av_read_frame(input_ctx, pkt);
+    if (ret < 0) {
+      av_packet_free(&pkt);
+      eof = (ret == AVERROR_EOF);
+      break;
+    }
+
+    const char *file_data = nullptr;
+    if (remote_reader_) {
+      file_data = rd.get(pkt->pos, pkt->size);
+    } else if (pkt->pos >= 0 && pkt->pos + pkt->size <= data_size_) {
+      file_data = data_ + pkt->pos;
+    }
+    pending.push_back({{.pos = pkt->pos, .size = pkt->size, .flags = pkt->flags}, pkt});
+    if (file_data && memcmp(file_data, pkt->data, pkt->size) == 0) {
+      has_contiguous_packets = true;
+      pending.back().second = nullptr;
+      av_packet_free(&pkt);
+    }
+
+    std::unique_lock lk(demux_lock_, std::defer_lock);
+    if (!demuxing_ || lk.try_lock()) {
+      add_pending();
+      if (lk.owns_lock()) {
+        lk.unlock();
+        demux_cv_.notify_all();
+      }
+    }
+  }
+
+  std::unique_lock lk(demux_lock_, std::defer_lock);
+  if (demuxing_) lk.lock();
+  add_pending();
+  const bool success = eof && !packet_info_.empty();
+  valid_ = valid_ || success;
+  if (!has_contiguous_packets) {
+    // every packet is kept in memory, the file is no longer needed.
+    mapped_file_.reset(nullptr);
+    owned_data_ = {};
+    data_ = nullptr;
+    data_size_ = 0;
+  }
+  if (demuxing_ && !success && !(abort && *abort)) {
+    rError("failed to demux %s after %zu frames", url_.c_str(), packet_info_.size());
+  }
+  return success;
+}
+
+bool FrameReader::openDecoder(bool no_hw_decoder) {
+  no_hw_decoder_ = no_hw_decoder;
   width = (decoder_ctx->width + 3) & ~3;
   height = decoder_ctx->height;
   visionbuf_compute_aligned_width_and_height(width, height, &aligned_width, &aligned_height);
@@ -120,26 +350,131 @@ bool FrameReader::load(const std::byte *data, size_t size, bool no_hw_decoder, s
     }
   }
 
-  ret = avcodec_open2(decoder_ctx, decoder, nullptr);
-  if (ret < 0) return false;
+  av_frame_.reset(av_frame_alloc());
+  if (hw_pix_fmt == AV_PIX_FMT_NONE) {
+    // decode several frames of a GOP in parallel, at the cost of a few frames of latency.
+    decoder_ctx->thread_count = decoder_threads_;
+    decoder_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
 
-  packets.reserve(60 * 20);  // 20fps, one minute
-  while (!(abort && *abort)) {
-    AVPacket *pkt = av_packet_alloc();
-    ret = av_read_frame(input_ctx, pkt);
-    if (ret < 0) {
-      av_packet_free(&pkt);
-      valid_ = (ret == AVERROR_EOF);
-      break;
-    }
-    packets.push_back(pkt);
-    // some stream seems to contain no keyframes
-    key_frames_count_ += pkt->flags & AV_PKT_FLAG_KEY;
+  if (avcodec_open2(decoder_ctx, decoder_ctx->codec, nullptr) < 0) return false;
+
+  if (!codecpar_) {
+    codecpar_ = avcodec_parameters_alloc();
+    if (!codecpar_ || avcodec_parameters_from_context(codecpar_, decoder_ctx) < 0) return false;
   }
-  valid_ = valid_ && !packets.empty();
+  return true;
+}
+
+bool FrameReader::reopenDecoder() {
+  const AVCodec *decoder = codecpar_ ? avcodec_find_decoder(codecpar_->codec_id) : nullptr;
+  if (!decoder) return false;
+
+  decoder_ctx = avcodec_alloc_context3(decoder);
+  if (!decoder_ctx || avcodec_parameters_to_context(decoder_ctx, codecpar_) < 0 || !openDecoder(no_hw_decoder_)) {
+    avcodec_free_context(&decoder_ctx);
+    return false;
+  }
+  next_packet_idx_ = last_frame_idx_ = -1;
+  return true;
+}
+
+void FrameReader::releaseDecoder() {
+  if (!decoder_ctx || !codecpar_) return;
+
+  avcodec_free_context(&decoder_ctx);
+  if (hw_device_ctx) av_buffer_unref(&hw_device_ctx);
+  hw_pix_fmt = AV_PIX_FMT_NONE;
+  av_frame_.reset();
+  hw_frame.reset();
+  next_packet_idx_ = last_frame_idx_ = -1;
+}
+
+bool FrameReader::loadIndex(const std::string &file, bool no_hw_decoder) {
+  const std::string content = util::read_file(file);
+  FrameIndexHeader header = {};
+  if (content.size() >= sizeof(header)) {
+    memcpy(&header, content.data(), sizeof(header));
+  }
+  if (memcmp(header.magic, FRAME_INDEX_MAGIC, sizeof(FRAME_INDEX_MAGIC)) != 0 || header.version != FRAME_INDEX_VERSION ||
+      content.size() != sizeof(header) + header.count * sizeof(PacketInfo) || header.count == 0) {
+    rWarning("invalid frame index %s", file.c_str());
+    ::unlink(file.c_str());
+    return false;
+  }
+  uint64_t video_size = 0;
+  int64_t video_mtime = 0;
+  if (!statVideo(&video_size, &video_mtime) || video_size != header.video_size || video_mtime != header.video_mtime) {
+    rWarning("frame index %s does not match the video", file.c_str());
+    ::unlink(file.c_str());
+    return false;
+  }
+
+  packet_info_.resize(header.count);
+  memcpy(packet_info_.data(), content.data() + sizeof(header), header.count * sizeof(PacketInfo));
+  for (const auto &info : packet_info_) {
+    key_frames_count_ += info.flags & AV_PKT_FLAG_KEY;
+  }
+  const PacketInfo &last = packet_info_.back();
+  const size_t file_size = remote_reader_ ? remote_reader_->getFileSize(url_, abort_) : data_size_;
+  if ((data_ || remote_reader_) && last.pos + last.size > file_size) {
+    rWarning("frame index %s does not match the video", file.c_str());
+    packet_info_.clear();
+    key_frames_count_ = 0;
+    ::unlink(file.c_str());
+    return false;
+  }
+
+  const AVCodec *decoder = avcodec_find_decoder((AVCodecID)header.codec_id);
+  if (!decoder) return false;
+
+  decoder_ctx = avcodec_alloc_context3(decoder);
+  decoder_ctx->width = header.width;
+  decoder_ctx->height = header.height;
+  if (!openDecoder(no_hw_decoder)) return false;
+
+  // parameter sets are only guaranteed to be in the first packet, feed it to the decoder once.
+  valid_ = decode(0, nullptr);
   return valid_;
 }
 
+bool FrameReader::statVideo(uint64_t *size, int64_t *mtime) const {
+  if (remote_reader_) {
+    // not downloaded yet, only the size of the remote video is known
+    *size = remote_reader_->getFileSize(url_, abort_);
+    *mtime = 0;
+    return *size > 0;
+  }
+
+  struct stat st;
+  if (stat(video_file_.c_str(), &st) != 0) return false;
+
+  *size = st.st_size;
+  *mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  return true;
+}
+
+void FrameReader::saveIndex(const std::string &file) const {
+  // packets can only be read directly from the file if they are stored contiguously, e.g. raw HEVC.
+  for (const AVPacket *pkt : packets) {
+    if (pkt) return;
+  }
+
+  const AVCodecParameters *codecpar = input_ctx->streams[0]->codecpar;
+  FrameIndexHeader header = {.version = FRAME_INDEX_VERSION, .codec_id = codecpar->codec_id, .width = codecpar->width,
+                             .height = codecpar->height, .count = (uint32_t)packet_info_.size()};
+  memcpy(header.magic, FRAME_INDEX_MAGIC, sizeof(FRAME_INDEX_MAGIC));
+  // an index which can't be checked against its video isn't written
+  if (!statVideo(&header.video_size, &header.video_mtime)) return;
+
+  std::string content((const char *)&header, sizeof(header));
+  content.append((const char *)packet_info_.data(), packet_info_.size() * sizeof(PacketInfo));
+  const std::string tmp_file = file + "." + util::random_string(8);
+  if (util::write_file(tmp_file.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT) == 0) {
+    ::rename(tmp_file.c_str(), file.c_str());
+  }
+}
+
 bool FrameReader::initHardwareDecoder(AVHWDeviceType hw_device_type) {
   for (int i = 0;; i++) {
     const AVCodecHWConfig *config = avcodec_get_hw_config(decoder_ctx->codec, i);
@@ -170,51 +505,173 @@ bool FrameReader::initHardwareDecoder(AVHWDeviceType hw_device_type) {
 
 bool FrameReader::get(int idx, uint8_t *yuv) {
   assert(yuv != nullptr);
-  if (!valid_ || idx < 0 || idx >= packets.size()) {
+  // while demuxing in the background, the packet table is locked while decoding
+  std::unique_lock lk(demux_lock_, std::defer_lock);
+  if (demuxing_) {
+    lk.lock();
+    demux_cv_.wait(lk, [&]() { return !demuxing_ || idx < (int)packet_info_.size(); });
+  }
+  if (!valid_ || idx < 0 || idx >= packet_info_.size()) {
     return false;
   }
   return decode(idx, yuv);
 }
 
+size_t FrameReader::getFrameCount() const {
+  std::unique_lock lk(demux_lock_);
+  demux_cv_.wait(lk, [this]() { return !demuxing_; });
+  return packet_info_.size();
+}
+
+size_t FrameReader::memoryUsage() const {
+  std::unique_lock lk(demux_lock_, std::defer_lock);
+  if (demuxing_) lk.lock();
+  size_t size = data_size_ + gop_data_.size() + packet_info_.capacity() * sizeof(PacketInfo);
+  for (const AVPacket *pkt : packets) {
+    if (pkt) size += sizeof(AVPacket) + pkt->size;
+  }
+  return size;
+}
+
+int FrameReader::nextKeyFrame(int idx) const {
+  std::unique_lock lk(demux_lock_, std::defer_lock);
+  if (demuxing_) lk.lock();
+  if (key_frames_count_ > 1) {
+    for (int i = std::max(idx + 1, 0); i < packet_info_.size(); ++i) {
+      if (packet_info_[i].flags & AV_PKT_FLAG_KEY) return i;
+    }
+  }
+  return packet_info_.size();
+}
+
 bool FrameReader::decode(int idx, uint8_t *yuv) {
+  if (!decoder_ctx) {
+    // the decoder was released. parameter sets are only guaranteed to be in the first packet, feed it again.
+    if (!reopenDecoder() || (idx != 0 && !decode(0, nullptr))) return false;
+  }
+
   int from_idx = idx;
-  if (idx != prev_idx + 1 && key_frames_count_ > 1) {
+  if (key_frames_count_ > 1) {
     // seeking to the nearest key frame
     for (int i = idx; i >= 0; --i) {
-      if (packets[i]->flags & AV_PKT_FLAG_KEY) {
+      if (packet_info_[i].flags & AV_PKT_FLAG_KEY) {
         from_idx = i;
         break;
       }
     }
   }
-  prev_idx = idx;
+  // keep decoding from the current position, unless the frame is behind it or a key frame can be skipped to.
+  if (idx <= last_frame_idx_ || next_packet_idx_ < from_idx) {
+    avcodec_flush_buffers(decoder_ctx);
+    next_packet_idx_ = from_idx;
+    last_frame_idx_ = from_idx - 1;
+  }
+
+  while (true) {
+    int ret = avcodec_receive_frame(decoder_ctx, av_frame_.get());
+    if (ret == 0) {
+      last_frame_idx_ = av_frame_->pts;
+      if (last_frame_idx_ < idx) continue;
 
-  for (int i = from_idx; i <= idx; ++i) {
-    AVFrame *f = decodeFrame(packets[i]);
-    if (f && i == idx) {
-      return copyBuffers(f, yuv);
+      AVFrame *f = last_frame_idx_ == idx ? receiveFrame() : nullptr;
+      if (f) {
+        return !yuv || copyBuffers(f, yuv);
+      }
+      break;
+    } else if (ret != AVERROR(EAGAIN)) {
+      rError("avcodec_receive_frame error: %d", ret);
+      break;
+    }
+
+    // the decoder needs more packets
+    if (next_packet_idx_ >= packet_info_.size() && demuxing_) {
+      // get() holds demux_lock_
+      demux_cv_.wait(demux_lock_, [this]() { return !demuxing_ || next_packet_idx_ < packet_info_.size(); });
+    }
+    if (next_packet_idx_ >= packet_info_.size()) {
+      // drain the frames left in the decoder
+      avcodec_send_packet(decoder_ctx, nullptr);
+      continue;
+    }
+    if (remote_reader_ && !fetchGOP(next_packet_idx_, std::max(next_packet_idx_, idx))) {
+      rError("failed to fetch frames %d-%d of %s", next_packet_idx_, idx, url_.c_str());
+      break;
+    }
+    AVPacket *pkt = getPacket(next_packet_idx_++);
+    if (!pkt) break;
+
+    ret = avcodec_send_packet(decoder_ctx, pkt);
+    if (ret < 0) {
+      rError("Error sending a packet for decoding: %d", ret);
     }
   }
+
+  // start over from the key frame on the next request
+  next_packet_idx_ = -1;
   return false;
 }
 
-AVFrame *FrameReader::decodeFrame(AVPacket *pkt) {
-  int ret = avcodec_send_packet(decoder_ctx, pkt);
-  if (ret < 0) {
-    rError("Error sending a packet for decoding: %d", ret);
-    return nullptr;
+AVPacket *FrameReader::getPacket(int idx) {
+  if (idx < packets.size() && packets[idx]) return packets[idx];
+
+  const PacketInfo &info = packet_info_[idx];
+  const char *data = nullptr;
+  if (remote_reader_) {
+    if (idx < gop_begin_ || idx >= gop_end_ || info.pos < gop_pos_ || info.pos + info.size > gop_pos_ + (int64_t)gop_data_.size()) {
+      return nullptr;
+    }
+    data = gop_data_.data() + (info.pos - gop_pos_);
+  } else {
+    if (!data_ || info.pos < 0 || info.pos + info.size > data_size_) return nullptr;
+    data = data_ + info.pos;
   }
 
-  av_frame_.reset(av_frame_alloc());
-  ret = avcodec_receive_frame(decoder_ctx, av_frame_.get());
-  if (ret != 0) {
-    rError("avcodec_receive_frame error: %d", ret);
-    return nullptr;
+  if (!pkt_) {
+    pkt_.reset(av_packet_alloc());
   }
+  av_packet_unref(pkt_.get());
+  if (av_new_packet(pkt_.get(), info.size) < 0) return nullptr;
+
+  memcpy(pkt_->data, data, info.size);
+  pkt_->flags = info.flags;
+  pkt_->pts = pkt_->dts = idx;
+  return pkt_.get();
+}
+
+bool FrameReader::fetchGOP(int from_idx, int idx) {
+  if (!remote_reader_) return true;
+  if (from_idx >= gop_begin_ && idx < gop_end_) return true;
+
+  // fetch up to the next key frame, so that the following sequential reads need no more requests.
+  int end = idx + 1;
+  while (end < packet_info_.size() && !(packet_info_[end].flags & AV_PKT_FLAG_KEY)) {
+    ++end;
+  }
+  // the packets which are not stored contiguously in the file are in memory already
+  int64_t begin_pos = INT64_MAX, end_pos = 0;
+  for (int i = from_idx; i < end; ++i) {
+    if (i < packets.size() && packets[i]) continue;
+    begin_pos = std::min(begin_pos, packet_info_[i].pos);
+    end_pos = std::max(end_pos, packet_info_[i].pos + packet_info_[i].size);
+  }
+  gop_data_.clear();
+  if (begin_pos < end_pos) {
+    gop_data_ = remote_reader_->read(url_, begin_pos, end_pos - begin_pos, abort_);
+    if (gop_data_.size() != end_pos - begin_pos) {
+      gop_begin_ = gop_end_ = -1;
+      return false;
+    }
+  }
+  gop_begin_ = from_idx;
+  gop_end_ = end;
+  gop_pos_ = begin_pos;
+  return true;
+}
 
+AVFrame *FrameReader::receiveFrame() {
   if (av_frame_->format == hw_pix_fmt) {
     hw_frame.reset(av_frame_alloc());
-    if ((ret = av_hwframe_transfer_data(hw_frame.get(), av_frame_.get(), 0)) < 0) {
+    if (av_hwframe_transfer_data(hw_frame.get(), av_frame_.get(), 0) < 0) {
       rError("error transferring the data from GPU to CPU");
       return nullptr;
     }
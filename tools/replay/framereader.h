@@ -1,7 +1,10 @@
 #pragma once
 
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "tools/replay/filereader.h"
@@ -15,37 +18,92 @@ struct AVFrameDeleter {
   void operator()(AVFrame* frame) const { av_frame_free(&frame); }
 };
 
+struct AVPacketDeleter {
+  void operator()(AVPacket* pkt) const { av_packet_free(&pkt); }
+};
+
 class FrameReader {
 public:
-  FrameReader();
+  // decoder_threads: number of threads used by the software decoder, 0 to let ffmpeg decide.
+  FrameReader(int decoder_threads = 0);
   ~FrameReader();
   bool load(const std::string &url, bool no_hw_decoder = false, std::atomic<bool> *abort = nullptr, bool local_cache = false,
             int chunk_size = -1, int retries = 0);
   bool load(const std::byte *data, size_t size, bool no_hw_decoder = false, std::atomic<bool> *abort = nullptr);
+  // a remote video without an index is demuxed in the background after load() returns. get() waits for
+  // the packets of the frame, getFrameCount() for the whole video, nextKeyFrame() and memoryUsage() don't wait.
   bool get(int idx, uint8_t *yuv);
   int getYUVSize() const { return width * height * 3 / 2; }
-  size_t getFrameCount() const { return packets.size(); }
+  size_t getFrameCount() const;
+  int nextKeyFrame(int idx) const;
   bool valid() const { return valid_; }
+  // frees the decoder and its threads, the next get() opens it again
+  void releaseDecoder();
+  // bytes held by the video data and the packet table, not counting the decoder
+  size_t memoryUsage() const;
 
   int width = 0, height = 0;
   int aligned_width = 0, aligned_height = 0;
 
 private:
+  struct PacketInfo {
+    int64_t pos;
+    int32_t size;
+    int32_t flags;
+  };
+  bool openDecoder(bool no_hw_decoder);
+  bool reopenDecoder();
   bool initHardwareDecoder(AVHWDeviceType hw_device_type);
+  bool demux(bool no_hw_decoder, std::atomic<bool> *abort);
   bool decode(int idx, uint8_t *yuv);
-  AVFrame * decodeFrame(AVPacket *pkt);
+  AVPacket *getPacket(int idx);
+  bool fetchGOP(int from_idx, int idx);
+  AVFrame *receiveFrame();
   bool copyBuffers(AVFrame *f, uint8_t *yuv);
+  // the packet index is persisted next to the cache entry, so that later loads of a video skip
+  // the demux, and remote videos only need to fetch the GOPs that are actually decoded.
+  bool loadIndex(const std::string &file, bool no_hw_decoder);
+  void saveIndex(const std::string &file) const;
+  // size and mtime of the video the index is checked against
+  bool statVideo(uint64_t *size, int64_t *mtime) const;
 
+  // packets are read on demand from the (mapped) file. only packets which are not stored
+  // contiguously in the file, e.g. in MPEG-TS, are kept in memory.
   std::vector<AVPacket*> packets;
+  std::vector<PacketInfo> packet_info_;
+  std::unique_ptr<MappedFile> mapped_file_;
+  std::string owned_data_;
+  std::string video_file_;  // the local file of the video, or its cache file
+  const char *data_ = nullptr;
+  size_t data_size_ = 0;
+  std::unique_ptr<AVPacket, AVPacketDeleter> pkt_;
+  // remote mode: the video is demuxed through range reads, and packets are read on demand a GOP at a time
+  std::unique_ptr<FileReader> remote_reader_;
+  std::string url_;
+  std::atomic<bool> *abort_ = nullptr;
+  std::string gop_data_;
+  // demux thread of a remote video. while demuxing_, demux_lock_ protects the packet table, valid_ and the decoder.
+  std::thread demux_thread_;
+  mutable std::mutex demux_lock_;
+  mutable std::condition_variable_any demux_cv_;
+  std::atomic<bool> demuxing_ = false, stop_demux_ = false;
+  int gop_begin_ = -1, gop_end_ = -1;
+  int64_t gop_pos_ = 0;  // position of gop_data_ in the file
   std::unique_ptr<AVFrame, AVFrameDeleter>av_frame_, hw_frame;
   AVFormatContext *input_ctx = nullptr;
   AVCodecContext *decoder_ctx = nullptr;
+  AVCodecParameters *codecpar_ = nullptr;  // of the decoder, to open it again once released
+  bool no_hw_decoder_ = false;
   int key_frames_count_ = 0;
   bool valid_ = false;
   AVIOContext *avio_ctx_ = nullptr;
 
   AVPixelFormat hw_pix_fmt = AV_PIX_FMT_NONE;
   AVBufferRef *hw_device_ctx = nullptr;
-  int prev_idx = -1;
+  const int decoder_threads_;
+  // decoder state: the next packet to send and the last frame received.
+  // with frame threading, frames come out of the decoder a few packets later.
+  int next_packet_idx_ = -1;
+  int last_frame_idx_ = -1;
   inline static std::atomic<bool> has_hw_decoder = true;
 };
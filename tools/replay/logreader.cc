@@ -1,6 +1,14 @@
 #include "tools/replay/logreader.h"
 
+#include <sys/stat.h>
+
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <future>
+
+#include <capnp/serialize.h>
+#include "common/util.h"
 #include "tools/replay/util.h"
 
 Event::Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame) : reader(amsg), frame(frame) {
@@ -26,6 +34,41 @@ Event::Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame) : reader(a
 
 // class LogReader
 
+namespace {
+
+const size_t LOG_FETCH_SIZE = 4 * RANGE_BLOCK_SIZE;
+
+inline kj::ArrayPtr<const capnp::word> toWords(const char *data, size_t size) {
+  return kj::ArrayPtr<const capnp::word>((const capnp::word *)data, size / sizeof(capnp::word));
+}
+
+bool fetchBZ2(const std::string &url, const DecompressChunkHandler &handler, bool local_cache, int retries, std::atomic<bool> *abort) {
+  FileReader reader(local_cache, 0, retries);
+  const size_t size = reader.getFileSize(url, abort);
+  if (size == 0) return false;
+
+  BZ2StreamDecoder decoder(handler, abort);
+  auto fetch = [&](size_t offset) {
+    return std::async(std::launch::async, [&reader, &url, offset, abort]() {
+      return reader.read(url, offset, LOG_FETCH_SIZE, abort);
+    });
+  };
+  // download the next piece while the current one is decompressed
+  auto next = fetch(0);
+  for (size_t offset = 0; offset < size; offset += LOG_FETCH_SIZE) {
+    std::string data = next.get();
+    if (data.empty()) return false;
+
+    if (offset + LOG_FETCH_SIZE < size) {
+      next = fetch(offset + LOG_FETCH_SIZE);
+    }
+    if (!decoder.push(data)) return false;
+  }
+  return decoder.finish();
+}
+
+}  // namespace
+
 LogReader::LogReader(size_t memory_pool_block_size) {
 #ifdef HAS_MEMORY_RESOURCE
   const size_t buf_size = sizeof(Event) * memory_pool_block_size;
@@ -49,67 +92,433 @@ LogReader::~LogReader() {
 bool LogReader::load(const std::string &url, std::atomic<bool> *abort,
                      const std::set<cereal::Event::Which> &allow,
                      bool local_cache, int chunk_size, int retries) {
-  raw_ = FileReader(local_cache, chunk_size, retries).read(url, abort);
-  if (raw_.empty()) return false;
+  const bool is_bz2 = url.find(".bz2") != std::string::npos;
+  const bool is_remote = isRemoteFile(url);
+  const std::string index_file = (!is_remote || local_cache) ? cacheFilePath(url) + ".idx" : "";
+  // the index is checked against the file on disk, the download cache of remote logs
+  const std::string log_file = is_remote ? cacheFilePath(url) : url;
+  auto index = std::make_unique<LogIndex>();
+  if (!index_file.empty() && !(index->load(index_file) && index->isIndexOf(log_file))) {
+    index.reset(nullptr);
+  }
+
+  if (!is_bz2) {
+    if (std::string local_file = localFilePath(url, local_cache); !local_file.empty()) {
+      auto mapped = std::make_unique<MappedFile>(local_file);
+      if (mapped->valid()) {
+        mapped_file_ = std::move(mapped);
+        return parse(mapped_file_->data(), mapped_file_->size(), allow, abort, std::move(index), index_file, log_file);
+      }
+    }
+  }
 
-  if (url.find(".bz2") != std::string::npos) {
-    raw_ = decompressBZ2(raw_, abort);
-    if (raw_.empty()) return false;
+  if (is_bz2 && !index && is_remote && localFilePath(url, local_cache).empty()) {
+    // download the log piece by piece, decompressing and parsing what has arrived while the rest is downloading.
+    return parseBZ2([&](const DecompressChunkHandler &handler) {
+      return fetchBZ2(url, handler, local_cache, retries, abort);
+    }, allow, abort, index_file, log_file);
   }
-  return parse(allow, abort);
+
+  std::string data = FileReader(local_cache, chunk_size, retries).read(url, abort);
+  if (data.empty()) return false;
+
+  if (is_bz2) {
+    if (!index) {
+      return parseBZ2([&](const DecompressChunkHandler &handler) {
+        return decompressBZ2((const std::byte *)data.data(), data.size(), handler, abort);
+      }, allow, abort, index_file, log_file);
+    }
+    // random access needs the whole log in one buffer
+    std::string decompressed;
+    decompressed.reserve(index->data_size);
+    bool ret = decompressBZ2((const std::byte *)data.data(), data.size(), [&](std::string &&chunk) {
+      decompressed += chunk;
+    }, abort);
+    if (!ret) return false;
+    data = std::move(decompressed);
+  }
+  const std::string &buf = buffers_.emplace_back(std::move(data));
+  return parse(buf.data(), buf.size(), allow, abort, std::move(index), index_file, log_file);
 }
 
 bool LogReader::load(const std::byte *data, size_t size, std::atomic<bool> *abort) {
-  raw_.assign((const char *)data, size);
-  return parse({}, abort);
+  const std::string &buf = buffers_.emplace_back((const char *)data, size);
+  return parse(buf.data(), buf.size(), {}, abort);
 }
 
-bool LogReader::parse(const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort) {
+size_t LogReader::memoryUsage() const {
+  size_t size = mapped_file_ ? mapped_file_->size() : 0;
+  for (const auto &buf : buffers_) {
+    size += buf.capacity();
+  }
+  // the event pool is sized like the events vector
+  return size + events.capacity() * (sizeof(Event *) + sizeof(Event));
+}
+
+bool LogReader::parse(const char *data, size_t size, const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort,
+                      std::unique_ptr<LogIndex> index, const std::string &index_file, const std::string &log_file) {
+  if (index) {
+    if (index->data_size == size) {
+      return parseIndexed(data, size, *index, allow, abort);
+    }
+    rWarning("log index %s is out of date, rebuilding", index_file.c_str());
+  }
+
+  std::unique_ptr<LogIndex> new_index;
+  if (!index_file.empty()) {
+    new_index = std::make_unique<LogIndex>();
+  }
+
+  bool complete = false;
   try {
-    kj::ArrayPtr<const capnp::word> words((const capnp::word *)raw_.data(), raw_.size() / sizeof(capnp::word));
-    while (words.size() > 0 && !(abort && *abort)) {
-      if (!allow.empty()) {
-        capnp::FlatArrayMessageReader reader(words);
-        auto which = reader.getRoot<cereal::Event>().which();
-        if (allow.find(which) == allow.end()) {
-          words = kj::arrayPtr(reader.getEnd(), words.end());
-          continue;
+    auto words = toWords(data, size);
+    complete = parseMessages(words, allow, abort, new_index.get(), 0) == words.size();
+    if (!complete && !(abort && *abort)) {
+      rWarning("failed to parse log : incomplete message at the end of log");
+    }
+  } catch (const kj::Exception &e) {
+    rWarning("failed to parse log : %s", e.getDescription().cStr());
+    if (!events.empty()) {
+      rWarning("read %zu events from corrupt log", events.size());
+    }
+  }
+
+  if (new_index && complete && !(abort && *abort)) {
+    new_index->data_size = size;
+    new_index->save(index_file, log_file);
+  }
+  return finishParse(abort);
+}
+
+bool LogReader::parseIndexed(const char *data, size_t size, const LogIndex &index,
+                             const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort) {
+  size_t count = 0;
+  for (const auto &[which, n] : index.type_counts) {
+    if (allow.empty() || allow.find((cereal::Event::Which)which) != allow.end()) count += n;
+  }
+  events.reserve(count);
+
+  // entries are stored in Event::lessThan order, there is no need to scan or sort the log.
+  try {
+    for (const auto &entry : index.entries) {
+      if (abort && *abort) break;
+      if (!allow.empty() && allow.find((cereal::Event::Which)entry.which) == allow.end()) continue;
+
+#ifdef HAS_MEMORY_RESOURCE
+      Event *evt = new (mbr_) Event(toWords(data + entry.offset, size - entry.offset), entry.frame);
+#else
+      Event *evt = new Event(toWords(data + entry.offset, size - entry.offset), entry.frame);
+#endif
+      events.push_back(evt);
+    }
+  } catch (const kj::Exception &e) {
+    rWarning("failed to parse log : %s", e.getDescription().cStr());
+  }
+  return !events.empty() && !(abort && *abort);
+}
+
+bool LogReader::parseBZ2(const std::function<bool(const DecompressChunkHandler &)> &decompress,
+                         const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort, const std::string &index_file,
+                         const std::string &log_file) {
+  std::unique_ptr<LogIndex> new_index;
+  if (!index_file.empty()) {
+    new_index = std::make_unique<LogIndex>();
+  }
+
+  // parse the decompressed chunks while the remaining blocks are still being decompressed.
+  // a message split across chunks is carried over and completed with the data of the following chunks.
+  std::string pending;
+  uint64_t pending_offset = 0;  // offset of pending in the decompressed log
+  bool corrupt = false;
+  bool ret = decompress([&](std::string &&chunk) {
+    if (corrupt || (abort && *abort)) return;
+
+    if (pending.empty()) {
+      pending = std::move(chunk);
+    } else {
+      pending += chunk;
+    }
+    auto words = toWords(pending.data(), pending.size());
+    if (capnp::expectedSizeInWordsFromPrefix(words) > words.size()) return;
+
+    const std::string &buf = buffers_.emplace_back(std::move(pending));
+    try {
+      size_t consumed = parseMessages(toWords(buf.data(), buf.size()), allow, abort, new_index.get(), pending_offset) * sizeof(capnp::word);
+      pending.assign(buf.data() + consumed, buf.size() - consumed);
+      pending_offset += consumed;
+    } catch (const kj::Exception &e) {
+      rWarning("failed to parse log : %s", e.getDescription().cStr());
+      corrupt = true;
+    }
+  });
+
+  if (!ret) return false;
+  if (!pending.empty() && !corrupt) {
+    rWarning("failed to parse log : incomplete message at the end of log");
+  }
+
+  if (new_index && pending.empty() && !corrupt && !(abort && *abort)) {
+    new_index->data_size = pending_offset;
+    new_index->save(index_file, log_file);
+  }
+  return finishParse(abort);
+}
+
+size_t LogReader::parseMessages(kj::ArrayPtr<const capnp::word> words, const std::set<cereal::Event::Which> &allow,
+                                std::atomic<bool> *abort, LogIndex *index, uint64_t offset) {
+  auto is_encode_idx = [](cereal::Event::Which which) {
+    return which == cereal::Event::ROAD_ENCODE_IDX ||
+           which == cereal::Event::DRIVER_ENCODE_IDX ||
+           which == cereal::Event::WIDE_ROAD_ENCODE_IDX;
+  };
+
+  const capnp::word *begin = words.begin();
+  while (words.size() > 0 && !(abort && *abort)) {
+    if (capnp::expectedSizeInWordsFromPrefix(words) > words.size()) break;
+
+    const uint64_t msg_offset = offset + (words.begin() - begin) * sizeof(capnp::word);
+    if (!allow.empty()) {
+      capnp::FlatArrayMessageReader reader(words);
+      auto which = reader.getRoot<cereal::Event>().which();
+      if (allow.find(which) == allow.end()) {
+        if (index) {
+          // the index covers all events, not only the allowed ones
+          index->add(msg_offset, Event(words));
+          if (is_encode_idx(which)) index->add(msg_offset, Event(words, true));
         }
+        words = kj::arrayPtr(reader.getEnd(), words.end());
+        continue;
       }
+    }
 
 #ifdef HAS_MEMORY_RESOURCE
-      Event *evt = new (mbr_) Event(words);
+    Event *evt = new (mbr_) Event(words);
 #else
-      Event *evt = new Event(words);
+    Event *evt = new Event(words);
 #endif
 
-      // Add encodeIdx packet again as a frame packet for the video stream
-      if (evt->which == cereal::Event::ROAD_ENCODE_IDX ||
-          evt->which == cereal::Event::DRIVER_ENCODE_IDX ||
-          evt->which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
+    // Add encodeIdx packet again as a frame packet for the video stream
+    if (is_encode_idx(evt->which)) {
 
 #ifdef HAS_MEMORY_RESOURCE
-        Event *frame_evt = new (mbr_) Event(words, true);
+      Event *frame_evt = new (mbr_) Event(words, true);
 #else
-        Event *frame_evt = new Event(words, true);
+      Event *frame_evt = new Event(words, true);
 #endif
 
-        events.push_back(frame_evt);
-      }
-
-      words = kj::arrayPtr(evt->reader.getEnd(), words.end());
-      events.push_back(evt);
-    }
-  } catch (const kj::Exception &e) {
-    rWarning("failed to parse log : %s", e.getDescription().cStr());
-    if (!events.empty()) {
-      rWarning("read %zu events from corrupt log", events.size());
+      events.push_back(frame_evt);
+      if (index) index->add(msg_offset, *frame_evt);
     }
+
+    words = kj::arrayPtr(evt->reader.getEnd(), words.end());
+    events.push_back(evt);
+    if (index) index->add(msg_offset, *evt);
   }
+  return words.begin() - begin;
+}
 
+bool LogReader::finishParse(std::atomic<bool> *abort) {
   if (!events.empty() && !(abort && *abort)) {
     std::sort(events.begin(), events.end(), Event::lessThan());
     return true;
   }
   return false;
 }
+
+// class LogIndex
+
+namespace {
+
+const char LOG_INDEX_MAGIC[4] = {'L', 'I', 'D', 'X'};
+const uint32_t LOG_INDEX_VERSION = 2;
+
+struct LogIndexHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t data_size;
+  uint64_t log_file_size;
+  int64_t log_file_mtime;
+  uint32_t entry_count;
+  uint32_t type_count;
+};
+
+struct LogIndexTypeCount {
+  uint16_t which;
+  uint32_t count;
+};
+
+bool statLogFile(const std::string &file, uint64_t *size, int64_t *mtime) {
+  struct stat st;
+  if (stat(file.c_str(), &st) != 0) return false;
+
+  *size = st.st_size;
+  *mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  return true;
+}
+
+}  // namespace
+
+void LogIndex::add(uint64_t offset, const Event &e) {
+  entries.push_back({.offset = offset, .mono_time = e.mono_time, .which = (uint16_t)e.which, .frame = e.frame});
+  ++type_counts[(uint16_t)e.which];
+}
+
+bool LogIndex::load(const std::string &file) {
+  const std::string content = util::read_file(file);
+  if (content.size() < sizeof(LogIndexHeader)) return false;
+
+  LogIndexHeader header;
+  memcpy(&header, content.data(), sizeof(header));
+  const size_t expected_size = sizeof(header) + header.entry_count * sizeof(Entry) + header.type_count * sizeof(LogIndexTypeCount);
+  if (memcmp(header.magic, LOG_INDEX_MAGIC, sizeof(LOG_INDEX_MAGIC)) != 0 || header.version != LOG_INDEX_VERSION ||
+      content.size() != expected_size) {
+    rWarning("invalid log index %s", file.c_str());
+    return false;
+  }
+
+  const char *p = content.data() + sizeof(header);
+  entries.resize(header.entry_count);
+  memcpy(entries.data(), p, header.entry_count * sizeof(Entry));
+  p += header.entry_count * sizeof(Entry);
+
+  type_counts.clear();
+  for (uint32_t i = 0; i < header.type_count; ++i, p += sizeof(LogIndexTypeCount)) {
+    LogIndexTypeCount tc;
+    memcpy(&tc, p, sizeof(tc));
+    type_counts[tc.which] = tc.count;
+  }
+
+  data_size = header.data_size;
+  log_file_size = header.log_file_size;
+  log_file_mtime = header.log_file_mtime;
+  for (const auto &e : entries) {
+    if (e.offset >= data_size) {
+      rWarning("invalid log index %s", file.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+bool LogIndex::isIndexOf(const std::string &log_file) const {
+  uint64_t size;
+  int64_t mtime;
+  return statLogFile(log_file, &size, &mtime) && size == log_file_size && mtime == log_file_mtime;
+}
+
+bool LogIndex::save(const std::string &file, const std::string &log_file) {
+  // an index which can't be checked against its log isn't written
+  if (!statLogFile(log_file, &log_file_size, &log_file_mtime)) return false;
+
+  std::sort(entries.begin(), entries.end(), [](const Entry &l, const Entry &r) {
+    return l.mono_time < r.mono_time || (l.mono_time == r.mono_time && l.which < r.which);
+  });
+
+  LogIndexHeader header = {.version = LOG_INDEX_VERSION, .data_size = data_size,
+                           .log_file_size = log_file_size, .log_file_mtime = log_file_mtime,
+                           .entry_count = (uint32_t)entries.size(), .type_count = (uint32_t)type_counts.size()};
+  memcpy(header.magic, LOG_INDEX_MAGIC, sizeof(LOG_INDEX_MAGIC));
+
+  std::string content((const char *)&header, sizeof(header));
+  content.append((const char *)entries.data(), entries.size() * sizeof(Entry));
+  for (const auto &[which, count] : type_counts) {
+    LogIndexTypeCount tc = {.which = which, .count = count};
+    content.append((const char *)&tc, sizeof(tc));
+  }
+
+  // write to a temporary file first, other processes may be reading the same index.
+  const std::string tmp_file = file + "." + util::random_string(8);
+  if (util::write_file(tmp_file.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT) != 0) {
+    rWarning("failed to write log index %s", file.c_str());
+    return false;
+  }
+  return ::rename(tmp_file.c_str(), file.c_str()) == 0;
+}
+
+// class SegmentedEvents
+
+// heap order: the smallest event on top, ties are resolved in segment order.
+bool SegmentedEvents::spanGreater(const Span &l, const Span &r) {
+  if (Event::lessThan()(*r.it, *l.it)) return true;
+  return !Event::lessThan()(*l.it, *r.it) && l.seg > r.seg;
+}
+
+void SegmentedEvents::insert(int seg, const std::vector<Event *> &events) {
+  segments_[seg] = {events.cbegin(), events.cend(), seg};
+}
+
+std::vector<SegmentedEvents::Span> SegmentedEvents::spans() const {
+  std::vector<Span> result;
+  result.reserve(segments_.size());
+  for (auto &[n, span] : segments_) {
+    Span s = span;
+    // keep initData of the first segment only
+    if (!result.empty() && s.it != s.end && (*s.it)->which == cereal::Event::Which::INIT_DATA) ++s.it;
+    if (s.it != s.end) result.push_back(s);
+  }
+  return result;
+}
+
+size_t SegmentedEvents::size() const {
+  size_t n = 0;
+  for (const auto &s : spans()) {
+    n += std::distance(s.it, s.end);
+  }
+  return n;
+}
+
+const Event *SegmentedEvents::back() const {
+  const Event *last = nullptr;
+  for (const auto &s : spans()) {
+    if (!last || !Event::lessThan()(*(s.end - 1), last)) last = *(s.end - 1);
+  }
+  return last;
+}
+
+SegmentedEvents::Iterator SegmentedEvents::begin() const {
+  return Iterator(spans());
+}
+
+SegmentedEvents::Iterator SegmentedEvents::upperBound(const Event *e) const {
+  std::vector<Span> result;
+  for (auto s : spans()) {
+    s.it = std::upper_bound(s.it, s.end, e, Event::lessThan());
+    if (s.it != s.end) result.push_back(s);
+  }
+  return Iterator(std::move(result));
+}
+
+SegmentedEvents::Iterator::Iterator(std::vector<Span> &&spans) : pending_(std::move(spans)) {
+  // the smallest first event at the back
+  std::sort(pending_.begin(), pending_.end(), spanGreater);
+  activate();
+}
+
+void SegmentedEvents::Iterator::activate() {
+  while (!pending_.empty() && (heap_.empty() || !spanGreater(pending_.back(), heap_.front()))) {
+    heap_.push_back(pending_.back());
+    pending_.pop_back();
+    std::push_heap(heap_.begin(), heap_.end(), spanGreater);
+  }
+}
+
+SegmentedEvents::Iterator &SegmentedEvents::Iterator::operator++() {
+  if (heap_.size() == 1) {
+    if (++heap_[0].it == heap_[0].end) heap_.pop_back();
+  } else {
+    std::pop_heap(heap_.begin(), heap_.end(), spanGreater);
+    Span &span = heap_.back();
+    if (++span.it == span.end) {
+      heap_.pop_back();
+    } else {
+      std::push_heap(heap_.begin(), heap_.end(), spanGreater);
+    }
+  }
+  activate();
+  return *this;
+}
+
+bool SegmentedEvents::Iterator::operator==(const Iterator &other) const {
+  if (heap_.empty() || other.heap_.empty()) return heap_.empty() == other.heap_.empty();
+  return heap_.front().it == other.heap_.front().it;
+}
@@ -5,11 +5,16 @@
 #include <memory_resource>
 #endif
 
+#include <deque>
+#include <iterator>
+#include <map>
+#include <memory>
 #include <set>
 
 #include "cereal/gen/cpp/log.capnp.h"
 #include "system/camerad/cameras/camera_common.h"
 #include "tools/replay/filereader.h"
+#include "tools/replay/util.h"
 
 const CameraType ALL_CAMERAS[] = {RoadCam, DriverCam, WideRoadCam};
 const int MAX_CAMERAS = std::size(ALL_CAMERAS);
@@ -48,6 +53,29 @@ public:
   bool frame;
 };
 
+// sidecar index of a log, stored next to its download cache entry.
+// allows loading the events of selected services with random access, without scanning and sorting the whole log.
+struct LogIndex {
+  struct Entry {
+    uint64_t offset;  // byte offset of the message in the decompressed log
+    uint64_t mono_time;
+    uint16_t which;
+    bool frame;
+  };
+  void add(uint64_t offset, const Event &e);
+  bool load(const std::string &file);
+  // false if log_file changed since the index was built from it
+  bool isIndexOf(const std::string &log_file) const;
+  // sorts the entries in Event::lessThan order and writes the index of log_file to file
+  bool save(const std::string &file, const std::string &log_file);
+
+  uint64_t data_size = 0;  // size of the decompressed log
+  uint64_t log_file_size = 0;  // size and mtime (ns) of the log file on disk
+  int64_t log_file_mtime = 0;
+  std::vector<Entry> entries;
+  std::map<uint16_t, uint32_t> type_counts;
+};
+
 class LogReader {
 public:
   LogReader(size_t memory_pool_block_size = DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE);
@@ -55,13 +83,80 @@ public:
   bool load(const std::string &url, std::atomic<bool> *abort = nullptr, const std::set<cereal::Event::Which> &allow = {},
             bool local_cache = false, int chunk_size = -1, int retries = 0);
   bool load(const std::byte *data, size_t size, std::atomic<bool> *abort = nullptr);
+  // bytes held by the log: the decompressed or mapped log, which events point into, and the events
+  size_t memoryUsage() const;
   std::vector<Event*> events;
 
 private:
-  bool parse(const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort);
-  std::string raw_;
+  bool parse(const char *data, size_t size, const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort,
+             std::unique_ptr<LogIndex> index = nullptr, const std::string &index_file = {}, const std::string &log_file = {});
+  bool parseIndexed(const char *data, size_t size, const LogIndex &index,
+                    const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort);
+  bool parseBZ2(const std::function<bool(const DecompressChunkHandler &)> &decompress,
+                const std::set<cereal::Event::Which> &allow, std::atomic<bool> *abort, const std::string &index_file,
+                const std::string &log_file);
+  // parses all complete messages in words, returns the number of words consumed.
+  // if index is set, every message is added to it at its offset in the log, starting from `offset`.
+  size_t parseMessages(kj::ArrayPtr<const capnp::word> words, const std::set<cereal::Event::Which> &allow,
+                       std::atomic<bool> *abort, LogIndex *index, uint64_t offset);
+  bool finishParse(std::atomic<bool> *abort);
+
+  // events point into these buffers, their addresses must stay stable while the log is loading.
+  std::deque<std::string> buffers_;
+  // uncompressed local logs are parsed in place, events point directly into the mapped pages.
+  std::unique_ptr<MappedFile> mapped_file_;
 #ifdef HAS_MEMORY_RESOURCE
   std::pmr::monotonic_buffer_resource *mbr_ = nullptr;
   void *pool_buffer_ = nullptr;
 #endif
 };
+
+// the sorted events of several segments, merged on the fly while iterating.
+// adding or removing a segment only touches the events of that segment.
+class SegmentedEvents {
+  struct Span {
+    std::vector<Event *>::const_iterator it, end;
+    int seg;
+  };
+
+public:
+  class Iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = const Event *;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const Event *const *;
+    using reference = const Event *;
+
+    inline const Event *operator*() const { return *heap_.front().it; }
+    Iterator &operator++();
+    bool operator==(const Iterator &other) const;
+    inline bool operator!=(const Iterator &other) const { return !(*this == other); }
+
+  private:
+    friend class SegmentedEvents;
+    Iterator() = default;
+    Iterator(std::vector<Span> &&spans);
+    void activate();
+    // min-heap of the segments being merged. segments barely overlap, so the others wait
+    // in pending_ until the merge reaches their first event.
+    std::vector<Span> heap_;
+    std::vector<Span> pending_;
+  };
+
+  void insert(int seg, const std::vector<Event *> &events);
+  void erase(int seg) { segments_.erase(seg); }
+  void clear() { segments_.clear(); }
+  bool empty() const { return size() == 0; }
+  size_t size() const;
+  const Event *back() const;
+  Iterator begin() const;
+  Iterator end() const { return Iterator(); }
+  // returns an iterator to the first event which is greater than e
+  Iterator upperBound(const Event *e) const;
+
+private:
+  static bool spanGreater(const Span &l, const Span &r);
+  std::vector<Span> spans() const;
+  std::map<int, Span> segments_;
+};
@@ -16,6 +16,7 @@ int main(int argc, char *argv[]) {
       {"qcam", REPLAY_FLAG_QCAMERA, "load qcamera"},
       {"no-hw-decoder", REPLAY_FLAG_NO_HW_DECODER, "disable HW video decoding"},
       {"no-vipc", REPLAY_FLAG_NO_VIPC, "do not output video"},
+      {"headless", REPLAY_FLAG_HEADLESS, "replay once as fast as possible without UI, and report the throughput"},
   };
 
   QCommandLineParser parser;
@@ -64,7 +65,12 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
-  ConsoleUI console_ui(replay);
+  std::unique_ptr<ConsoleUI> console_ui;
+  if (replay->hasFlag(REPLAY_FLAG_HEADLESS)) {
+    QObject::connect(replay, &Replay::streamFinished, &app, &QCoreApplication::quit, Qt::QueuedConnection);
+  } else {
+    console_ui = std::make_unique<ConsoleUI>(replay);
+  }
   replay->start(parser.value("start").toInt());
   return app.exec();
 }
@@ -7,11 +7,15 @@
 #include "cereal/services.h"
 #include "common/params.h"
 #include "common/timing.h"
+#include "common/util.h"
 #include "system/hardware/hw.h"
 #include "tools/replay/util.h"
 
 Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *sm_, uint32_t flags, QString data_dir, QObject *parent)
     : sm(sm_), flags_(flags), QObject(parent) {
+  if (flags_ & REPLAY_FLAG_HEADLESS) {
+    flags_ |= REPLAY_FLAG_FULL_SPEED | REPLAY_FLAG_NO_LOOP;
+  }
   std::vector<const char *> s;
   auto event_struct = capnp::Schema::from<cereal::Event>().asStruct();
   sockets_.resize(event_struct.getUnionFields().size());
@@ -39,8 +43,6 @@ Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *s
     pm = std::make_unique<PubMaster>(s);
   }
   route_ = std::make_unique<Route>(route, data_dir);
-  events_ = std::make_unique<std::vector<Event *>>();
-  new_events_ = std::make_unique<std::vector<Event *>>();
 }
 
 Replay::~Replay() {
@@ -208,8 +210,13 @@ void Replay::setCurrentSegment(int n) {
 void Replay::segmentLoadFinished(bool success) {
   if (!success) {
     Segment *seg = qobject_cast<Segment *>(sender());
-    rWarning("failed to load segment %d, removing it from current replay list", seg->seg_num);
-    segments_.erase(seg->seg_num);
+    const int seg_num = seg->seg_num;
+    rWarning("failed to load segment %d, removing it from current replay list", seg_num);
+    // wakes up the stream thread, it may be waiting at the end of the events for this segment
+    updateEvents([&]() {
+      segments_.erase(seg_num);
+      return true;
+    });
   }
   queueSegment();
 }
@@ -257,11 +264,9 @@ void Replay::queueSegment() {
 
 void Replay::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end) {
   std::vector<int> segments_need_merge;
-  size_t new_events_size = 0;
   for (auto it = begin; it != end; ++it) {
     if (it->second && it->second->isLoaded()) {
       segments_need_merge.push_back(it->first);
-      new_events_size += it->second->log->events.size();
     }
   }
 
@@ -272,20 +277,13 @@ void Replay::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::
       if (i != segments_need_merge.size() - 1) s += ", ";
     }
     rDebug("merge segments %s", s.c_str());
-    new_events_->clear();
-    new_events_->reserve(new_events_size);
-    for (int n : segments_need_merge) {
-      const auto &e = segments_[n]->log->events;
-      if (e.size() > 0) {
-        auto insert_from = e.begin();
-        if (new_events_->size() > 0 && (*insert_from)->which == cereal::Event::Which::INIT_DATA) ++insert_from;
-        auto middle = new_events_->insert(new_events_->end(), insert_from, e.end());
-        std::inplace_merge(new_events_->begin(), middle, new_events_->end(), Event::lessThan());
-      }
-    }
 
+    // the events are merged while streaming, only the list of segments is updated here.
     updateEvents([&]() {
-      events_.swap(new_events_);
+      events_.clear();
+      for (int n : segments_need_merge) {
+        events_.insert(n, segments_[n]->log->events);
+      }
       segments_merged_ = segments_need_merge;
       return true;
     });
@@ -366,7 +364,11 @@ void Replay::publishFrame(const Event *e) {
   auto eidx = capnp::AnyStruct::Reader(e->event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
   if (eidx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C && isSegmentMerged(eidx.getSegmentNum())) {
     CameraType cam = cam_types.at(e->which);
-    camera_server_->pushFrame(cam, segments_[eidx.getSegmentNum()]->frames[cam].get(), eidx);
+    if (hasFlag(REPLAY_FLAG_FULL_SPEED)) {
+      // the cameras are sent in parallel, with at most one pending frame per camera.
+      camera_server_->waitForSent(cam, 0);
+    }
+    camera_server_->pushFrame(cam, segments_[eidx.getSegmentNum()]->frames[cam], eidx);
   }
 }
 
@@ -375,22 +377,61 @@ void Replay::stream() {
   double prev_replay_speed = 1.0;
   std::unique_lock lk(stream_lock_);
 
+  // throughput of full speed replays
+  uint64_t stats_ts = nanos_since_boot();
+  uint64_t stats_events = 0;
+  uint64_t stats_frames = 0;
+  auto report_stats = [&]() {
+    const uint64_t ts = nanos_since_boot();
+    const uint64_t frames = camera_server_ ? camera_server_->framesSent() : 0;
+    const double secs = (ts - stats_ts) / 1e9;
+    std::string decode_fps;
+    for (auto cam : ALL_CAMERAS) {
+      if (camera_server_ && camera_server_->decodeFps(cam) > 0) {
+        decode_fps += util::string_format(", camera[%d] decoding at %.1f fps", cam, camera_server_->decodeFps(cam));
+      }
+    }
+    rInfo("%.0f events/s, %.1f frames/s%s", stats_events / secs, (frames - stats_frames) / secs, decode_fps.c_str());
+    stats_ts = ts;
+    stats_events = 0;
+    stats_frames = frames;
+  };
+  // restarts or finishes the stream if it reached the end of route, false otherwise
+  auto stream_ended = [&]() {
+    if (segments_.empty()) return false;
+
+    int last_segment = segments_.rbegin()->first;
+    if (current_segment_ < last_segment || !isSegmentMerged(last_segment)) return false;
+
+    if (!hasFlag(REPLAY_FLAG_NO_LOOP)) {
+      rInfo("reaches the end of route, restart from beginning");
+      QMetaObject::invokeMethod(this, std::bind(&Replay::seekTo, this, 0, false), Qt::QueuedConnection);
+    } else {
+      if (hasFlag(REPLAY_FLAG_FULL_SPEED)) {
+        report_stats();
+      }
+      rInfo("reaches the end of route");
+      emit streamFinished();
+    }
+    return true;
+  };
+
   while (true) {
     stream_cv_.wait(lk, [=]() { return exit_ || (events_updated_ && !paused_); });
     events_updated_ = false;
     if (exit_) break;
 
     Event cur_event(cur_which, cur_mono_time_);
-    auto eit = std::upper_bound(events_->begin(), events_->end(), &cur_event, Event::lessThan());
-    if (eit == events_->end()) {
-      rInfo("waiting for events...");
+    auto eit = events_.upperBound(&cur_event);
+    if (eit == events_.end()) {
+      if (!stream_ended()) rInfo("waiting for events...");
       continue;
     }
 
     uint64_t evt_start_ts = cur_mono_time_;
     uint64_t loop_start_ts = nanos_since_boot();
 
-    for (auto end = events_->end(); !updating_events_ && eit != end; ++eit) {
+    for (auto end = events_.end(); !updating_events_ && eit != end; ++eit) {
       const Event *evt = (*eit);
       cur_which = evt->which;
       cur_mono_time_ = evt->mono_time;
@@ -422,13 +463,21 @@ void Replay::stream() {
         }
 
         if (!evt->frame) {
-          publishMessage(evt);
-        } else if (camera_server_) {
-          if (hasFlag(REPLAY_FLAG_FULL_SPEED)) {
+          if (camera_server_ && hasFlag(REPLAY_FLAG_FULL_SPEED)) {
+            // frames are sent before any later message, consumers see the same order as the log.
             camera_server_->waitForSent();
           }
+          publishMessage(evt);
+        } else if (camera_server_) {
           publishFrame(evt);
         }
+
+        if (hasFlag(REPLAY_FLAG_FULL_SPEED)) {
+          ++stats_events;
+          if (nanos_since_boot() - stats_ts >= 5 * 1e9) {
+            report_stats();
+          }
+        }
       }
     }
     // wait for frame to be sent before unlock.(frameReader may be deleted after unlock)
@@ -436,12 +485,9 @@ void Replay::stream() {
       camera_server_->waitForSent();
     }
 
-    if (eit == events_->end() && !hasFlag(REPLAY_FLAG_NO_LOOP)) {
-      int last_segment = segments_.rbegin()->first;
-      if (current_segment_ >= last_segment && isSegmentMerged(last_segment)) {
-        rInfo("reaches the end of route, restart from beginning");
-        QMetaObject::invokeMethod(this, std::bind(&Replay::seekTo, this, 0, false), Qt::QueuedConnection);
-      }
+    if (eit == events_.end()) {
+      stream_ended();
     }
   }
 }
+
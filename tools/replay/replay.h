@@ -22,6 +22,8 @@ enum REPLAY_FLAGS {
   REPLAY_FLAG_NO_HW_DECODER = 0x0100,
   REPLAY_FLAG_FULL_SPEED = 0x0200,
   REPLAY_FLAG_NO_VIPC = 0x0400,
+  // replay the route once as fast as the frames can be sent, without UI. implies FULL_SPEED and NO_LOOP.
+  REPLAY_FLAG_HEADLESS = 0x0800,
 };
 
 enum class FindFlag {
@@ -70,7 +72,7 @@ public:
   inline int totalSeconds() const { return segments_.size() * 60; }
   inline void setSpeed(float speed) { speed_ = speed; }
   inline float getSpeed() const { return speed_; }
-  inline const std::vector<Event *> *events() const { return events_.get(); }
+  inline const SegmentedEvents *events() const { return &events_; }
   inline const std::map<int, std::unique_ptr<Segment>> &segments() const { return segments_; };
   inline const std::string &carFingerprint() const { return car_fingerprint_; }
   inline const std::vector<std::tuple<int, int, TimelineType>> getTimeline() {
@@ -80,6 +82,7 @@ public:
 
 signals:
   void streamStarted();
+  void streamFinished();
   void segmentsMerged();
   void seekedTo(double sec);
 
@@ -116,8 +119,7 @@ protected:
   bool events_updated_ = false;
   uint64_t route_start_ts_ = 0;
   std::atomic<uint64_t> cur_mono_time_ = 0;
-  std::unique_ptr<std::vector<Event *>> events_;
-  std::unique_ptr<std::vector<Event *>> new_events_;
+  SegmentedEvents events_;
   std::vector<int> segments_merged_;
 
   // messaging
@@ -129,10 +129,15 @@ void Segment::loadFile(int id, const std::string file) {
   const bool local_cache = !(flags & REPLAY_FLAG_NO_FILE_CACHE);
   bool success = false;
   if (id < MAX_CAMERAS) {
-    frames[id] = std::make_unique<FrameReader>();
+    // CameraServer decodes each camera on its decoder pool, with one task per camera, and keeps the decoder of
+    // one segment per camera open. the decoders of the loaded segments are released until they are played,
+    // so that the cores are shared by the cameras only.
+    const int cameras = 1 + !!(flags & REPLAY_FLAG_DCAM) + !!(flags & REPLAY_FLAG_ECAM);
+    frames[id] = std::make_shared<FrameReader>(std::max<int>(std::thread::hardware_concurrency() / cameras, 1));
     success = frames[id]->load(file, flags & REPLAY_FLAG_NO_HW_DECODER, &abort_, local_cache, 20 * 1024 * 1024, 3);
+    if (success) frames[id]->releaseDecoder();
   } else {
-    log = std::make_unique<LogReader>();
+    log = std::make_shared<LogReader>();
     success = log->load(file, &abort_, allow, local_cache, 0, 3);
   }
 
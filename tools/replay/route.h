@@ -55,8 +55,8 @@ public:
   inline bool isLoaded() const { return !loading_ && !abort_; }
 
   const int seg_num = 0;
-  std::unique_ptr<LogReader> log;
-  std::unique_ptr<FrameReader> frames[MAX_CAMERAS] = {};
+  std::shared_ptr<LogReader> log;
+  std::shared_ptr<FrameReader> frames[MAX_CAMERAS] = {};
 
 signals:
   void loadFinished(bool success);
@@ -0,0 +1,112 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+#include "common/timing.h"
+#include "tools/replay/replay.h"
+#include "tools/replay/routereader.h"
+#include "tools/replay/util.h"
+
+// reads a range of segments of a route in mono_time order, and prints the number of events of each service
+// along with the reading throughput. with the camera options, all frames of the selected cameras are decoded too.
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Read all events of a route as fast as possible and print their statistics.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("route", "the drive to read. find your drives at connect.comma.ai");
+  parser.addOption({{"a", "allow"}, "whitelist of services to read", "allow"});
+  parser.addOption({"begin", "first segment to read", "n"});
+  parser.addOption({"end", "last segment to read", "n"});
+  parser.addOption({{"j", "threads"}, "number of segments loaded in parallel", "n"});
+  parser.addOption({{"m", "memory"}, "memory budget of the loaded segments in MB. default is 2048", "mb"});
+  parser.addOption({"data_dir", "local directory with routes", "data_dir"});
+  parser.addOption({"demo", "use a demo route instead of providing your own"});
+  parser.addOption({"fcam", "decode road camera"});
+  parser.addOption({"dcam", "decode driver camera"});
+  parser.addOption({"ecam", "decode wide road camera"});
+  parser.addOption({"no-cache", "turn off local cache"});
+  parser.process(app);
+
+  const QStringList args = parser.positionalArguments();
+  if (args.empty() && !parser.isSet("demo")) {
+    parser.showHelp();
+  }
+  const QString route = args.empty() ? DEMO_ROUTE : args.first();
+
+  RouteReader::Options options;
+  options.begin_segment = parser.value("begin").toInt();
+  options.end_segment = parser.isSet("end") ? parser.value("end").toInt() : -1;
+  options.threads = parser.value("threads").toInt();
+  options.local_cache = !parser.isSet("no-cache");
+  if (parser.isSet("memory")) {
+    options.memory_budget_mb = parser.value("memory").toULong();
+  }
+
+  const std::map<cereal::Event::Which, CameraType> cam_types{
+      {cereal::Event::ROAD_ENCODE_IDX, RoadCam},
+      {cereal::Event::DRIVER_ENCODE_IDX, DriverCam},
+      {cereal::Event::WIDE_ROAD_ENCODE_IDX, WideRoadCam},
+  };
+  const std::pair<const char *, CameraType> cameras[] = {{"fcam", RoadCam}, {"dcam", DriverCam}, {"ecam", WideRoadCam}};
+  for (const auto &[name, type] : cameras) {
+    if (parser.isSet(name)) options.cameras.insert(type);
+  }
+
+  auto event_struct = capnp::Schema::from<cereal::Event>().asStruct();
+  const QString allow = parser.value("allow");
+  if (!allow.isEmpty()) {
+    for (const auto &name : allow.split(",")) {
+      auto field = event_struct.findFieldByName(name.toStdString());
+      if (!field) {
+        rError("unknown service %s", name.toStdString().c_str());
+        return 1;
+      }
+      options.allow.insert((cereal::Event::Which)field->getProto().getDiscriminantValue());
+    }
+    for (const auto &[which, cam] : cam_types) {
+      if (options.cameras.count(cam)) options.allow.insert(which);
+    }
+  }
+
+  RouteReader reader(route.toStdString(), parser.value("data_dir").toStdString(), options);
+  if (!reader.load()) {
+    return 1;
+  }
+
+  std::map<cereal::Event::Which, uint64_t> counts;
+  uint64_t total_events = 0, total_frames = 0;
+  const uint64_t start_ts = nanos_since_boot();
+  bool ret = reader.forEach([&](const Event *e, const SegmentData &seg) {
+    ++counts[e->which];
+    ++total_events;
+    if (auto cam = cam_types.find(e->which); cam != cam_types.end() && seg.frames[cam->second]) {
+      auto eidx = capnp::AnyStruct::Reader(e->event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+      if (eidx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C && eidx.getSegmentNum() == seg.seg_num) {
+        total_frames += reader.frame(seg, cam->second, eidx.getSegmentId()) != nullptr;
+      }
+    }
+    return true;
+  });
+  const double elapsed = (nanos_since_boot() - start_ts) / 1e9;
+
+  std::vector<std::pair<uint64_t, std::string>> services;
+  for (const auto &[which, count] : counts) {
+    services.push_back({count, event_struct.getUnionFields()[(uint16_t)which].getProto().getName().cStr()});
+  }
+  std::sort(services.rbegin(), services.rend());
+  for (const auto &[count, name] : services) {
+    printf("%-32s %10lu\n", name.c_str(), count);
+  }
+  printf("\n%lu segments, %lu events in %.2fs, %.0f events/s", reader.segments().size(), total_events, elapsed, total_events / elapsed);
+  if (!options.cameras.empty()) {
+    printf(", %lu frames, %.1f frames/s", total_frames, total_frames / elapsed);
+  }
+  printf("\n");
+  return ret ? 0 : 1;
+}
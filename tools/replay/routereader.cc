@@ -0,0 +1,305 @@
+#include "tools/replay/routereader.h"
+
+#include <algorithm>
+
+#include "tools/replay/route.h"
+#include "tools/replay/util.h"
+
+RouteReader::RouteReader(const std::string &route, const std::string &data_dir, const Options &options)
+    : route_(route), data_dir_(data_dir), options_(options) {}
+
+RouteReader::~RouteReader() {
+  abort_ = true;
+  cv_.notify_all();
+  for (auto &t : loaders_) {
+    t.join();
+  }
+}
+
+bool RouteReader::load() {
+  Route route(QString::fromStdString(route_), QString::fromStdString(data_dir_));
+  if (!route.load()) {
+    rError("failed to load route %s", route_.c_str());
+    return false;
+  }
+
+  for (const auto &[n, f] : route.segments()) {
+    if (n < options_.begin_segment || (options_.end_segment >= 0 && n > options_.end_segment)) continue;
+
+    const QString &log = f.rlog.isEmpty() ? f.qlog : f.rlog;
+    if (log.isEmpty()) {
+      rWarning("segment %d has no log, skipping", n);
+      continue;
+    }
+    auto &files = files_[n];
+    files[RoadCam] = (options_.qcamera || f.road_cam.isEmpty() ? f.qcamera : f.road_cam).toStdString();
+    files[DriverCam] = f.driver_cam.toStdString();
+    files[WideRoadCam] = f.wide_road_cam.toStdString();
+    files[MAX_CAMERAS] = log.toStdString();
+    seg_nums_.push_back(n);
+  }
+  if (seg_nums_.empty()) {
+    rError("no valid segments in route %s", route_.c_str());
+  }
+  return !seg_nums_.empty();
+}
+
+bool RouteReader::forEach(const Visitor &visitor) {
+  slots_.assign(seg_nums_.size(), {});
+  next_load_ = current_slot_ = 0;
+  memory_used_ = memory_loaded_ = segments_loaded_ = 0;
+  abort_ = false;
+  const int threads = options_.threads > 0 ? options_.threads : std::max<int>(std::thread::hardware_concurrency(), 1);
+  // the cameras of up to two segments are decoded at a time, each by one loader thread and its decoder threads
+  decoder_threads_ = std::max<int>(threads / std::max<int>(options_.cameras.size() * 2, 1), 1);
+  for (int i = 0; i < std::min<int>(threads, seg_nums_.size()); ++i) {
+    loaders_.emplace_back(&RouteReader::loaderThread, this);
+  }
+
+  struct Cursor {
+    size_t slot;
+    std::shared_ptr<SegmentData> seg;
+    std::vector<Event *>::const_iterator it, end;
+  };
+  std::vector<Cursor> window;
+  bool stopped = false, failed = false;
+  for (size_t i = 0; i < slots_.size() && !stopped; ++i) {
+    {
+      std::lock_guard lk(lock_);
+      current_slot_ = i;
+    }
+    cv_.notify_all();
+
+    if (auto seg = waitForSegment(i)) {
+      const auto &events = seg->log->events;
+      auto begin = events.cbegin();
+      // keep initData of the first segment only
+      if (i > 0 && begin != events.cend() && (*begin)->which == cereal::Event::Which::INIT_DATA) ++begin;
+      if (begin != events.cend()) {
+        window.push_back({i, seg, begin, events.cend()});
+      } else {
+        releaseSegment(i);
+      }
+    } else {
+      rWarning("failed to load segment %d, skipping", seg_nums_[i]);
+      failed = true;
+    }
+
+    // the last events of a segment may be logged after the first ones of the next segment,
+    // merge the window of segments up to the first event of the next segment.
+    const Event *boundary = nullptr;
+    if (i + 1 < slots_.size()) {
+      if (auto next = waitForSegment(i + 1)) {
+        const auto &events = next->log->events;
+        auto it = std::find_if(events.cbegin(), events.cend(), [](auto e) { return e->which != cereal::Event::Which::INIT_DATA; });
+        boundary = it != events.cend() ? *it : nullptr;
+      }
+    }
+
+    while (!window.empty()) {
+      // segments overlap only at their boundaries, the window holds one or two segments.
+      auto c = std::min_element(window.begin(), window.end(), [](const Cursor &l, const Cursor &r) {
+        return Event::lessThan()(*l.it, *r.it) || (!Event::lessThan()(*r.it, *l.it) && l.slot < r.slot);
+      });
+      const Event *e = *c->it;
+      if (boundary && !Event::lessThan()(e, boundary)) break;
+
+      if (!visitor(e, *c->seg)) {
+        stopped = true;
+        break;
+      }
+      if (++c->it == c->end) {
+        const size_t slot = c->slot;
+        window.erase(c);
+        releaseSegment(slot);
+      }
+    }
+  }
+
+  abort_ = true;
+  cv_.notify_all();
+  for (auto &t : loaders_) {
+    t.join();
+  }
+  loaders_.clear();
+  slots_.clear();
+  return !stopped && !failed;
+}
+
+void RouteReader::loaderThread() {
+  const size_t budget = options_.memory_budget_mb * 1024 * 1024;
+  while (true) {
+    size_t slot = 0, estimate = 0;
+    std::shared_ptr<SegmentData> decode_seg;
+    CameraType decode_cam = RoadCam;
+    int decode_idx = 0;
+    {
+      std::unique_lock lk(lock_);
+      cv_.wait(lk, [&]() {
+        // the frames of the visited segments are decoded before the next segments are loaded
+        if (abort_ || (decode_seg = nextDecode(decode_cam, decode_idx))) return true;
+        if (next_load_ >= slots_.size()) return false;
+        // the current and the next segment are always loaded, the others only within the budget.
+        estimate = segments_loaded_ > 0 ? memory_loaded_ / segments_loaded_ : 0;
+        return next_load_ <= current_slot_ + 1 || memory_used_ + estimate <= budget;
+      });
+      if (abort_) return;
+
+      if (!decode_seg) {
+        slot = next_load_++;
+        memory_used_ += estimate;
+      }
+    }
+
+    if (decode_seg) {
+      auto &fr = decode_seg->frames[decode_cam];
+      std::vector<uint8_t> yuv(fr->getYUVSize());
+      const bool success = fr->get(decode_idx, yuv.data());
+      {
+        std::lock_guard lk(lock_);
+        auto &d = decode_seg->decoded_[decode_cam];
+        d.decoding = false;
+        if (!success) {
+          d.failed = true;
+        } else if (!d.failed && decode_idx == d.next) {
+          // the frame is dropped if the visitor skipped it meanwhile
+          d.yuvs.push_back(std::move(yuv));
+          ++d.next;
+          memory_used_ += fr->getYUVSize();
+        }
+      }
+      cv_.notify_all();
+      continue;
+    }
+
+    auto seg = std::make_shared<SegmentData>();
+    const bool success = loadSegment(*seg, seg_nums_[slot]);
+    size_t memory = 0;
+    if (success) {
+      memory = seg->log->memoryUsage();
+      for (const auto &fr : seg->frames) {
+        if (fr) memory += fr->memoryUsage();
+      }
+    }
+
+    {
+      std::lock_guard lk(lock_);
+      memory_used_ = memory_used_ - estimate + memory;
+      memory_loaded_ += memory;
+      ++segments_loaded_;
+      auto &s = slots_[slot];
+      s.data = success ? seg : nullptr;
+      s.loaded = success;
+      s.failed = !success;
+      s.memory = memory;
+    }
+    cv_.notify_all();
+  }
+}
+
+std::shared_ptr<SegmentData> RouteReader::nextDecode(CameraType &cam, int &idx) {
+  if (options_.decode_ahead <= 0) return nullptr;
+
+  // the window of visited segments is the current one, the one before it until its last events are visited,
+  // and the next one, whose first frames are decoded while the current one is visited.
+  for (size_t s = current_slot_ > 0 ? current_slot_ - 1 : 0; s < std::min(current_slot_ + 2, slots_.size()); ++s) {
+    const auto &seg = slots_[s].data;
+    if (!seg) continue;
+
+    for (auto c : options_.cameras) {
+      auto &d = seg->decoded_[c];
+      if (seg->frames[c] && !d.decoding && !d.failed && d.next < (int)seg->frames[c]->getFrameCount() &&
+          (int)d.yuvs.size() < options_.decode_ahead) {
+        d.decoding = true;
+        cam = c;
+        idx = d.next;
+        return seg;
+      }
+    }
+  }
+  return nullptr;
+}
+
+const uint8_t *RouteReader::frame(const SegmentData &seg, CameraType cam, int idx) {
+  const auto &fr = seg.frames[cam];
+  if (!fr || idx < 0 || idx >= (int)fr->getFrameCount()) return nullptr;
+
+  auto &d = seg.decoded_[cam];
+  const size_t yuv_size = fr->getYUVSize();
+  std::unique_lock lk(lock_);
+  if (idx >= d.first && !d.failed && options_.decode_ahead > 0) {
+    // the frames before idx are not needed anymore, the ones not decoded yet are skipped
+    const int skipped = std::min(idx, d.next) - d.first;
+    d.yuvs.erase(d.yuvs.begin(), d.yuvs.begin() + skipped);
+    memory_used_ -= skipped * yuv_size;
+    d.first = idx;
+    d.next = std::max(d.next, idx);
+    cv_.notify_all();
+
+    cv_.wait(lk, [&]() { return d.next > idx || d.failed || abort_; });
+    if (d.next > idx) {
+      d.current = std::move(d.yuvs.front());
+      d.yuvs.pop_front();
+      ++d.first;
+      memory_used_ -= yuv_size;
+      cv_.notify_all();
+      return d.current.data();
+    }
+  }
+
+  // frames requested out of order, or after a decoding error, are decoded here
+  cv_.wait(lk, [&]() { return !d.decoding; });
+  d.decoding = true;
+  lk.unlock();
+  d.current.resize(yuv_size);
+  const bool success = fr->get(idx, d.current.data());
+  lk.lock();
+  d.decoding = false;
+  cv_.notify_all();
+  return success ? d.current.data() : nullptr;
+}
+
+bool RouteReader::loadSegment(SegmentData &seg, int n) {
+  const auto &files = files_.at(n);
+  seg.seg_num = n;
+  for (auto cam : options_.cameras) {
+    if (files[cam].empty()) continue;
+
+    seg.frames[cam] = std::make_shared<FrameReader>(decoder_threads_);
+    // every frame is visited, wait for the packet table of a remote video that is demuxed in the background
+    if (!seg.frames[cam]->load(files[cam], options_.no_hw_decoder, &abort_, options_.local_cache, 20 * 1024 * 1024, 3) ||
+        seg.frames[cam]->getFrameCount() == 0) {
+      return false;
+    }
+    // the decoder is opened again when the segment is visited, the segments waiting in the budget don't hold one
+    seg.frames[cam]->releaseDecoder();
+  }
+  seg.log = std::make_unique<LogReader>();
+  return seg.log->load(files[MAX_CAMERAS], &abort_, options_.allow, options_.local_cache, 0, 3);
+}
+
+std::shared_ptr<SegmentData> RouteReader::waitForSegment(size_t slot) {
+  std::unique_lock lk(lock_);
+  cv_.wait(lk, [&]() { return abort_ || slots_[slot].loaded || slots_[slot].failed; });
+  return slots_[slot].data;
+}
+
+void RouteReader::releaseSegment(size_t slot) {
+  {
+    std::lock_guard lk(lock_);
+    auto &s = slots_[slot];
+    memory_used_ -= s.memory;
+    s.memory = 0;
+    if (s.data) {
+      // a loader thread may still be decoding a frame of the segment, it's not kept
+      for (auto cam : options_.cameras) {
+        auto &d = s.data->decoded_[cam];
+        if (s.data->frames[cam]) memory_used_ -= d.yuvs.size() * s.data->frames[cam]->getYUVSize();
+        d.yuvs.clear();
+        d.failed = true;
+      }
+    }
+    s.data.reset();
+  }
+  cv_.notify_all();
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tools/replay/framereader.h"
+#include "tools/replay/logreader.h"
+
+// the logs and videos of one segment, kept in memory while its events are being visited.
+// the frames are read with RouteReader::frame(), the FrameReaders are shared with the loader threads.
+struct SegmentData {
+  int seg_num = 0;
+  std::unique_ptr<LogReader> log;
+  std::shared_ptr<FrameReader> frames[MAX_CAMERAS] = {};
+
+private:
+  friend class RouteReader;
+  // frames [first, next) of a camera, decoded in order on the loader threads. protected by RouteReader::lock_
+  struct DecodedFrames {
+    std::deque<std::vector<uint8_t>> yuvs;
+    int first = 0, next = 0;
+    bool decoding = false;  // a thread is using the FrameReader
+    bool failed = false;  // no more frames are decoded ahead
+    std::vector<uint8_t> current;  // the frame returned last
+  };
+  mutable DecodedFrames decoded_[MAX_CAMERAS];
+};
+
+// reads the events of a route in mono_time order for offline processing, without the event loop,
+// sockets and VisionIpc of Replay. the next segments are loaded on a pool of threads while the
+// current one is visited, until the memory used by the loaded segments reaches the budget. the
+// frames of the visited segments are decoded ahead of the visitor on the same threads.
+// note: Route::load needs a QCoreApplication instance for routes that are not in data_dir.
+class RouteReader {
+public:
+  struct Options {
+    int begin_segment = 0;
+    int end_segment = -1;  // inclusive, -1 for the last segment of the route
+    std::set<cereal::Event::Which> allow;  // services to read, empty for all
+    std::set<CameraType> cameras;  // videos to load with each segment
+    bool qcamera = false;
+    bool no_hw_decoder = true;
+    bool local_cache = true;
+    size_t memory_budget_mb = 2048;  // of the logs, videos and decoded frames
+    int threads = 0;  // 0 for std::thread::hardware_concurrency()
+    int decode_ahead = 20;  // frames of each camera decoded ahead of the visitor, 0 to decode them in frame()
+  };
+  // visitor returns false to stop reading
+  typedef std::function<bool(const Event *e, const SegmentData &segment)> Visitor;
+
+  RouteReader(const std::string &route, const std::string &data_dir = {}) : RouteReader(route, data_dir, Options{}) {}
+  RouteReader(const std::string &route, const std::string &data_dir, const Options &options);
+  ~RouteReader();
+  bool load();
+  const std::vector<int> &segments() const { return seg_nums_; }
+  // returns false if a segment failed to load or reading was stopped
+  bool forEach(const Visitor &visitor);
+  // returns frame idx of the camera in the YUV format of FrameReader::get(), or nullptr if it can't be decoded.
+  // called from the visitor, the frame is valid until the next call for the camera of the segment.
+  const uint8_t *frame(const SegmentData &seg, CameraType cam, int idx);
+
+private:
+  struct Slot {
+    std::shared_ptr<SegmentData> data;
+    bool loaded = false;
+    bool failed = false;
+    size_t memory = 0;
+  };
+  void loaderThread();
+  bool loadSegment(SegmentData &seg, int n);
+  // picks the next frame to decode ahead of the visitor, called with lock_ held
+  std::shared_ptr<SegmentData> nextDecode(CameraType &cam, int &idx);
+  std::shared_ptr<SegmentData> waitForSegment(size_t slot);
+  void releaseSegment(size_t slot);
+
+  std::string route_;
+  std::string data_dir_;
+  Options options_;
+  std::map<int, std::array<std::string, MAX_CAMERAS + 1>> files_;  // [RoadCam, DriverCam, WideRoadCam, log]
+  std::vector<int> seg_nums_;
+
+  std::mutex lock_;
+  std::condition_variable cv_;
+  std::vector<Slot> slots_;
+  size_t next_load_ = 0;
+  size_t current_slot_ = 0;
+  size_t memory_used_ = 0;
+  size_t memory_loaded_ = 0;
+  size_t segments_loaded_ = 0;
+  int decoder_threads_ = 0;
+  std::atomic<bool> abort_ = false;
+  std::vector<std::thread> loaders_;
+};
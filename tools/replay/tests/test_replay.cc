@@ -1,5 +1,15 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
 #include <chrono>
+#include <cstring>
+#include <mutex>
+#include <random>
 #include <thread>
+#include <utility>
 
 #include <QDebug>
 #include <QEventLoop>
@@ -7,6 +17,7 @@
 #include "catch2/catch.hpp"
 #include "common/util.h"
 #include "tools/replay/replay.h"
+#include "tools/replay/routereader.h"
 #include "tools/replay/util.h"
 
 const std::string TEST_RLOG_URL = "https://commadataci.blob.core.windows.net/openpilotci/0c94aa1e1296d7c6/2021-05-05--19-48-37/0/rlog.bz2";
@@ -50,6 +61,24 @@ int random_int(int min, int max) {
   return dist(rng);
 }
 
+TEST_CASE("decompressBZ2") {
+  std::string compressed = FileReader(true).read(TEST_RLOG_URL);
+  std::string expected = decompressBZ2(compressed);
+  REQUIRE(!expected.empty());
+
+  auto threads = GENERATE(1, 4);
+  std::string content;
+  int chunks = 0;
+  REQUIRE(decompressBZ2((std::byte *)compressed.data(), compressed.size(), [&](std::string &&chunk) {
+    content += chunk;
+    ++chunks;
+  }, nullptr, threads));
+  REQUIRE(content == expected);
+  if (threads > 1) {
+    REQUIRE(chunks > 1);
+  }
+}
+
 TEST_CASE("FileReader") {
   auto enable_local_cache = GENERATE(true, false);
   std::string cache_file = cacheFilePath(TEST_RLOG_URL);
@@ -65,6 +94,122 @@ TEST_CASE("FileReader") {
   }
 }
 
+// serves one file over http on localhost, with or without support for range requests.
+// the ranges of the GET requests are recorded.
+class TestHttpServer {
+public:
+  TestHttpServer(const std::string &content) : content_(content) {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    REQUIRE(bind(fd_, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    REQUIRE(listen(fd_, 16) == 0);
+    getsockname(fd_, (struct sockaddr *)&addr, &len);
+    url = "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + "/fixture";
+    thread_ = std::thread(&TestHttpServer::serve, this);
+  }
+  ~TestHttpServer() {
+    // wakes up accept()
+    shutdown(fd_, SHUT_RDWR);
+    thread_.join();
+    close(fd_);
+  }
+  void setRangeSupport(bool support) { range_support_ = support; }
+  std::vector<std::pair<size_t, size_t>> takeRequests() {
+    std::lock_guard lk(lock_);
+    return std::exchange(requests_, {});
+  }
+
+  std::string url;
+
+private:
+  void serve() {
+    for (int conn; (conn = accept(fd_, nullptr, nullptr)) >= 0; close(conn)) {
+      std::string request;
+      char buf[4096];
+      while (request.find("\r\n\r\n") == std::string::npos) {
+        ssize_t n = recv(conn, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        request.append(buf, n);
+      }
+
+      size_t begin = 0, end = content_.size() - 1;
+      const size_t range_pos = request.find("Range: bytes=");
+      const bool partial = range_pos != std::string::npos && range_support_ &&
+                           sscanf(request.c_str() + range_pos, "Range: bytes=%zu-%zu", &begin, &end) == 2;
+      std::string reply = partial ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+      if (partial) {
+        reply += util::string_format("Content-Range: bytes %zu-%zu/%zu\r\n", begin, end, content_.size());
+      }
+      reply += util::string_format("Content-Length: %zu\r\nConnection: close\r\n\r\n", end - begin + 1);
+      if (request.find("GET") == 0) {
+        {
+          std::lock_guard lk(lock_);
+          requests_.push_back({begin, end});
+        }
+        reply += content_.substr(begin, end - begin + 1);
+      }
+      // the client closes the connection of a 200 reply once it has the range it asked for
+      for (size_t sent = 0; sent < reply.size();) {
+        ssize_t n = send(conn, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
+      }
+    }
+  }
+
+  const std::string content_;
+  int fd_;
+  std::atomic<bool> range_support_ = true;
+  std::mutex lock_;
+  std::vector<std::pair<size_t, size_t>> requests_;
+  std::thread thread_;
+};
+
+TEST_CASE("FileReader range read") {
+  auto enable_local_cache = GENERATE(true, false);
+  std::mt19937 rng(0);
+  std::string content(3 * RANGE_BLOCK_SIZE + 1000, '\0');
+  for (auto &c : content) c = rng();
+
+  TestHttpServer server(content);
+  const std::string &url = server.url;
+  system(("rm -f " + cacheFilePath(url) + "*").c_str());
+
+  FileReader reader(enable_local_cache, 0, 0);
+  REQUIRE(reader.getFileSize(url) == content.size());
+  SECTION("partial reads") {
+    for (int i = 0; i < 20; ++i) {
+      size_t offset = random_int(0, content.size() - 1);
+      size_t size = random_int(1, 2 * RANGE_BLOCK_SIZE);
+      REQUIRE(reader.read(url, offset, size) == content.substr(offset, size));
+    }
+  }
+  SECTION("reads across cached blocks") {
+    REQUIRE(reader.read(url, RANGE_BLOCK_SIZE + 10, 100) == content.substr(RANGE_BLOCK_SIZE + 10, 100));
+    REQUIRE(server.takeRequests() == std::vector<std::pair<size_t, size_t>>{{RANGE_BLOCK_SIZE, 2 * RANGE_BLOCK_SIZE - 1}});
+    REQUIRE(reader.read(url, 10, 2 * RANGE_BLOCK_SIZE) == content.substr(10, 2 * RANGE_BLOCK_SIZE));
+    // the cached block in the middle splits the request in two
+    const std::vector<std::pair<size_t, size_t>> expected = enable_local_cache
+        ? std::vector<std::pair<size_t, size_t>>{{0, RANGE_BLOCK_SIZE - 1}, {2 * RANGE_BLOCK_SIZE, 3 * RANGE_BLOCK_SIZE - 1}}
+        : std::vector<std::pair<size_t, size_t>>{{0, 3 * RANGE_BLOCK_SIZE - 1}};
+    REQUIRE(server.takeRequests() == expected);
+  }
+  SECTION("200 reply to a range request") {
+    server.setRangeSupport(false);
+    for (size_t offset : {(size_t)0, RANGE_BLOCK_SIZE - 10, 2 * RANGE_BLOCK_SIZE + 5, content.size() - 1}) {
+      REQUIRE(reader.read(url, offset, 100) == content.substr(offset, 100));
+    }
+  }
+
+  // reading to the end of the file merges all cached blocks into the cache file
+  REQUIRE(reader.read(url, 0, content.size()) == content);
+  REQUIRE(util::file_exists(cacheFilePath(url)) == enable_local_cache);
+  system(("rm -f " + cacheFilePath(url) + "*").c_str());
+}
+
 TEST_CASE("LogReader") {
   SECTION("corrupt log") {
     FileReader reader(true);
@@ -75,6 +220,188 @@ TEST_CASE("LogReader") {
     REQUIRE(log.load((std::byte *)corrupt_content.data(), corrupt_content.size()));
     REQUIRE(log.events.size() > 0);
   }
+  SECTION("streaming bz2") {
+    std::string content = FileReader(true).read(TEST_RLOG_URL);
+    std::string decompressed = decompressBZ2(content);
+    unlink((cacheFilePath(TEST_RLOG_URL) + ".idx").c_str());
+    LogReader log_from_buffer, log_from_url;
+    REQUIRE(log_from_buffer.load((std::byte *)decompressed.data(), decompressed.size()));
+    REQUIRE(log_from_url.load(TEST_RLOG_URL, nullptr, {}, true));
+    REQUIRE(log_from_url.events.size() == log_from_buffer.events.size());
+  }
+  SECTION("sidecar index") {
+    const std::string index_file = cacheFilePath(TEST_RLOG_URL) + ".idx";
+    unlink(index_file.c_str());
+    const std::set<cereal::Event::Which> allow = {cereal::Event::Which::CAN, cereal::Event::Which::CAR_STATE};
+
+    LogReader full_scan, full_scan_filtered;
+    REQUIRE(full_scan.load(TEST_RLOG_URL, nullptr, {}, true));
+    REQUIRE(util::file_exists(index_file));
+    REQUIRE(full_scan_filtered.load(TEST_RLOG_URL, nullptr, allow, true));
+
+    LogReader indexed, indexed_filtered;
+    REQUIRE(indexed.load(TEST_RLOG_URL, nullptr, {}, true));
+    REQUIRE(indexed_filtered.load(TEST_RLOG_URL, nullptr, allow, true));
+    REQUIRE(indexed.events.size() == full_scan.events.size());
+    REQUIRE(indexed_filtered.events.size() == full_scan_filtered.events.size());
+    REQUIRE(std::is_sorted(indexed.events.begin(), indexed.events.end(), Event::lessThan()));
+    for (int i = 0; i < indexed_filtered.events.size(); ++i) {
+      REQUIRE(indexed_filtered.events[i]->mono_time == full_scan_filtered.events[i]->mono_time);
+      REQUIRE(indexed_filtered.events[i]->which == full_scan_filtered.events[i]->which);
+    }
+
+    // the index of a log file modified since is rebuilt
+    const std::string log_file = cacheFilePath(TEST_RLOG_URL);
+    LogIndex index;
+    REQUIRE(index.load(index_file));
+    REQUIRE(index.isIndexOf(log_file));
+    const struct timespec times[2] = {{.tv_sec = 0, .tv_nsec = UTIME_OMIT}, {.tv_sec = 1, .tv_nsec = 0}};
+    REQUIRE(utimensat(AT_FDCWD, log_file.c_str(), times, 0) == 0);
+    REQUIRE(!index.isIndexOf(log_file));
+    LogReader reindexed;
+    REQUIRE(reindexed.load(TEST_RLOG_URL, nullptr, {}, true));
+    REQUIRE(reindexed.events.size() == full_scan.events.size());
+    REQUIRE(index.load(index_file));
+    REQUIRE(index.isIndexOf(log_file));
+  }
+  SECTION("mmap local file") {
+    std::string content = decompressBZ2(FileReader(true).read(TEST_RLOG_URL));
+    char filename[] = "/tmp/XXXXXX";
+    int fd = mkstemp(filename);
+    REQUIRE(write(fd, content.data(), content.size()) == content.size());
+    close(fd);
+
+    LogReader log_from_buffer, log_from_file;
+    REQUIRE(log_from_buffer.load((std::byte *)content.data(), content.size()));
+    REQUIRE(log_from_file.load(filename));
+    REQUIRE(log_from_file.events.size() == log_from_buffer.events.size());
+    for (int i = 0; i < log_from_file.events.size(); ++i) {
+      REQUIRE(log_from_file.events[i]->bytes() == log_from_buffer.events[i]->bytes());
+    }
+    unlink(filename);
+  }
+}
+
+TEST_CASE("SegmentedEvents") {
+  std::deque<Event> storage;
+  std::vector<Event *> segs[3];
+  for (int n = 0; n < 3; ++n) {
+    segs[n].push_back(&storage.emplace_back(cereal::Event::Which::INIT_DATA, n * 100));
+    // the last events of a segment overlap with the next one
+    for (int t = n * 100 + 1; t < n * 100 + 110; t += 3) {
+      segs[n].push_back(&storage.emplace_back(cereal::Event::Which::CAN, t));
+    }
+  }
+
+  SegmentedEvents events;
+  events.insert(2, segs[2]);
+  events.insert(0, segs[0]);
+  events.insert(1, segs[1]);
+  REQUIRE(std::is_sorted(events.begin(), events.end(), Event::lessThan()));
+  // only the initData of the first segment is kept
+  REQUIRE(events.size() == segs[0].size() + segs[1].size() + segs[2].size() - 2);
+  REQUIRE(std::count_if(events.begin(), events.end(), [](auto e) { return e->which == cereal::Event::Which::INIT_DATA; }) == 1);
+  REQUIRE(events.back() == segs[2].back());
+
+  Event cur_event(cereal::Event::Which::CAN, 150);
+  auto it = events.upperBound(&cur_event);
+  REQUIRE((*it)->mono_time > 150);
+  REQUIRE(std::all_of(events.begin(), it, [](auto e) { return e->mono_time <= 150; }));
+
+  events.erase(0);
+  REQUIRE((*events.begin())->which == cereal::Event::Which::INIT_DATA);
+  REQUIRE((*events.begin())->mono_time == 100);
+  events.clear();
+  REQUIRE(events.empty());
+  REQUIRE(events.begin() == events.end());
+}
+
+TEST_CASE("FrameReader") {
+  Route route(DEMO_ROUTE);
+  REQUIRE(route.load());
+  char filename[] = "/tmp/XXXXXX";
+  close(mkstemp(filename));
+  REQUIRE(donload_to_file(route.at(0).road_cam.toStdString(), filename));
+  unlink((cacheFilePath(filename) + ".idx").c_str());
+
+  // the first load demuxes the video and saves the packet index, the second one only reads the index.
+  FrameReader fr_demuxed, fr_indexed;
+  REQUIRE(fr_demuxed.load(filename));
+  REQUIRE(util::file_exists(cacheFilePath(filename) + ".idx"));
+  REQUIRE(fr_indexed.load(filename));
+  REQUIRE(fr_indexed.getFrameCount() == fr_demuxed.getFrameCount());
+
+  std::vector<uint8_t> yuv1(fr_demuxed.getYUVSize()), yuv2(fr_indexed.getYUVSize());
+  for (int i : {0, 1, 2, 100, 50, 1199}) {
+    REQUIRE(fr_demuxed.get(i, yuv1.data()));
+    REQUIRE(fr_indexed.get(i, yuv2.data()));
+    REQUIRE(yuv1 == yuv2);
+  }
+
+  // the index of a video modified since is rebuilt
+  const std::string index = util::read_file(cacheFilePath(filename) + ".idx");
+  const struct timespec times[2] = {{.tv_sec = 0, .tv_nsec = UTIME_OMIT}, {.tv_sec = 1, .tv_nsec = 0}};
+  REQUIRE(utimensat(AT_FDCWD, filename, times, 0) == 0);
+  FrameReader fr_reindexed;
+  REQUIRE(fr_reindexed.load(filename));
+  REQUIRE(fr_reindexed.getFrameCount() == fr_demuxed.getFrameCount());
+  const std::string reindex = util::read_file(cacheFilePath(filename) + ".idx");
+  REQUIRE(!reindex.empty());
+  REQUIRE(reindex != index);
+
+  // a remote video is demuxed through range reads and its GOPs are fetched as they are decoded, once it
+  // has an index no more than the decoded GOPs are fetched.
+  const std::string video = util::read_file(filename);
+  TestHttpServer server(video);
+  system(("rm -f " + cacheFilePath(server.url) + "*").c_str());
+  for (bool indexed : {false, true}) {
+    FrameReader fr_remote;
+    REQUIRE(fr_remote.load(server.url, false, nullptr, true));
+    // waits for the demux, which saves the index
+    REQUIRE(fr_remote.getFrameCount() == fr_demuxed.getFrameCount());
+    REQUIRE(util::file_exists(cacheFilePath(server.url) + ".idx"));
+    for (int i : {0, 1, 2, 100, 50, 1199}) {
+      REQUIRE(fr_demuxed.get(i, yuv1.data()));
+      REQUIRE(fr_remote.get(i, yuv2.data()));
+      REQUIRE(yuv1 == yuv2);
+    }
+    size_t fetched = 0;
+    for (const auto &[begin, end] : server.takeRequests()) {
+      REQUIRE(end - begin + 1 < video.size());
+      fetched += end - begin + 1;
+    }
+    REQUIRE((fetched < video.size()) == indexed);
+    // keep the index only, the demux merged all the blocks into the cache file
+    system(("rm -f " + cacheFilePath(server.url) + " " + cacheFilePath(server.url) + ".*.blk").c_str());
+  }
+  system(("rm -f " + cacheFilePath(server.url) + "*").c_str());
+  unlink((cacheFilePath(filename) + ".idx").c_str());
+  unlink(filename);
+}
+
+TEST_CASE("FrameCache") {
+  FrameCache cache;
+  cache.setCapacity(3);
+  for (int i = 0; i < 3; ++i) {
+    REQUIRE(cache.insert(0, i, std::vector<uint8_t>(4, i)).empty());
+  }
+  uint8_t yuv[4] = {};
+  REQUIRE(cache.get(0, 0, yuv, sizeof(yuv)));
+  REQUIRE(yuv[3] == 0);
+  REQUIRE_FALSE(cache.get(1, 0, yuv, sizeof(yuv)));
+
+  // frame 1 is the least recently used one, its buffer is returned for reuse.
+  std::vector<uint8_t> evicted = cache.insert(1, 0, std::vector<uint8_t>(4, 10));
+  REQUIRE(evicted == std::vector<uint8_t>(4, 1));
+  REQUIRE_FALSE(cache.contains(0, 1));
+  REQUIRE(cache.contains(0, 0));
+  REQUIRE(cache.contains(0, 2));
+  REQUIRE(cache.get(1, 0, yuv, sizeof(yuv)));
+  REQUIRE(yuv[0] == 10);
+
+  cache.setCapacity(1);
+  REQUIRE(cache.size() == 1);
+  REQUIRE(cache.contains(1, 0));
 }
 
 void read_segment(int n, const SegmentFile &segment_file, uint32_t flags) {
@@ -151,6 +478,69 @@ TEST_CASE("Route") {
   };
 }
 
+TEST_CASE("RouteReader") {
+  Route route(DEMO_ROUTE);
+  REQUIRE(route.load());
+  size_t total_events = 0;
+  for (int i = 0; i < 2; ++i) {
+    LogReader log;
+    REQUIRE(log.load(route.at(i).rlog.toStdString(), nullptr, {}, true));
+    // the leading initData of the following segments is skipped
+    total_events += log.events.size() - (i > 0);
+  }
+
+  RouteReader::Options options;
+  options.end_segment = 1;
+  options.memory_budget_mb = GENERATE(0, 2048);
+  RouteReader reader(DEMO_ROUTE.toStdString(), {}, options);
+  REQUIRE(reader.load());
+  REQUIRE(reader.segments() == std::vector<int>{0, 1});
+
+  size_t count = 0;
+  std::pair<uint64_t, cereal::Event::Which> prev = {};
+  REQUIRE(reader.forEach([&](const Event *e, const SegmentData &seg) {
+    REQUIRE(prev <= std::pair{e->mono_time, e->which});
+    prev = {e->mono_time, e->which};
+    ++count;
+    return true;
+  }));
+  REQUIRE(count == total_events);
+}
+
+TEST_CASE("RouteReader frames") {
+  Route route(DEMO_ROUTE);
+  REQUIRE(route.load());
+  FrameReader fr;
+  REQUIRE(fr.load(route.at(0).road_cam.toStdString(), true, nullptr, true));
+
+  RouteReader::Options options;
+  options.end_segment = 0;
+  options.allow = {cereal::Event::Which::ROAD_ENCODE_IDX};
+  options.cameras = {RoadCam};
+  options.decode_ahead = GENERATE(0, 20);
+  RouteReader reader(DEMO_ROUTE.toStdString(), {}, options);
+  REQUIRE(reader.load());
+
+  // the frames decoded ahead on the loader threads, skipped ones and out of order ones match the frames decoded in order
+  std::vector<uint8_t> expected(fr.getYUVSize());
+  std::vector<int> frame_ids;
+  REQUIRE(reader.forEach([&](const Event *e, const SegmentData &seg) {
+    auto eidx = capnp::AnyStruct::Reader(e->event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+    const int idx = eidx.getSegmentId();
+    if (idx >= 60 || idx % 7 == 3) return true;
+
+    for (int id : idx % 10 == 9 ? std::vector<int>{idx - 5, idx} : std::vector<int>{idx}) {
+      const uint8_t *yuv = reader.frame(seg, RoadCam, id);
+      REQUIRE(yuv != nullptr);
+      REQUIRE(fr.get(id, expected.data()));
+      REQUIRE(memcmp(yuv, expected.data(), expected.size()) == 0);
+      frame_ids.push_back(id);
+    }
+    return true;
+  }));
+  REQUIRE(frame_ids.size() > 50);
+}
+
 // helper class for unit tests
 class TestReplay : public Replay {
  public:
@@ -172,13 +562,13 @@ void TestReplay::testSeekTo(int seek_to) {
     }
 
     Event cur_event(cereal::Event::Which::INIT_DATA, cur_mono_time_);
-    auto eit = std::upper_bound(events_->begin(), events_->end(), &cur_event, Event::lessThan());
-    if (eit == events_->end()) {
+    auto eit = events_.upperBound(&cur_event);
+    if (eit == events_.end()) {
       qDebug() << "waiting for events...";
       continue;
     }
 
-    REQUIRE(std::is_sorted(events_->begin(), events_->end(), Event::lessThan()));
+    REQUIRE(std::is_sorted(events_.begin(), events_.end(), Event::lessThan()));
     const int seek_to_segment = seek_to / 60;
     const int event_seconds = ((*eit)->mono_time - route_start_ts_) / 1e9;
     current_segment_ = event_seconds / 60;
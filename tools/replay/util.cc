@@ -7,10 +7,12 @@
 #include <cstring>
 #include <cassert>
 #include <cmath>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
 #include <mutex>
 #include <numeric>
+#include <optional>
 
 #include "common/timing.h"
 #include "common/util.h"
@@ -64,11 +66,35 @@ struct MultiPartWriter {
   size_t *total_written;
   size_t offset;
   size_t end;
+  CURL *handle;
+  size_t range_start;  // offset of buf in the file
+  long status = 0;
+  size_t received = 0;  // bytes of a 200 reply
 
   size_t write(char *data, size_t size, size_t count) {
-    size_t bytes = size * count;
-    if ((offset + bytes) > end) return 0;
+    const size_t bytes = size * count;
+    if (status == 0) {
+      curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+    }
+    if (status != 200) {
+      if ((offset + bytes) > end) return 0;
+      put(data, bytes);
+      return bytes;
+    }
+
+    // the server ignored the range and replies with the whole file. the bytes of the part are taken from it,
+    // and the transfer is stopped once they are all written.
+    const size_t pos = received;
+    received += bytes;
+    const size_t begin = std::max(pos, range_start + offset);
+    const size_t stop = std::min(received, range_start + end);
+    if (begin < stop) {
+      put(data + (begin - pos), stop - begin);
+    }
+    return offset == end ? 0 : bytes;
+  }
 
+  void put(const char *data, size_t bytes) {
     if constexpr (std::is_same<T, std::string>::value) {
       memcpy(buf->data() + offset, data, bytes);
     } else if constexpr (std::is_same<T, std::ofstream>::value) {
@@ -78,7 +104,6 @@ struct MultiPartWriter {
 
     offset += bytes;
     *total_written += bytes;
-    return bytes;
   }
 };
 
@@ -162,8 +187,10 @@ std::string getUrlWithoutQuery(const std::string &url) {
   return (idx == std::string::npos ? url : url.substr(0, idx));
 }
 
+// download content_length bytes of url starting at range_start into buf
 template <class T>
-bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t content_length, std::atomic<bool> *abort) {
+bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t content_length, std::atomic<bool> *abort,
+                  size_t range_start = 0) {
   static DownloadStats download_stats;
   download_stats.add(url, content_length);
 
@@ -184,11 +211,14 @@ bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t cont
         .total_written = &written,
         .offset = (size_t)(i * part_size),
         .end = i == parts - 1 ? content_length : (i + 1) * part_size,
+        .handle = eh,
+        .range_start = range_start,
     };
     curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, write_cb<T>);
     curl_easy_setopt(eh, CURLOPT_WRITEDATA, (void *)(&writers[eh]));
     curl_easy_setopt(eh, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(eh, CURLOPT_RANGE, util::string_format("%d-%d", writers[eh].offset, writers[eh].end - 1).c_str());
+    curl_easy_setopt(eh, CURLOPT_RANGE, util::string_format("%zu-%zu", range_start + writers[eh].offset,
+                                                            range_start + writers[eh].end - 1).c_str());
     curl_easy_setopt(eh, CURLOPT_HTTPGET, 1);
     curl_easy_setopt(eh, CURLOPT_NOSIGNAL, 1);
     curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1);
@@ -208,16 +238,17 @@ bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t cont
   int complete = 0;
   while ((msg = curl_multi_info_read(cm, &msgs_left)) && !(abort && *abort)) {
     if (msg->msg == CURLMSG_DONE) {
-      if (msg->data.result == CURLE_OK) {
-        long res_status = 0;
-        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &res_status);
-        if (res_status == 206) {
-          complete++;
-        } else {
-          rWarning("Download failed: http error code: %d", res_status);
-        }
-      } else {
+      const auto &w = writers[msg->easy_handle];
+      long res_status = 0;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &res_status);
+      // a 200 reply is cut short by the writer once it has the bytes of the part
+      if ((res_status == 206 || res_status == 200) && w.offset == w.end &&
+          (msg->data.result == CURLE_OK || (res_status == 200 && msg->data.result == CURLE_WRITE_ERROR))) {
+        complete++;
+      } else if (msg->data.result != CURLE_OK) {
         rWarning("Download failed: connection failure: %d",  msg->data.result);
+      } else {
+        rWarning("Download failed: http error code: %d", res_status);
       }
     }
   }
@@ -243,6 +274,13 @@ std::string httpGet(const std::string &url, size_t chunk_size, std::atomic<bool>
   return httpDownload(url, result, chunk_size, size, abort) ? result : "";
 }
 
+std::string httpGetRange(const std::string &url, size_t offset, size_t size, std::atomic<bool> *abort) {
+  if (size == 0) return {};
+
+  std::string result(size, '\0');
+  return httpDownload(url, result, 0, size, abort, offset) ? result : "";
+}
+
 bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size, std::atomic<bool> *abort) {
   size_t size = getRemoteFileSize(url, abort);
   if (size == 0) return false;
@@ -292,6 +330,242 @@ std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool>
   return {};
 }
 
+namespace {
+
+// bzip2 stream layout: "BZh" + level, followed by blocks starting with BZ2_BLOCK_MAGIC + 32-bit block crc,
+// terminated by BZ2_EOS_MAGIC + 32-bit combined crc and padded to a byte boundary.
+// blocks are not byte aligned, but each one can be decompressed on its own.
+constexpr uint64_t BZ2_BLOCK_MAGIC = 0x314159265359;
+constexpr uint64_t BZ2_EOS_MAGIC = 0x177245385090;
+constexpr uint64_t BZ2_MAGIC_MASK = 0xffffffffffff;
+
+struct BitReader {
+  const uint8_t *data;
+  uint64_t bits(uint64_t pos, int n) const {
+    uint64_t v = 0;
+    for (int i = 0; i < n; ++i, ++pos) {
+      v = (v << 1) | ((data[pos / 8] >> (7 - pos % 8)) & 1);
+    }
+    return v;
+  }
+  uint8_t byte(uint64_t pos) const {
+    const uint64_t i = pos / 8;
+    const int shift = pos % 8;
+    return shift == 0 ? data[i] : (uint8_t)((data[i] << shift) | (data[i + 1] >> (8 - shift)));
+  }
+};
+
+struct BitWriter {
+  std::string out;
+  uint64_t acc = 0;
+  int n = 0;
+  void put(uint64_t v, int bits) {
+    while (bits > 0) {
+      const int take = std::min(bits, 8 - n);
+      bits -= take;
+      acc = (acc << take) | ((v >> bits) & ((1u << take) - 1));
+      n += take;
+      if (n == 8) {
+        out.push_back((char)acc);
+        acc = n = 0;
+      }
+    }
+  }
+  std::string &flush() {
+    if (n > 0) put(0, 8 - n);
+    return out;
+  }
+};
+
+// wrap the block in [begin_bit, end_bit) into a standalone bzip2 stream
+std::string makeBZ2Stream(const uint8_t *in, uint64_t begin_bit, uint64_t end_bit, char level) {
+  const BitReader reader{in};
+  BitWriter w;
+  w.out.reserve((end_bit - begin_bit) / 8 + 16);
+  w.put('B', 8);
+  w.put('Z', 8);
+  w.put('h', 8);
+  w.put(level, 8);
+
+  uint64_t pos = begin_bit;
+  for (; pos + 8 <= end_bit; pos += 8) {
+    w.put(reader.byte(pos), 8);
+  }
+  w.put(reader.bits(pos, end_bit - pos), end_bit - pos);
+
+  // the combined crc of a stream with a single block is the block crc
+  const uint64_t block_crc = reader.bits(begin_bit + 48, 32);
+  w.put(BZ2_EOS_MAGIC, 48);
+  w.put(block_crc, 32);
+  return std::move(w.flush());
+}
+
+}  // namespace
+
+// class BZ2StreamDecoder
+
+BZ2StreamDecoder::BZ2StreamDecoder(const DecompressChunkHandler &handler, std::atomic<bool> *abort, int threads)
+    : handler_(handler), abort_(abort) {
+  threads_ = threads > 0 ? threads : std::max<int>(1, std::thread::hardware_concurrency());
+}
+
+BZ2StreamDecoder::~BZ2StreamDecoder() {
+  {
+    std::lock_guard lk(lock_);
+    exit_ = true;
+  }
+  cv_.notify_all();
+  for (auto &t : workers_) t.join();
+}
+
+bool BZ2StreamDecoder::push(const std::byte *data, size_t size) {
+  in_.append((const char *)data, size);
+  if (!failed_) {
+    scan();
+  }
+  // keep a bounded number of decompressed blocks in flight
+  deliver(threads_ * 2);
+  return !aborted();
+}
+
+bool BZ2StreamDecoder::finish() {
+  if (!failed_ && block_begin_) {
+    // no end-of-stream marker: truncated stream, the serial decoder decides what can be recovered.
+    dispatch(*block_begin_, in_.size() * 8);
+    block_begin_.reset();
+  }
+  deliver(0);
+  if (aborted()) return false;
+
+  bool failed;
+  {
+    std::lock_guard lk(lock_);
+    failed = failed_ || header_level_ == 0;
+  }
+  if (failed) {
+    // corrupt or truncated stream, or a false block magic inside the compressed data.
+    // fall back to decompressing serially and pass on whatever has not been delivered yet.
+    std::string out = decompressBZ2((const std::byte *)in_.data(), in_.size(), abort_);
+    if (out.size() < delivered_bytes_ || out.empty()) return false;
+    if (out.size() > delivered_bytes_) {
+      handler_(delivered_bytes_ == 0 ? std::move(out) : out.substr(delivered_bytes_));
+    }
+  }
+  return !aborted();
+}
+
+void BZ2StreamDecoder::scan() {
+  const uint8_t *in = (const uint8_t *)in_.data();
+  if (header_level_ == 0) {
+    if (in_.size() < 4) return;
+    if (memcmp(in, "BZh", 3) != 0) {
+      failed_ = true;
+      return;
+    }
+    header_level_ = in[3];
+    scan_pos_ = 4;
+  }
+
+  for (; scan_pos_ < in_.size(); ++scan_pos_) {
+    window_ = (window_ << 8) | in[scan_pos_];
+    if (scan_pos_ < 9) continue;
+
+    // check the 8 bit offsets at which a magic can end inside this byte, earliest first.
+    for (int shift = 7; shift >= 0; --shift) {
+      const uint64_t magic = (window_ >> shift) & BZ2_MAGIC_MASK;
+      if (magic != BZ2_BLOCK_MAGIC && magic != BZ2_EOS_MAGIC) continue;
+
+      const uint64_t pos = (scan_pos_ + 1) * 8 - shift - 48;
+      if (block_begin_) {
+        dispatch(*block_begin_, pos);
+        block_begin_.reset();
+      }
+      if (magic == BZ2_BLOCK_MAGIC) {
+        if (next_header_ && *next_header_ + 4 <= pos / 8 && memcmp(in + *next_header_, "BZh", 3) == 0) {
+          header_level_ = in[*next_header_ + 3];
+        }
+        next_header_.reset();
+        block_begin_ = pos;
+      } else {
+        // concatenated streams start on the byte following the combined crc
+        next_header_ = (pos + 48 + 32 + 7) / 8;
+      }
+    }
+  }
+}
+
+void BZ2StreamDecoder::dispatch(uint64_t begin_bit, uint64_t end_bit) {
+  std::string stream = makeBZ2Stream((const uint8_t *)in_.data(), begin_bit, end_bit, header_level_);
+  {
+    std::lock_guard lk(lock_);
+    tasks_.push_back(std::move(stream));
+    results_.emplace_back();
+  }
+  if (workers_.size() < std::min<size_t>(threads_, tasks_.size())) {
+    workers_.emplace_back(&BZ2StreamDecoder::workerThread, this);
+  }
+  cv_.notify_all();
+}
+
+void BZ2StreamDecoder::deliver(size_t max_pending) {
+  while (!aborted()) {
+    std::string chunk;
+    {
+      std::unique_lock lk(lock_);
+      auto ready = [&]() { return failed_ || (delivered_ < results_.size() && results_[delivered_]); };
+      if (!ready()) {
+        if (results_.size() - delivered_ <= max_pending) break;
+        cv_.wait_for(lk, std::chrono::milliseconds(100), ready);
+        continue;
+      }
+      if (failed_) break;
+
+      chunk = std::move(*results_[delivered_]);
+      results_[delivered_].reset();
+      ++delivered_;
+    }
+    delivered_bytes_ += chunk.size();
+    handler_(std::move(chunk));
+  }
+}
+
+void BZ2StreamDecoder::workerThread() {
+  while (true) {
+    std::string stream;
+    size_t i;
+    {
+      std::unique_lock lk(lock_);
+      cv_.wait(lk, [&]() { return exit_ || failed_ || next_task_ < tasks_.size(); });
+      if (exit_ || failed_) break;
+      i = next_task_++;
+      stream = std::move(tasks_[i]);
+    }
+    std::string out = decompressBZ2((const std::byte *)stream.data(), stream.size(), abort_);
+    {
+      std::lock_guard lk(lock_);
+      if (out.empty()) failed_ = true;
+      results_[i] = std::move(out);
+    }
+    cv_.notify_all();
+  }
+}
+
+bool decompressBZ2(const std::byte *in, size_t in_size, const DecompressChunkHandler &handler,
+                   std::atomic<bool> *abort, int threads) {
+  if (threads <= 0) {
+    threads = std::max<int>(1, std::thread::hardware_concurrency());
+  }
+  if (threads == 1) {
+    std::string out = decompressBZ2(in, in_size, abort);
+    if (out.empty()) return false;
+    handler(std::move(out));
+    return true;
+  }
+
+  BZ2StreamDecoder decoder(handler, abort, threads);
+  return decoder.push(in, in_size) && decoder.finish();
+}
+
 void precise_nano_sleep(long sleep_ns) {
   const long estimate_ns = 1 * 1e6;  // 1ms
   struct timespec req = {.tv_nsec = estimate_ns};
@@ -1,8 +1,14 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
+#include <vector>
 
 enum class ReplyMsgType {
   Info,
@@ -24,11 +30,62 @@ std::string sha256(const std::string &str);
 void precise_nano_sleep(long sleep_ns);
 std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort = nullptr);
 std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort = nullptr);
+// decompress the independent bzip2 blocks of `in` on a pool of worker threads and hand
+// the decompressed data to `handler` in stream order as soon as each block is ready.
+typedef std::function<void(std::string &&chunk)> DecompressChunkHandler;
+bool decompressBZ2(const std::byte *in, size_t in_size, const DecompressChunkHandler &handler,
+                   std::atomic<bool> *abort = nullptr, int threads = 0);
 std::string getUrlWithoutQuery(const std::string &url);
 size_t getRemoteFileSize(const std::string &url, std::atomic<bool> *abort = nullptr);
 std::string httpGet(const std::string &url, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
+std::string httpGetRange(const std::string &url, size_t offset, size_t size, std::atomic<bool> *abort = nullptr);
 
 typedef std::function<void(uint64_t cur, uint64_t total, bool success)> DownloadProgressHandler;
 void installDownloadProgressHandler(DownloadProgressHandler);
 bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
 std::string formattedDataSize(size_t size);
+
+// incremental version of decompressBZ2: the compressed stream can be pushed piece by piece, e.g. while it
+// is being downloaded. complete blocks are decompressed on worker threads, the handler is called in
+// stream order from the thread calling push() and finish().
+class BZ2StreamDecoder {
+public:
+  BZ2StreamDecoder(const DecompressChunkHandler &handler, std::atomic<bool> *abort = nullptr, int threads = 0);
+  ~BZ2StreamDecoder();
+  bool push(const std::byte *data, size_t size);
+  inline bool push(const std::string &data) { return push((const std::byte *)data.data(), data.size()); }
+  // decompress the remaining blocks. returns false if the stream is corrupt or decompression was aborted.
+  bool finish();
+
+private:
+  void scan();
+  void dispatch(uint64_t begin_bit, uint64_t end_bit);
+  void deliver(size_t max_pending);
+  void workerThread();
+  inline bool aborted() const { return abort_ && *abort_; }
+
+  DecompressChunkHandler handler_;
+  std::atomic<bool> *abort_;
+  int threads_;
+  std::string in_;
+  size_t delivered_bytes_ = 0;
+
+  // block scanner state
+  size_t scan_pos_ = 0;
+  uint64_t window_ = 0;
+  char header_level_ = 0;
+  std::optional<uint64_t> block_begin_;
+  std::optional<uint64_t> next_header_;
+
+  std::mutex lock_;
+  std::condition_variable cv_;
+  std::vector<std::thread> workers_;
+  // set by the scanner and the workers, the workers set it with lock_ held
+  std::atomic<bool> failed_ = false;
+  // the following variables must be protected with lock_
+  std::deque<std::string> tasks_;
+  std::vector<std::optional<std::string>> results_;
+  size_t next_task_ = 0;
+  size_t delivered_ = 0;
+  bool exit_ = false;
+};